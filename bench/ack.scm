@@ -0,0 +1,9 @@
+; Ackermann function: mixes tail and non-tail self calls.
+; expect: 2045
+(letrec ([ack (lambda (m n)
+                (if (fx= m 0)
+                    (fx+ n 1)
+                    (if (fx= n 0)
+                        (ack (fx- m 1) 1)
+                        (ack (fx- m 1) (ack m (fx- n 1))))))])
+  (ack 3 8))
@@ -0,0 +1,499 @@
+// Benchmark driver. Compiles each benchmark program, links it against the
+// runtime and runs it several times, recording compile time, assemble/link
+// time and run time (median of N runs, plus CPU cycles when perf_event_open is
+// available).
+//
+// Build (from this directory):
+//   g++ -std=c++17 -O2 -pthread -I.. bench.cpp ../emit.cpp ../parse.cpp
+//       ../stats.cpp ../cache.cpp ../module.cpp ../threads.cpp
+//       ../peephole.cpp -o bench
+//
+// Usage:
+//   ./bench [--runs N] [--csv FILE | --json FILE] [--runtime PATH]
+//           [--work-dir DIR] [--cache-dir DIR] [--codegen-threads N]
+//           [--threads N] [--no-peephole] [--safe] [program.scm ...]
+//
+// Without program arguments, all *.scm files in the current directory are
+// run. Each program file holds a single expression; a "; expect: <output>"
+// comment line gives the output the program must print.
+//
+// With --threads N, the programs are instead compiled on N threads at once,
+// --runs times each per thread, and the code has to be byte-identical to what
+// a single compilation emits. --codegen-threads emits the procedures of each
+// program on N threads (see SetCodegenThreads).
+//
+// The instruction counts compare the code with what is emitted without the
+// peephole optimizer, which --no-peephole turns off for the runs.
+//
+// --safe compiles the programs in safe mode (see EnableSafeMode); the checks
+// columns count the checks in each program and the ones tag inference left
+// out.
+
+#include "cache.h"
+#include "defs.h"
+#include "emit.h"
+#include "parse.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sstream>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// The runtime has no garbage collector; give benchmarks room to allocate.
+const char *BenchHeapSize = "4G";
+const char *BenchStackSize = "256M";
+
+// Set by --no-peephole.
+bool gUsePeephole = true;
+
+struct TBenchProgram {
+    string name;
+    // The file's path and text, and the text normalized.
+    string path;
+    string text;
+    string source;
+    string expectedOutput;
+};
+
+struct TBenchResult {
+    string name;
+    double compileMs;
+    double linkMs;
+    double runMsMedian;
+    double runMsMin;
+    // -1 when cycle counting isn't available.
+    long cyclesMedian;
+    // Instructions emitted, and emitted without the peephole optimizer.
+    long numInstructions;
+    long numUnoptimizedInstructions;
+    // Safety checks emitted and elided; 0 without --safe.
+    long numChecks;
+    long numElidedChecks;
+    bool outputOk;
+};
+
+bool ReadBenchProgram(const string &path, TBenchProgram *outProgram) {
+    ifstream file(path);
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    ostringstream textOS;
+    textOS << file.rdbuf();
+    auto text = textOS.str();
+
+    const string expectMarker = "; expect: ";
+    auto expectPos = text.find(expectMarker);
+
+    if (expectPos != string::npos) {
+        auto lineEnd = text.find('\n', expectPos);
+        outProgram->expectedOutput =
+            text.substr(expectPos + expectMarker.size(),
+                        lineEnd - expectPos - expectMarker.size());
+    }
+
+    auto slash = path.find_last_of('/');
+    auto base = slash == string::npos ? path : path.substr(slash + 1);
+    outProgram->name = base.substr(0, base.find('.'));
+    outProgram->path = path;
+    outProgram->text = text;
+    outProgram->source = NormalizeSource(text);
+
+    return true;
+}
+
+double MsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+        .count();
+}
+
+long OpenCycleCounter(pid_t pid) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+// Runs binary once, capturing its standard output. The child waits on a pipe
+// until the parent has attached the cycle counter, which starts counting at
+// exec.
+bool RunOnce(const string &binary, string *outOutput, double *outMs,
+             long *outCycles) {
+    int goPipe[2];
+    int outPipe[2];
+
+    if (pipe(goPipe) != 0 || pipe(outPipe) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        char go;
+        close(goPipe[1]);
+        close(outPipe[0]);
+        read(goPipe[0], &go, 1);
+        dup2(outPipe[1], STDOUT_FILENO);
+        setenv("SIL_HEAP_SIZE", BenchHeapSize, 1);
+        setenv("SIL_STACK_SIZE", BenchStackSize, 1);
+        execl(binary.c_str(), binary.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+
+    close(goPipe[0]);
+    close(outPipe[1]);
+
+    long counterFd = OpenCycleCounter(pid);
+    auto start = chrono::steady_clock::now();
+    write(goPipe[1], "g", 1);
+    close(goPipe[1]);
+
+    string output;
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(outPipe[0], buf, sizeof(buf))) > 0) {
+        output.append(buf, n);
+    }
+
+    close(outPipe[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    *outMs = MsSince(start);
+    *outCycles = -1;
+
+    if (counterFd >= 0) {
+        long long cycles;
+
+        if (read(counterFd, &cycles, sizeof(cycles)) == sizeof(cycles)) {
+            *outCycles = cycles;
+        }
+
+        close(counterFd);
+    }
+
+    if (!output.empty() && output.back() == '\n') {
+        output.pop_back();
+    }
+
+    *outOutput = output;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template <typename T> T Median(vector<T> values) {
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+bool RunBenchmark(const TBenchProgram &program, const string &workDir,
+                  const string &runtimeObj, int numRuns,
+                  TBenchResult *outResult) {
+    outResult->name = program.name;
+
+    auto start = chrono::steady_clock::now();
+    auto programAsm = EmitProgram(program.source, program.path, program.text);
+    outResult->compileMs = MsSince(start);
+    outResult->numInstructions = CountAsmInstructions(programAsm);
+    CountSafetyChecks(programAsm, &outResult->numChecks,
+                      &outResult->numElidedChecks);
+    EnablePeephole(false);
+    outResult->numUnoptimizedInstructions =
+        CountAsmInstructions(EmitProgram(program.source));
+    EnablePeephole(gUsePeephole);
+
+    auto asmPath = workDir + "/" + program.name + ".s";
+    auto binaryPath = workDir + "/" + program.name + ".out";
+    ofstream asmOS(asmPath);
+    asmOS << programAsm;
+    asmOS.close();
+
+    start = chrono::steady_clock::now();
+    auto linkCmd = "gcc " + asmPath + " " + runtimeObj + " -o " + binaryPath;
+
+    if (system(linkCmd.c_str()) != 0) {
+        cerr << program.name << ": assembling/linking failed.\n";
+        return false;
+    }
+
+    outResult->linkMs = MsSince(start);
+
+    vector<double> runMs;
+    vector<long> cycles;
+    outResult->outputOk = true;
+
+    for (int i = 0; i < numRuns; ++i) {
+        string output;
+        double ms;
+        long runCycles;
+
+        if (!RunOnce(binaryPath, &output, &ms, &runCycles)) {
+            cerr << program.name << ": run failed.\n";
+            outResult->outputOk = false;
+        }
+
+        if (!program.expectedOutput.empty() &&
+            output != program.expectedOutput) {
+            cerr << program.name << ": expected " << program.expectedOutput
+                 << ", got " << output << "\n";
+            outResult->outputOk = false;
+        }
+
+        runMs.push_back(ms);
+
+        if (runCycles >= 0) {
+            cycles.push_back(runCycles);
+        }
+    }
+
+    outResult->runMsMedian = Median(runMs);
+    outResult->runMsMin = *min_element(runMs.begin(), runMs.end());
+    outResult->cyclesMedian = cycles.size() == runMs.size() ? Median(cycles)
+                                                           : -1;
+    return true;
+}
+
+// Compiles the programs concurrently, with and without line info, and checks
+// the code against what serial compilations emit.
+bool CheckConcurrentCompilation(const vector<TBenchProgram> &programs,
+                                int numThreads, int numRuns) {
+    vector<string> expectedAsm;
+
+    for (const auto &program : programs) {
+        expectedAsm.push_back(EmitProgram(program.source));
+        expectedAsm.push_back(
+            EmitProgram(program.source, program.name + ".scm"));
+    }
+
+    atomic<long> numMismatches(0);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int run = 0; run < numRuns; ++run) {
+                // Start at a different program on each thread, so that
+                // different programs are compiled at the same time.
+                for (int i = 0; i < programs.size(); ++i) {
+                    auto idx = (i + t) % programs.size();
+                    const auto &program = programs[idx];
+
+                    if (EmitProgram(program.source) != expectedAsm[2 * idx] ||
+                        EmitProgram(program.source, program.name + ".scm") !=
+                            expectedAsm[2 * idx + 1]) {
+                        ++numMismatches;
+                        cerr << program.name << ": thread " << t
+                             << " emitted different code.\n";
+                    }
+                }
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    cout << "Compiled " << programs.size() << " programs " << numRuns
+         << " times on each of " << numThreads << " threads in "
+         << MsSince(start) << " ms: " << numMismatches.load()
+         << " mismatches.\n";
+
+    return numMismatches == 0;
+}
+
+void WriteCsv(ostream &os, const vector<TBenchResult> &results) {
+    os << "benchmark,compile_ms,link_ms,run_ms_median,run_ms_min,"
+          "cycles_median,instructions,instructions_no_peephole,checks,"
+          "checks_elided,output_ok\n";
+
+    for (const auto &r : results) {
+        os << r.name << "," << r.compileMs << "," << r.linkMs << ","
+           << r.runMsMedian << "," << r.runMsMin << ","
+           << (r.cyclesMedian >= 0 ? to_string(r.cyclesMedian) : "") << ","
+           << r.numInstructions << "," << r.numUnoptimizedInstructions << ","
+           << r.numChecks << "," << r.numElidedChecks << ","
+           << (r.outputOk ? "true" : "false") << "\n";
+    }
+}
+
+void WriteJson(ostream &os, const vector<TBenchResult> &results) {
+    os << "[\n";
+
+    for (int i = 0; i < results.size(); ++i) {
+        const auto &r = results[i];
+        os << "  {\"benchmark\": \"" << r.name << "\", "
+           << "\"compile_ms\": " << r.compileMs << ", "
+           << "\"link_ms\": " << r.linkMs << ", "
+           << "\"run_ms_median\": " << r.runMsMedian << ", "
+           << "\"run_ms_min\": " << r.runMsMin << ", "
+           << "\"cycles_median\": "
+           << (r.cyclesMedian >= 0 ? to_string(r.cyclesMedian) : "null")
+           << ", "
+           << "\"instructions\": " << r.numInstructions << ", "
+           << "\"instructions_no_peephole\": "
+           << r.numUnoptimizedInstructions << ", "
+           << "\"checks\": " << r.numChecks << ", "
+           << "\"checks_elided\": " << r.numElidedChecks << ", "
+           << "\"output_ok\": " << (r.outputOk ? "true" : "false") << "}"
+           << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    os << "]\n";
+}
+
+vector<string> ListScmFiles(const string &dir) {
+    vector<string> paths;
+    auto dirHandle = opendir(dir.c_str());
+
+    if (dirHandle == nullptr) {
+        return paths;
+    }
+
+    while (auto entry = readdir(dirHandle)) {
+        string name = entry->d_name;
+
+        if (name.size() > 4 && name.substr(name.size() - 4) == ".scm") {
+            paths.push_back(dir + "/" + name);
+        }
+    }
+
+    closedir(dirHandle);
+    sort(paths.begin(), paths.end());
+    return paths;
+}
+
+int main(int argc, char *argv[]) {
+    int numRuns = 5;
+    int numThreads = 0;
+    string csvPath;
+    string jsonPath;
+    string runtimePath = "../runtime.c";
+    string workDir = "bench-work";
+    vector<string> programPaths;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--runs" && hasValue) {
+            numRuns = max(1, atoi(argv[++i]));
+        } else if (arg == "--csv" && hasValue) {
+            csvPath = argv[++i];
+        } else if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else if (arg == "--runtime" && hasValue) {
+            runtimePath = argv[++i];
+        } else if (arg == "--work-dir" && hasValue) {
+            workDir = argv[++i];
+        } else if (arg == "--cache-dir" && hasValue) {
+            EnableCompileCache(argv[++i]);
+        } else if (arg == "--codegen-threads" && hasValue) {
+            SetCodegenThreads(atoi(argv[++i]));
+        } else if (arg == "--no-peephole") {
+            gUsePeephole = false;
+            EnablePeephole(false);
+        } else if (arg == "--safe") {
+            EnableSafeMode(true);
+        } else if (arg == "--threads" && hasValue) {
+            numThreads = max(1, atoi(argv[++i]));
+        } else if (arg.size() > 0 && arg[0] == '-') {
+            cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            programPaths.push_back(arg);
+        }
+    }
+
+    if (programPaths.empty()) {
+        programPaths = ListScmFiles(".");
+    }
+
+    if (numThreads > 0) {
+        vector<TBenchProgram> programs;
+
+        for (const auto &path : programPaths) {
+            programs.emplace_back();
+
+            if (!ReadBenchProgram(path, &programs.back())) {
+                cerr << "Cannot open benchmark " << path << ".\n";
+                return 1;
+            }
+        }
+
+        return CheckConcurrentCompilation(programs, numThreads, numRuns) ? 0
+                                                                         : 1;
+    }
+
+    mkdir(workDir.c_str(), 0755);
+    auto runtimeObj = workDir + "/runtime.o";
+    auto runtimeCmd = "gcc -O2 -c " + runtimePath + " -o " + runtimeObj;
+
+    if (system(runtimeCmd.c_str()) != 0) {
+        cerr << "Couldn't compile the runtime.\n";
+        return 1;
+    }
+
+    vector<TBenchResult> results;
+    bool allOk = true;
+
+    for (const auto &path : programPaths) {
+        TBenchProgram program;
+
+        if (!ReadBenchProgram(path, &program)) {
+            cerr << "Cannot open benchmark " << path << ".\n";
+            return 1;
+        }
+
+        TBenchResult result;
+
+        if (!RunBenchmark(program, workDir, runtimeObj, numRuns, &result)) {
+            allOk = false;
+            continue;
+        }
+
+        allOk = allOk && result.outputOk;
+        results.push_back(result);
+    }
+
+    if (!csvPath.empty()) {
+        ofstream csvOS(csvPath);
+        WriteCsv(csvOS, results);
+    }
+
+    if (!jsonPath.empty()) {
+        ofstream jsonOS(jsonPath);
+        WriteJson(jsonOS, results);
+    }
+
+    if (csvPath.empty() && jsonPath.empty()) {
+        WriteCsv(cout, results);
+    }
+
+    return allOk ? 0 : 1;
+}
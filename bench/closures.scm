@@ -0,0 +1,10 @@
+; Creates and calls short-lived closures in a loop.
+; expect: 20000300000
+(letrec ([makeadder (lambda (n) (lambda (x) (fx+ x n)))]
+         [compose (lambda (f g) (lambda (x) (f (g x))))]
+         [loop (lambda (i acc)
+                 (if (fx= i 0)
+                     acc
+                     (loop (fx- i 1)
+                           ((compose (makeadder i) (makeadder 1)) acc))))])
+  (loop 200000 0))
@@ -0,0 +1,7 @@
+; Doubly recursive Fibonacci: non-tail calls and fixnum arithmetic.
+; expect: 832040
+(letrec ([fib (lambda (n)
+                (if (fx< n 2)
+                    n
+                    (fx+ (fib (fx- n 1)) (fib (fx- n 2)))))])
+  (fib 30))
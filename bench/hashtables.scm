@@ -0,0 +1,24 @@
+; Inserts, looks up and deletes fixnum keys in eq hashtables.
+; expect: 6000000000
+(letrec ([fill (lambda (t i n)
+                 (if (fx= i n)
+                     t
+                     (begin
+                       (hashtable-set! t i (fx* i 3))
+                       (fill t (fxadd1 i) n))))]
+         [drop (lambda (t i n)
+                 (if (fx>= i n)
+                     t
+                     (begin
+                       (hashtable-delete! t i)
+                       (drop t (fx+ i 2) n))))]
+         [sum (lambda (t i n acc)
+                (if (fx= i n)
+                    acc
+                    (sum t (fxadd1 i) n (fx+ acc (hashtable-ref t i 0)))))]
+         [rep (lambda (k acc)
+                (if (fx= k 0)
+                    acc
+                    (rep (fx- k 1)
+                         (fx+ acc (sum (drop (fill (make-eq-hashtable) 0 20000) 0 20000) 0 20000 0)))))])
+  (rep 20 0))
@@ -0,0 +1,24 @@
+; Looks symbols up in a quoted association list and sums the chars of a
+; string literal.
+; expect: 758000000
+(letrec ([lookup (lambda (key alist)
+                   (if (eq? key (car (car alist)))
+                       (cdr (car alist))
+                       (lookup key (cdr alist))))]
+         [colors (lambda ()
+                   '((red . 1) (green . 2) (blue . 3)
+                     (cyan . 4) (magenta . 5) (yellow . 6)))]
+         [chars (lambda (s i acc)
+                  (if (fx= i (string-length s))
+                      acc
+                      (chars s (fxadd1 i)
+                             (fx+ acc (char->fixnum (string-ref s i))))))]
+         [rep (lambda (k acc)
+                (if (fx= k 0)
+                    acc
+                    (rep (fx- k 1)
+                         (fx+ acc
+                              (fx+ (lookup 'yellow (colors))
+                                   (fx+ (lookup 'blue (colors))
+                                        (chars "literal" 0 0)))))))])
+  (rep 1000000 0))
@@ -0,0 +1,26 @@
+; Counts the solutions of the 10 queens problem by backtracking over lists.
+; expect: 724
+(letrec ([iota (lambda (n acc)
+                 (if (fx= n 0)
+                     acc
+                     (iota (fx- n 1) (cons n acc))))]
+         [append (lambda (a b)
+                   (if (null? a)
+                       b
+                       (cons (car a) (append (cdr a) b))))]
+         [safe (lambda (row dist placed)
+                 (if (null? placed)
+                     #t
+                     (if (fx= (car placed) (fx+ row dist))
+                         #f
+                         (if (fx= (car placed) (fx- row dist))
+                             #f
+                             (safe row (fx+ dist 1) (cdr placed))))))]
+         [try (lambda (x y z)
+                (if (null? x)
+                    (if (null? y) 1 0)
+                    (fx+ (if (safe (car x) 1 z)
+                             (try (append (cdr x) y) () (cons (car x) z))
+                             0)
+                         (try (cdr x) (cons (car x) y) z))))])
+  (try (iota 10 ()) () ()))
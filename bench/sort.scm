@@ -0,0 +1,41 @@
+; Merge sort of a pseudo-random list, followed by a sortedness check.
+; expect: #t
+(letrec ([gen (lambda (n seed acc)
+                (if (fx= n 0)
+                    acc
+                    (gen (fx- n 1)
+                         (fxlogand (fx+ (fx* seed 1103515245) 12345) 1048575)
+                         (cons seed acc))))]
+         [merge (lambda (a b)
+                  (if (null? a)
+                      b
+                      (if (null? b)
+                          a
+                          (if (fx< (car b) (car a))
+                              (cons (car b) (merge a (cdr b)))
+                              (cons (car a) (merge (cdr a) b))))))]
+         [odds (lambda (l)
+                 (if (null? l)
+                     ()
+                     (if (null? (cdr l))
+                         l
+                         (cons (car l) (odds (cdr (cdr l)))))))]
+         [evens (lambda (l)
+                  (if (null? l)
+                      ()
+                      (odds (cdr l))))]
+         [sort (lambda (l)
+                 (if (null? l)
+                     l
+                     (if (null? (cdr l))
+                         l
+                         (merge (sort (odds l)) (sort (evens l))))))]
+         [sorted (lambda (l)
+                   (if (null? l)
+                       #t
+                       (if (null? (cdr l))
+                           #t
+                           (if (fx< (car (cdr l)) (car l))
+                               #f
+                               (sorted (cdr l))))))])
+  (sorted (sort (gen 20000 42 ()))))
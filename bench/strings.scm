@@ -0,0 +1,18 @@
+; Builds strings character by character and checksums them.
+; expect: 208936000
+(letrec ([fill (lambda (s i n)
+                 (if (fx= i n)
+                     s
+                     (begin
+                       (string-set! s i (fixnum->char (fx+ 97 (fxlogand i 15))))
+                       (fill s (fxadd1 i) n))))]
+         [sum (lambda (s i acc)
+                (if (fx= i (string-length s))
+                    acc
+                    (sum s (fxadd1 i) (fx+ acc (char->fixnum (string-ref s i))))))]
+         [build (lambda (k acc)
+                  (if (fx= k 0)
+                      acc
+                      (build (fx- k 1)
+                             (fx+ acc (sum (fill (make-string 1000) 0 1000) 0 0)))))])
+  (build 2000 0))
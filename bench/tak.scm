@@ -0,0 +1,9 @@
+; Takeuchi function: deep non-tail recursion with three arguments.
+; expect: 9
+(letrec ([tak (lambda (x y z)
+                (if (not (fx< y x))
+                    z
+                    (tak (tak (fx- x 1) y z)
+                         (tak (fx- y 1) z x)
+                         (tak (fx- z 1) x y))))])
+  (tak 24 16 8))
@@ -0,0 +1,18 @@
+; Fills and sums vectors with counted loops.
+; expect: 665667000000
+(letrec ([fill (lambda (v i n)
+                 (if (fx= i n)
+                     v
+                     (begin
+                       (vector-set! v i (fx* i i))
+                       (fill v (fxadd1 i) n))))]
+         [sum (lambda (v i n acc)
+                (if (fx= i n)
+                    acc
+                    (sum v (fxadd1 i) n (fx+ acc (vector-ref v i)))))]
+         [rep (lambda (k acc)
+                (if (fx= k 0)
+                    acc
+                    (rep (fx- k 1)
+                         (fx+ acc (sum (fill (make-vector 1000) 0 1000) 0 1000 0)))))])
+  (rep 2000 0))
@@ -0,0 +1,217 @@
+#include "cache.h"
+
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static string gCacheDir;
+// Entries kept in memory, in front of the directory, by long-running
+// compilers. They are evicted oldest first once they take more than the
+// budget.
+static long gMemoryCacheBudget = 0;
+static mutex gMemoryCacheMutex;
+static unordered_map<string, string> gMemoryCache;
+static deque<string> gMemoryCacheKeys;
+static long gMemoryCacheBytes = 0;
+static atomic<long> gNumHits(0);
+static atomic<long> gNumMisses(0);
+// Numbers the temporary files entries are written to.
+static atomic<long> gNumTmpFiles(0);
+
+void EnableCompileCache(string cacheDir) {
+    gCacheDir = cacheDir;
+
+    if (!gCacheDir.empty()) {
+        mkdir(gCacheDir.c_str(), 0755);
+    }
+}
+
+void EnableMemoryCompileCache(long maxBytes) { gMemoryCacheBudget = maxBytes; }
+
+bool IsCompileCacheEnabled() {
+    return !gCacheDir.empty() || gMemoryCacheBudget > 0;
+}
+
+// 64-bit FNV-1a. Entries store their full key, so collisions only cost a miss.
+static unsigned long HashBytes(const char *data, size_t size,
+                               unsigned long hash = 0xcbf29ce484222325UL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3UL;
+    }
+
+    return hash;
+}
+
+static string ToHex(unsigned long value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016lx", value);
+    return buf;
+}
+
+static string ComputeCompilerVersion() {
+    // The running executable's contents, so that any rebuild of the
+    // compiler invalidates the cache.
+    ifstream exe("/proc/self/exe", ios::binary);
+
+    if (!exe.is_open()) {
+        return string(__DATE__) + " " + __TIME__;
+    }
+
+    ostringstream contentsOS;
+    contentsOS << exe.rdbuf();
+    auto contents = contentsOS.str();
+
+    return ToHex(HashBytes(contents.data(), contents.size()));
+}
+
+string CompilerVersion() {
+    static const string version = ComputeCompilerVersion();
+    return version;
+}
+
+string NormalizeCacheKeySource(const string &source) {
+    string normalized;
+    bool pendingSpace = false;
+
+    for (auto c : source) {
+        if (isspace(static_cast<unsigned char>(c))) {
+            pendingSpace = !normalized.empty();
+            continue;
+        }
+
+        if (pendingSpace) {
+            auto prev = normalized.back();
+
+            if (prev != '(' && prev != '[' && c != ')' && c != ']') {
+                normalized += ' ';
+            }
+
+            pendingSpace = false;
+        }
+
+        normalized += c;
+    }
+
+    return normalized;
+}
+
+static string EntryPath(const string &key) {
+    return gCacheDir + "/" + ToHex(HashBytes(key.data(), key.size())) + ".s";
+}
+
+// An entry is the key's length and the key, followed by the code.
+static bool LookUpCacheFile(const string &key, string *outCode) {
+    ifstream entry(EntryPath(key), ios::binary);
+    size_t keySize;
+
+    if (!entry.is_open() || !(entry >> keySize) || entry.get() != '\n') {
+        return false;
+    }
+
+    string entryKey(keySize, '\0');
+
+    if (!entry.read(&entryKey[0], keySize) || entryKey != key) {
+        return false;
+    }
+
+    ostringstream codeOS;
+    codeOS << entry.rdbuf();
+    *outCode = codeOS.str();
+    return true;
+}
+
+static void StoreInCacheFile(const string &key, const string &code) {
+    auto path = EntryPath(key);
+    // Write to a private file first, so readers never see a partial entry.
+    auto tmpPath = path + ".tmp" + to_string(getpid()) + "." +
+                   to_string(gNumTmpFiles++);
+
+    {
+        ofstream entry(tmpPath, ios::binary);
+        entry << key.size() << "\n" << key << code;
+
+        if (!entry.good()) {
+            entry.close();
+            remove(tmpPath.c_str());
+            return;
+        }
+    }
+
+    rename(tmpPath.c_str(), path.c_str());
+}
+
+static bool LookUpInMemory(const string &key, string *outCode) {
+    lock_guard<mutex> lock(gMemoryCacheMutex);
+    auto entry = gMemoryCache.find(key);
+
+    if (entry == gMemoryCache.end()) {
+        return false;
+    }
+
+    *outCode = entry->second;
+    return true;
+}
+
+static void StoreInMemory(const string &key, const string &code) {
+    lock_guard<mutex> lock(gMemoryCacheMutex);
+
+    if (!gMemoryCache.emplace(key, code).second) {
+        return;
+    }
+
+    gMemoryCacheKeys.push_back(key);
+    gMemoryCacheBytes += key.size() + code.size();
+
+    while (gMemoryCacheBytes > gMemoryCacheBudget) {
+        auto oldest = gMemoryCache.find(gMemoryCacheKeys.front());
+        gMemoryCacheBytes -= oldest->first.size() + oldest->second.size();
+        gMemoryCache.erase(oldest);
+        gMemoryCacheKeys.pop_front();
+    }
+}
+
+bool LookUpCompileCache(const string &key, string *outCode) {
+    bool inMemory = gMemoryCacheBudget > 0;
+
+    if (inMemory && LookUpInMemory(key, outCode)) {
+        ++gNumHits;
+        return true;
+    }
+
+    if (gCacheDir.empty() || !LookUpCacheFile(key, outCode)) {
+        ++gNumMisses;
+        return false;
+    }
+
+    if (inMemory) {
+        StoreInMemory(key, *outCode);
+    }
+
+    ++gNumHits;
+    return true;
+}
+
+void StoreInCompileCache(const string &key, const string &code) {
+    if (gMemoryCacheBudget > 0) {
+        StoreInMemory(key, code);
+    }
+
+    if (!gCacheDir.empty()) {
+        StoreInCacheFile(key, code);
+    }
+}
+
+void TakeCompileCacheStats(long *outHits, long *outMisses) {
+    *outHits = gNumHits.exchange(0);
+    *outMisses = gNumMisses.exchange(0);
+}
@@ -0,0 +1,31 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string>
+
+// On-disk cache of emitted code, one file per entry in the cache directory.
+// Keys are arbitrary text; entries are only ever replaced as a whole, so
+// several compilers can share a directory.
+
+// An empty directory disables the cache.
+void EnableCompileCache(std::string cacheDir);
+// Also keeps up to maxBytes of entries in memory, for compilers that run for
+// long; 0, the default, disables it. The directory is optional then.
+void EnableMemoryCompileCache(long maxBytes);
+bool IsCompileCacheEnabled();
+
+// Identifies the compiler build; part of every key, so entries written by
+// another build are never used.
+std::string CompilerVersion();
+
+// Collapses whitespace runs into one space and drops the spaces next to
+// parentheses and brackets, so keys don't change with formatting.
+std::string NormalizeCacheKeySource(const std::string &source);
+
+bool LookUpCompileCache(const std::string &key, std::string *outCode);
+void StoreInCompileCache(const std::string &key, const std::string &code);
+
+// Lookups that found and didn't find an entry since the last call.
+void TakeCompileCacheStats(long *outHits, long *outMisses);
+
+#endif
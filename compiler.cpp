@@ -1,11 +1,16 @@
+#include "cache.h"
 #include "defs.h"
 #include "emit.h"
 #include "parse.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -39,8 +44,99 @@ string Exec(const char *cmd) {
     return result.substr(0, result.size() - 1);
 }
 
+void PrintPhaseStats(const vector<TPhaseStats> &phaseStats) {
+    cout << "\t " << left << setw(32) << "Phase" << right << setw(6) << "Runs"
+         << setw(12) << "Wall (ms)" << setw(10) << "Allocs" << setw(14)
+         << "Alloc (KiB)" << setw(14) << "Peak (KiB)" << setw(14)
+         << "RSS (KiB)" << "\n";
+
+    for (const auto &phase : phaseStats) {
+        cout << "\t " << left << setw(32)
+             << (string(phase.depth * 2, ' ') + phase.name) << right
+             << setw(6) << phase.count << setw(12) << fixed
+             << setprecision(3) << phase.wallMs << setw(10)
+             << phase.numAllocs << setw(14) << (phase.allocBytes / 1024)
+             << setw(14) << (phase.peakLiveBytes / 1024) << setw(14)
+             << phase.peakRssKb << "\n";
+    }
+
+    cout << "\n";
+}
+
+void PrintInstructionStats(const map<string, long> &instructionStats) {
+    vector<pair<string, long>> sortedStats(instructionStats.begin(),
+                                           instructionStats.end());
+    sort(sortedStats.begin(), sortedStats.end(),
+         [](const pair<string, long> &a, const pair<string, long> &b) {
+             return a.second > b.second;
+         });
+
+    long total = 0;
+
+    for (const auto &s : sortedStats) {
+        total += s.second;
+    }
+
+    cout << "\nEmitted instructions by expression kind:\n";
+
+    for (const auto &s : sortedStats) {
+        cout << "\t " << left << setw(16) << s.first << right << setw(10)
+             << s.second << setw(8) << fixed << setprecision(1)
+             << (total > 0 ? 100.0 * s.second / total : 0.0) << "%\n";
+    }
+
+    cout << "\t " << left << setw(16) << "total" << right << setw(10) << total
+         << "\n";
+}
+
+// Usage: compiler [--time-phases] [--stats] [--profile-allocs]
+//                 [--cache-dir DIR] [--no-peephole] [--safe] [test-file ...]
+//
+// --time-phases: report wall time, allocations and peak memory per compiler
+//   phase (and per top-level letrec lambda) for every test case.
+// --stats: report emitted instruction counts per primitive over all test
+//   cases.
+// --profile-allocs: compile test programs with allocation profiling; each
+//   program prints its per-site allocation counts to stderr when it exits.
+// --cache-dir DIR: reuse the code emitted for unchanged top-level letrec
+//   lambdas across runs, keeping it in DIR.
+// --no-peephole: emit code without the peephole optimizer.
+// --safe: compile test programs in safe mode, and report how many checks each
+//   one has and how many tag inference left out. The error a failed check
+//   reports counts as the program's output, e.g. in tests/safe-mode.scm.
 int main(int argc, char *argv[]) {
-    vector<string> testFilePaths{
+    vector<string> testFilePaths;
+    bool printStats = false;
+    bool safeMode = false;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+
+        if (arg == "--time-phases") {
+            EnablePhaseTiming(true);
+        } else if (arg == "--stats") {
+            printStats = true;
+            EnableInstructionStats(true);
+        } else if (arg == "--profile-allocs") {
+            EnableAllocationProfiling(true);
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            EnableCompileCache(argv[++i]);
+        } else if (arg == "--no-peephole") {
+            EnablePeephole(false);
+        } else if (arg == "--safe") {
+            safeMode = true;
+            EnableSafeMode(true);
+        } else if (arg == "--codegen-threads" && i + 1 < argc) {
+            SetCodegenThreads(atoi(argv[++i]));
+        } else if (arg.size() > 0 && arg[0] == '-') {
+            cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            testFilePaths.push_back(arg);
+        }
+    }
+
+    vector<string> defaultTestFilePaths{
         "/home/ergawy/repos/inc-compiler/src/tests-1.1-req.scm",
         "/home/ergawy/repos/inc-compiler/src/tests-1.2-req.scm",
         "/home/ergawy/repos/inc-compiler/src/tests-1.3-req.scm",
@@ -57,6 +153,10 @@ int main(int argc, char *argv[]) {
         "/home/ergawy/repos/inc-compiler/src/tests-2.2-req.scm",
     };
 
+    if (testFilePaths.empty()) {
+        testFilePaths = defaultTestFilePaths;
+    }
+
     int testCaseCounter = 1;
     int failedTestCaseCounter = 0;
 
@@ -116,7 +216,8 @@ int main(int argc, char *argv[]) {
                 programSourceOutputStream << " " << nextProgramSubString;
             }
 
-            string programSource = programSourceOutputStream.str();
+            string programSource =
+                NormalizeSource(programSourceOutputStream.str());
 
             // Parse expected program output.
             ostringstream expectedResultOutputStream;
@@ -139,9 +240,23 @@ int main(int argc, char *argv[]) {
             expectedResult =
                 expectedResult.substr(1, expectedResult.size() - 4);
 
-            auto programAsm = EmitProgram(programSource);
-
             string testId = "test-" + to_string(testCaseCounter);
+            // The emitted line info refers to the program's source file.
+            ofstream(testId + ".scm") << programSource << "\n";
+            string programAsm;
+
+            try {
+                programAsm = EmitProgram(programSource, testId + ".scm");
+            } catch (const TCompileError &error) {
+                cout << "[TEST " << testCaseCounter << "]\n";
+                cout << programSource << "\n";
+                cout << "\t " << error.what() << "\n";
+                cout << "\033[1;31mFAILED\033[0m\n\n";
+                ++failedTestCaseCounter;
+                ++testCaseCounter;
+                continue;
+            }
+
             ofstream programAsmOutputStream(testId + ".s");
 
             if (!programAsmOutputStream.is_open()) {
@@ -152,10 +267,21 @@ int main(int argc, char *argv[]) {
             programAsmOutputStream << programAsm;
             programAsmOutputStream.close();
 
-            Exec(("gcc -g /home/ergawy/repos/sil-compiler/runtime.c " + testId +
-                  ".s -o " + testId + ".out")
-                     .c_str());
-            auto actualResult = Exec(("./" + testId + ".out").c_str());
+            {
+                TPhaseTimer phaseTimer("assemble+link");
+                Exec(("gcc -g /home/ergawy/repos/sil-compiler/runtime.c " +
+                      testId + ".s -o " + testId + ".out")
+                         .c_str());
+            }
+
+            string actualResult;
+
+            {
+                TPhaseTimer phaseTimer("run");
+                actualResult = Exec(
+                    ("./" + testId + ".out" + (safeMode ? " 2>&1" : ""))
+                        .c_str());
+            }
 
             cout << "[TEST " << testCaseCounter << "]\n";
             cout << programSource << "\n";
@@ -163,6 +289,14 @@ int main(int argc, char *argv[]) {
             cout << "\t Expected: " << expectedResult << "\n"
                  << "\t Actual  : " << actualResult << "\n";
 
+            if (safeMode) {
+                long numChecks;
+                long numElided;
+                CountSafetyChecks(programAsm, &numChecks, &numElided);
+                cout << "\t Checks  : " << numChecks << " emitted, "
+                     << numElided << " elided\n";
+            }
+
             if (actualResult == expectedResult) {
                 cout << "\033[1;32mOK\033[0m\n\n";
             } else {
@@ -170,10 +304,26 @@ int main(int argc, char *argv[]) {
                 ++failedTestCaseCounter;
             }
 
+            if (IsPhaseTimingEnabled()) {
+                PrintPhaseStats(TakePhaseStats());
+            }
+
             ++testCaseCounter;
         }
     }
 
+    if (printStats) {
+        PrintInstructionStats(TakeInstructionStats());
+    }
+
+    if (IsCompileCacheEnabled()) {
+        long hits;
+        long misses;
+        TakeCompileCacheStats(&hits, &misses);
+        cout << "\nCompile cache: " << hits << " hits, " << misses
+             << " misses\n";
+    }
+
     if (failedTestCaseCounter > 0) {
         cout << "\n\033[1;31mFailed/Total: " << failedTestCaseCounter << "/"
              << (testCaseCounter - 1) << "\033[0m\n";
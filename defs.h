@@ -1,7 +1,6 @@
 #ifndef DEFS_H
 #define DEFS_H
 
-#include <cmath>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -52,12 +51,38 @@ const unsigned int PairTag = 0x01;
 const unsigned int ClosureTag = 0x02;
 const unsigned int VectorTag = 0x05;
 const unsigned int StringTag = 0x06;
+// Boxed objects whose first word is a header identifying their type.
+const unsigned int ObjTag = 0x03;
+
+const unsigned int ObjTypeMask = 0xFF;
+const unsigned int FlonumType = 0x01;
+const unsigned int BignumType = 0x02;
+const unsigned int HashtableType = 0x03;
+const unsigned int SymbolType = 0x04;
 
 const int WordSize = 8;
 const int WordSizeLg2 = 3;
 
 const int FixNumBits = WordSize * 8 - FxShift;
-const long FxLower = -pow(2, FixNumBits - 1);
-const long FxUpper = pow(2, FixNumBits - 1) - 1;
+const long FxLower = -(1L << (FixNumBits - 1));
+const long FxUpper = (1L << (FixNumBits - 1)) - 1;
+
+// Safe mode: the types of values that primitives check their operands for,
+// and that tag inference knows values to have. runtime.c names a failed check
+// by the same numbers.
+enum class EValueType {
+    Unknown,
+    FixNum,
+    Char,
+    Pair,
+    Vector,
+    String,
+    Procedure
+};
+// A failed check of a vector or string index.
+const int IndexCheck = 7;
+// A failed check that the length make-vector or make-string is passed isn't
+// negative.
+const int LengthCheck = 11;
 
 #endif
@@ -1,13 +1,194 @@
 #include "emit.h"
+#include "cache.h"
 #include "parse.h"
+#include "peephole.h"
+#include "stats.h"
+#include "threads.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
 #include <sstream>
+#include <thread>
+#include <unordered_set>
 
 using namespace std;
 
-ostringstream gAllLambdasOS;
+// Line info. When the program has a source file, each expression's code is
+// preceded by a .loc directive with the expression's position in the source.
+// Expressions are plain strings, so a position is found by searching for the
+// expression's text within its parent's span, past the siblings found so far.
+// Spans are in the normalized program and mapped back to the file's lines
+// and columns through the offsets NormalizeSource gives.
+struct TSourceSpan {
+    size_t begin;
+    size_t end;
+    // Where to look for the next child expression.
+    size_t searchFrom;
+};
+
+// What the emitter knows about the program or module being compiled. Each
+// EmitProgram/EmitModule call has its own, so several can run at the same time
+// on different threads. It doesn't change while the program's procedures are
+// emitted, so that they can be emitted in parallel.
+struct TCompilation {
+    bool emitLineInfo = false;
+    string programSource;
+    // The source file's text, where in it each character of programSource
+    // comes from and where its lines start.
+    string sourceText;
+    vector<size_t> sourceOffsets;
+    vector<size_t> lineStarts;
+
+    // Qualifies the labels of a module's procedures, so that modules linked
+    // into the same program can use the same names. Empty outside of modules.
+    string modulePrefix;
+    TLambdaTable lambdaTable;
+    // Number of arguments of each procedure imported from another module,
+    // which calls are checked against.
+    unordered_map<string, int> importedProcNumArgs;
+
+    // Variables set! anywhere in the program, whose types tag inference
+    // doesn't track. Only found in safe mode.
+    unordered_set<string> assignedVars;
+};
+
+// A lambda whose code is still to be emitted.
+struct TPendingLambda {
+    string label;
+    // Describe the procedure to the profiler.
+    string procName;
+    string source;
+    vector<string> formalArgs;
+    string body;
+    TClosureEnvironment closEnv;
+    string labelScope;
+    // Where the lambda is in the source, with line info.
+    TSourceSpan span;
+    // The free variables of a lifted lambda, whose boxes it takes after its
+    // arguments.
+    vector<string> liftedFreeVars;
+    // Bound by the program's or module's letrec, rather than nested in one
+    // of its lambdas.
+    bool isTopLevel = false;
+};
+
+// A lambda bound by let and only ever called there, emitted as a procedure of
+// its own rather than made into a closure. Its calls go straight to label,
+// passing the boxes of freeVars after the arguments.
+struct TLiftedLambda {
+    string label;
+    vector<string> freeVars;
+};
+
+// lhs < rhs, or lhs <= rhs. The terms are fixnum literals, variables holding
+// fixnums and (vector-length v) or (string-length s) of variables. A fact with
+// an empty rhs marks where lhs is bound anew; the facts before it don't hold
+// for the new variable.
+struct TRangeFact {
+    string lhs;
+    string rhs;
+    bool isStrict;
+};
+
+// A self-recursive procedure that steps index through the elements of the
+// objects. Its check-free version, at fastLabel, is only entered with
+// 0 <= index <= bound <= the length of each object, bound being a parameter
+// or the length of one of the objects, and the objects of their types.
+struct TCountedLoop {
+    string procName;
+    vector<string> formalArgs;
+    string index;
+    string bound;
+    vector<pair<string, EValueType>> objs;
+    string fastLabel;
+};
+
+// State of the emission of one procedure's code.
+struct TEmission {
+    // Inclusive instruction counts of the sub-expressions emitted so far by
+    // each EmitExpr call in progress. Only maintained with instruction stats
+    // enabled.
+    vector<long> subExprInstructionCounts;
+
+    // Out-of-line slow paths (e.g. fixnum overflow handling) of the procedure
+    // currently being emitted. They are placed after the procedure's body so
+    // the fast paths fall through without taken branches.
+    ostringstream coldCodeOS;
+
+    // Label of the procedure being emitted, used to describe allocation sites.
+    string currentProcLabel = "scheme_entry";
+
+    // Spans of the expressions being emitted, innermost last.
+    vector<TSourceSpan> sourceSpans;
+
+    // Labels are numbered per scope. Each procedure has its own scope, so the
+    // code emitted for it doesn't depend on what was emitted before, which
+    // lets it be cached or emitted on another thread.
+    string labelScope;
+    unsigned int labelCount = 0;
+
+    // Lambdas found in the procedure's body. Their code is emitted once the
+    // procedure's is done, possibly in parallel.
+    vector<TPendingLambda> pendingLambdas;
+
+    // Safe mode. The types tag inference knows variables to have where code
+    // is being emitted, latest last; facts learnt in a branch are dropped
+    // when it ends.
+    vector<pair<string, EValueType>> typeFacts;
+    // What range analysis knows of the fixnums compared where code is being
+    // emitted, kept like the type facts.
+    vector<TRangeFact> rangeFacts;
+    // Labels of the out-of-line code reporting failed checks, shared by the
+    // procedure's checks.
+    unordered_map<string, string> checkFailedLabels;
+    // The counted loop whose check-free version is being emitted, if any.
+    TCountedLoop countedLoop;
+
+    // Literal data of the procedure, laid out after its code, and the tagged
+    // addresses of the objects laid out so far by their datum's text.
+    ostringstream literalDataOS;
+    unordered_map<string, string> literalLabels;
+
+    // The lifted lambdas of the let expressions being emitted, by the
+    // variable they aren't bound to.
+    unordered_map<string, TLiftedLambda> liftedLambdas;
+
+    // Where in the frame the cons, make-vector or lambda about to be emitted
+    // is laid out, as it doesn't outlive the frame; 0 to allocate it on the
+    // heap. See TakeStackObjectIdx.
+    int stackObjectIdx = 0;
+    // The slots of the boxes of the let-bound variables whose closures are in
+    // the frame, by name.
+    unordered_map<string, int> stackClosures;
+};
+
+// The compilation and procedure the calling thread is emitting code for.
+thread_local TCompilation* gCompilation = nullptr;
+thread_local TEmission* gEmission = nullptr;
+
+// Emits the lambdas of programs in parallel; null to emit them on the calling
+// thread.
+static unique_ptr<TThreadPool> gCodegenPool;
+
+// Allocation profiling: every allocation site gets a record in the
+// sil_alloc_sites section, which the emitted code updates on each allocation
+// and runtime.c dumps at exit.
+bool gAllocationProfilingEnabled = false;
+
+bool gPeepholeEnabled = true;
+
+// Safe mode: emitted checks, and the ones tag inference leaves out, are marked
+// with comments that CountSafetyChecks looks for.
+bool gSafeModeEnabled = false;
+const string CheckComment = "# Check: ";
+const string ElidedCheckComment = "# Check elided: ";
 
 string EmitExpr(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string expr,
@@ -15,8 +196,371 @@ string EmitExpr(int stackIdx, TEnvironment env,
                 int numFormalParamsInContainingLambda = -1);
 
 string UniqueLabel(string prefix = "") {
-    static unsigned int count = 0;
-    return prefix + "_L_" + to_string(count++);
+    return prefix + "_L_" + gEmission->labelScope +
+           to_string(gEmission->labelCount++);
+}
+
+// Turns a Scheme identifier into something usable in a label: characters
+// other than letters, digits and '_' become '$' and their hex code.
+string MangleName(string name) {
+    static const char* hexDigits = "0123456789abcdef";
+    string mangled;
+
+    for (auto c : name) {
+        if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+            mangled += c;
+        } else {
+            mangled += '$';
+            mangled += hexDigits[(c >> 4) & 0xF];
+            mangled += hexDigits[c & 0xF];
+        }
+    }
+
+    return mangled;
+}
+
+string DemangleName(string mangled) {
+    string name;
+
+    for (size_t i = 0; i < mangled.size(); ++i) {
+        if (mangled[i] == '$' && i + 2 < mangled.size()) {
+            name += static_cast<char>(stoi(mangled.substr(i + 1, 2), nullptr,
+                                           16));
+            i += 2;
+        } else {
+            name += mangled[i];
+        }
+    }
+
+    return name;
+}
+
+void SetCodegenThreads(int numThreads) {
+    gCodegenPool.reset(numThreads > 1 ? new TThreadPool(numThreads) : nullptr);
+}
+
+void EnableAllocationProfiling(bool enabled) {
+    gAllocationProfilingEnabled = enabled;
+}
+
+void EnablePeephole(bool enabled) { gPeepholeEnabled = enabled; }
+
+void EnableSafeMode(bool enabled) { gSafeModeEnabled = enabled; }
+
+void CountSafetyChecks(const string& code, long* outNumChecks,
+                       long* outNumElided) {
+    *outNumChecks = 0;
+    *outNumElided = 0;
+
+    for (auto pos = code.find("# Check"); pos != string::npos;
+         pos = code.find("# Check", pos + 1)) {
+        if (code.compare(pos, CheckComment.size(), CheckComment) == 0) {
+            ++*outNumChecks;
+        } else if (code.compare(pos, ElidedCheckComment.size(),
+                                ElidedCheckComment) == 0) {
+            ++*outNumElided;
+        }
+    }
+}
+
+// Instruction stats count what expressions emit, less what the peephole
+// optimizer removes from the procedure.
+string OptimizeProc(const string& code) {
+    if (!gPeepholeEnabled) {
+        return code;
+    }
+
+    TPhaseTimer phaseTimer("peephole");
+    long numRemoved;
+    auto optimized = OptimizeAsm(code, &numRemoved);
+
+    if (IsInstructionStatsEnabled()) {
+        AddInstructionCount("peephole", -numRemoved);
+    }
+
+    return optimized;
+}
+
+string EscapeAsmString(string s) {
+    string escaped;
+
+    for (auto c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+// Shortens source code quoted in the tables that describe the program to the
+// runtime.
+string AbbreviateSource(string source) {
+    const int MaxSourceLength = 60;
+
+    if (source.size() > MaxSourceLength) {
+        source = source.substr(0, MaxSourceLength - 3) + "...";
+    }
+
+    return source;
+}
+
+// Describes the procedure whose code lies between startLabel and endLabel to
+// the sampling profiler in runtime.c. Layout matches proc_info there.
+string EmitProcInfo(string startLabel, string endLabel, string name,
+                    string source) {
+    ostringstream infoOS;
+    infoOS << "    .pushsection sil_procs, \"aw\"\n"
+           << "    .balign 8\n"
+           << "    .quad " << startLabel << ", " << endLabel << ", "
+           << endLabel << "_name, " << endLabel << "_source\n"
+           << "    .section .rodata\n"
+           << endLabel << "_name:\n"
+           << "    .string \"" << EscapeAsmString(name) << "\"\n"
+           << endLabel << "_source:\n"
+           << "    .string \"" << EscapeAsmString(AbbreviateSource(source))
+           << "\"\n"
+           << "    .popsection\n";
+
+    return infoOS.str();
+}
+
+// Where a procedure's code goes on once its stack check passes.
+string ProcBodyLabel(string procLabel) { return ".L" + procLabel + "_body"; }
+
+string FrameSizeSymbol(string procLabel) {
+    return ".L" + procLabel + "_frame_size";
+}
+
+// Checks that the frame of the procedure at procLabel fits above the stack
+// segment's limit, and else moves to the next segment (see
+// sil_stack_overflow in runtime.c), taking the numArgWords words of
+// arguments at the top of the frame along. The frame size is only known once
+// the procedure's code is, so it's a symbol, set by EmitLambda.
+string EmitStackCheck(string procLabel, int numArgWords) {
+    auto overflowLabel = UniqueLabel();
+    gEmission->coldCodeOS << overflowLabel << ":\n"
+                          << "    leaq " << ProcBodyLabel(procLabel)
+                          << "(%rip), %r8\n"
+                          << "    movq $" << numArgWords << ", %r11\n"
+                          << "    movq $" << FrameSizeSymbol(procLabel)
+                          << ", %r9\n"
+                          << "    jmp sil_stack_overflow\n";
+
+    ostringstream checkOS;
+    checkOS << "    # Stack check.\n"
+            << "    leaq -" << FrameSizeSymbol(procLabel) << "(%rsp), %r11\n"
+            << "    cmpq gStackLimit(%rip), %r11\n"
+            << "    jb " << overflowLabel << "\n"
+            << ProcBodyLabel(procLabel) << ":\n";
+
+    return checkOS.str();
+}
+
+// How far below %rsp code stores, loads and points, and its calls push their
+// return address, which is the size of the frame of the procedure it's the
+// code of.
+long FrameSize(const string& code) {
+    long size = 0;
+    const string rspOperand = "(%rsp)";
+    const string callPrefix = "addq $-";
+
+    for (auto pos = code.find(rspOperand); pos != string::npos;
+         pos = code.find(rspOperand, pos + 1)) {
+        auto start = pos;
+
+        while (start > 0 &&
+               (isdigit(static_cast<unsigned char>(code[start - 1])) ||
+                code[start - 1] == '-')) {
+            --start;
+        }
+
+        if (start < pos && code[start] == '-') {
+            size = max(size, -stol(code.substr(start, pos - start)));
+        }
+    }
+
+    // Calls move %rsp down by a stack index first.
+    for (auto pos = code.find(callPrefix); pos != string::npos;
+         pos = code.find(callPrefix, pos + 1)) {
+        auto start = pos + callPrefix.size() - 1;
+        auto end = code.find(", %rsp", start);
+
+        if (end < code.find('\n', start)) {
+            auto stackIdx = stol(code.substr(start, end - start));
+            size = max(size, WordSize - stackIdx);
+        }
+    }
+
+    return size;
+}
+
+// Marks the return address of a Scheme procedure call made with %rsp moved
+// down by stackIdx, so the sampling profiler can walk from the callee's frame
+// back to the caller's. Layout matches call_site_info in runtime.c.
+string EmitCallSiteInfo(int stackIdx) {
+    auto returnLabel = UniqueLabel();
+    ostringstream infoOS;
+    infoOS << returnLabel << ":\n"
+           << "    .pushsection sil_call_sites, \"aw\"\n"
+           << "    .balign 8\n"
+           << "    .quad " << returnLabel << ", " << stackIdx << "\n"
+           << "    .popsection\n";
+
+    return infoOS.str();
+}
+
+// Counts an allocation of sizeOperand bytes (an immediate or a register) at a
+// new allocation site of the given kind; source describes the site. Emits
+// nothing unless allocation profiling is enabled. Only changes the flags.
+string EmitAllocationCount(string kind, string source, string sizeOperand) {
+    if (!gAllocationProfilingEnabled) {
+        return "";
+    }
+
+    auto siteLabel = UniqueLabel("alloc_site");
+    ostringstream countOS;
+    // Layout matches alloc_site in runtime.c: bytes, objects, kind, location.
+    countOS << "    .pushsection sil_alloc_sites, \"aw\"\n"
+            << "    .balign 8\n"
+            << siteLabel << ":\n"
+            << "    .quad 0, 0, " << siteLabel << "_kind, " << siteLabel
+            << "_location\n"
+            << "    .section .rodata\n"
+            << siteLabel << "_kind:\n"
+            << "    .string \"" << kind << "\"\n"
+            << siteLabel << "_location:\n"
+            << "    .string \""
+            << EscapeAsmString(gEmission->currentProcLabel + ": " +
+                               AbbreviateSource(source))
+            << "\"\n"
+            << "    .popsection\n"
+            << "    addq " << sizeOperand << ", " << siteLabel << "(%rip)\n"
+            << "    incq " << siteLabel << "+" << WordSize << "(%rip)\n";
+
+    return countOS.str();
+}
+
+bool IsExprDelimiter(char c) {
+    return c == '(' || c == ')' || c == '[' || c == ']' || c == ' ';
+}
+
+TSourceSpan LocateSubExpr(string expr) {
+    const auto& source = gCompilation->programSource;
+    auto& parent = gEmission->sourceSpans.back();
+
+    for (auto from : {parent.searchFrom, parent.begin}) {
+        auto pos = source.find(expr, from);
+
+        while (pos != string::npos && pos + expr.size() <= parent.end) {
+            auto end = pos + expr.size();
+
+            if ((pos == 0 || IsExprDelimiter(source[pos - 1])) &&
+                (end == source.size() || IsExprDelimiter(source[end]))) {
+                if (from == parent.searchFrom) {
+                    parent.searchFrom = end;
+                }
+
+                return {pos, end, pos};
+            }
+
+            pos = source.find(expr, pos + 1);
+        }
+    }
+
+    // Code the parser synthesized (e.g. the begin around a lambda's body)
+    // belongs to its parent.
+    return {parent.begin, parent.end, parent.begin};
+}
+
+string EmitLoc(const TSourceSpan& span) {
+    const auto& lineStarts = gCompilation->lineStarts;
+    auto offset = gCompilation->sourceOffsets[span.begin];
+    auto lineStart =
+        upper_bound(lineStarts.begin(), lineStarts.end(), offset) - 1;
+    auto line = lineStart - lineStarts.begin() + 1;
+    auto column = offset - *lineStart + 1;
+
+    return "    .loc 1 " + to_string(line) + " " + to_string(column) + "\n";
+}
+
+// The text in the source file an expression was normalized from. The .loc
+// lines within the expression depend on its line breaks, which normalizing
+// drops.
+string SourceTextOf(const TSourceSpan& span) {
+    const auto& offsets = gCompilation->sourceOffsets;
+    auto begin = offsets[span.begin];
+    auto end = span.end == span.begin ? begin : offsets[span.end - 1] + 1;
+
+    return gCompilation->sourceText.substr(begin, end - begin);
+}
+
+void AppendLeb128(long value, bool isSigned, vector<int>* outBytes) {
+    while (true) {
+        int byte = value & 0x7F;
+        value >>= 7;
+        bool done = isSigned ? ((value == 0 && !(byte & 0x40)) ||
+                                (value == -1 && (byte & 0x40)))
+                             : value == 0;
+
+        outBytes->push_back(done ? byte : byte | 0x80);
+
+        if (done) {
+            return;
+        }
+    }
+}
+
+// CFI for the code that follows, which runs with the frame base (the %rsp the
+// procedure body started with) at baseOffset(%rsp) or, when indirect, stored
+// at (%rsp) (on the aligned frame of a runtime call). A procedure's return
+// address sits right above its frame base, except in scheme_entry, which
+// switches to the Scheme stack and keeps the C stack pointer at its frame
+// base, with the return address and the two registers it pushed there.
+string EmitCfiFrameBase(long baseOffset, bool indirect = false) {
+    bool isSchemeEntry = gEmission->currentProcLabel == "scheme_entry";
+
+    if (!indirect && !isSchemeEntry) {
+        return "    .cfi_def_cfa %rsp, " + to_string(baseOffset + WordSize) +
+               "\n";
+    }
+
+    const int DW_CFA_def_cfa_expression = 0x0F;
+    const int DW_OP_breg7_rsp = 0x77;
+    const int DW_OP_deref = 0x06;
+    const int DW_OP_plus_uconst = 0x23;
+
+    vector<int> expr{DW_OP_breg7_rsp};
+    AppendLeb128(indirect ? 0 : baseOffset, true, &expr);
+
+    if (indirect) {
+        expr.push_back(DW_OP_deref);
+    }
+
+    if (isSchemeEntry) {
+        expr.push_back(DW_OP_deref);
+        expr.push_back(DW_OP_plus_uconst);
+        AppendLeb128(3 * WordSize, false, &expr);
+    } else {
+        expr.push_back(DW_OP_plus_uconst);
+        AppendLeb128(WordSize, false, &expr);
+    }
+
+    vector<int> bytes{DW_CFA_def_cfa_expression};
+    AppendLeb128(expr.size(), false, &bytes);
+    bytes.insert(bytes.end(), expr.begin(), expr.end());
+
+    ostringstream cfiOS;
+    cfiOS << "    .cfi_escape ";
+
+    for (int i = 0; i < bytes.size(); ++i) {
+        cfiOS << (i > 0 ? ", " : "") << "0x" << hex << bytes[i] << dec;
+    }
+
+    cfiOS << "\n";
+    return cfiOS.str();
 }
 
 string EmitStackSave(int stackIdx, string sourceReg = "rax") {
@@ -29,6 +573,45 @@ string EmitStackLoad(int stackIdx, string targetReg = "rax") {
            targetReg + "\n";
 }
 
+// Calls a C function in runtime.c with up to 3 arguments, each given as an
+// assembly operand that doesn't refer to %rdi, %rsi or %rdx. The result is left
+// in %rax. Slots stackIdx and below are clobbered.
+string EmitRuntimeCall(int stackIdx, string funcName,
+                       const vector<string>& args) {
+    static const vector<string> argRegs{"rdi", "rsi", "rdx"};
+    assert(args.size() <= argRegs.size());
+    ostringstream callOS;
+
+    callOS << "    # Runtime call: " << funcName << ".\n"
+           << EmitStackSave(stackIdx, "rdi")
+           << EmitStackSave(stackIdx - WordSize, "rcx");
+
+    for (int i = args.size() - 1; i >= 0; --i) {
+        callOS << "    movq " << args[i] << ", %" << argRegs[i] << "\n";
+    }
+
+    // The runtime allocates from the Scheme heap through gAllocPtr. The C
+    // function runs below the live part of the Scheme stack on a 16-byte
+    // aligned frame that remembers the Scheme %rsp. gRuntimeFrame points to
+    // that frame while the call lasts, for the sampling profiler.
+    callOS << "    movq %rbp, gAllocPtr(%rip)\n"
+           << "    leaq " << (stackIdx - 2 * WordSize) << "(%rsp), %r11\n"
+           << "    andq $-16, %r11\n"
+           << "    movq %rsp, (%r11)\n"
+           << "    movq %r11, %rsp\n"
+           << EmitCfiFrameBase(0, /* indirect */ true)
+           << "    movq %r11, gRuntimeFrame(%rip)\n"
+           << "    call " << funcName << "\n"
+           << "    movq $0, gRuntimeFrame(%rip)\n"
+           << "    movq (%rsp), %rsp\n"
+           << EmitCfiFrameBase(0)
+           << "    movq gAllocPtr(%rip), %rbp\n"
+           << EmitStackLoad(stackIdx - WordSize, "rcx")
+           << EmitStackLoad(stackIdx, "rdi");
+
+    return callOS.str();
+}
+
 char TokenToChar(string token) {
     assert(IsChar(token));
 
@@ -51,7 +634,7 @@ char TokenToChar(string token) {
     return token[2];
 }
 
-int ImmediateRep(string token) {
+long ImmediateRep(string token) {
     assert(IsImmediate(token));
 
     if (IsNull(token)) {
@@ -68,7 +651,18 @@ int ImmediateRep(string token) {
 
     // Else, must be fixnum.
     assert(IsFixNum(token));
-    return (stoi(token) << FxShift) | FxTag;
+    return (stol(token) << FxShift) | FxTag;
+}
+
+// Immediate operands of most x86-64 instructions are sign-extended 32-bit
+// values. Wider fixnums have to be loaded with movabsq.
+bool FitsInImm32(long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+string EmitLoadImmediate(long value, string targetReg = "rax") {
+    return string("    ") + (FitsInImm32(value) ? "movq" : "movabsq") + " $" +
+           to_string(value) + ", %" + targetReg + "\n";
 }
 
 bool IsLocalVar(TEnvironment env, string possibleVarName) {
@@ -85,141 +679,660 @@ bool IsLocalOrCapturedVar(TEnvironment env, const TClosureEnvironment& closEnv,
            IsCapturedVar(closEnv, possibleVarName);
 }
 
-string EmitVarRef(TEnvironment env, const TClosureEnvironment& closEnv,
-                  string expr, bool isTail,
-                  int numFormalParamsInContainingLambda) {
-    assert(IsLocalOrCapturedVar(env, closEnv, expr));
+// The variables a lambda refers to that are bound where it is made.
+vector<string> LambdaFreeVars(TEnvironment env,
+                              const TClosureEnvironment& closEnv,
+                              const vector<string>& possibleFreeVars) {
+    vector<string> freeVars;
 
-    if (env.count(expr)) {
-        auto stackIdx = env.at(expr);
-        return "    # Local var ref: " + expr + ".\n" + "    movq " +
-               to_string(stackIdx) + "(%rsp), %rax\n" +
-               (isTail ? "    ret\n" : "");
+    for (const auto& var : possibleFreeVars) {
+        if (IsLocalOrCapturedVar(env, closEnv, var)) {
+            freeVars.push_back(var);
+        }
     }
 
-    auto heapIdx = closEnv.at(expr) - ClosureTag;
-    return "    # Free var ref: " + expr + ".\n" + "    movq " +
-           to_string(heapIdx) + "(%rdi), %rax\n" + (isTail ? "    ret\n" : "");
+    return freeVars;
 }
 
-string EmitVarVal(TEnvironment env, const TClosureEnvironment& closEnv,
-                  string expr, bool isTail,
-                  int numFormalParamsInContainingLambda) {
-    assert(IsLocalOrCapturedVar(env, closEnv, expr));
-    ostringstream varValOS;
+const char* ValueTypeName(EValueType type) {
+    static const char* names[] = {"unknown", "fixnum", "char",     "pair",
+                                  "vector",  "string", "procedure"};
+    return names[static_cast<int>(type)];
+}
 
-    varValOS << EmitVarRef(env, closEnv, expr, false,
-                           numFormalParamsInContainingLambda)
+// Tag inference: the type of expr's value as far as is known where its code
+// is being emitted. Values known from the primitives that make them assume
+// that the primitives' operands were checked, so only hold in safe mode.
+EValueType InferType(string expr) {
+    static const unordered_map<string, EValueType> resultTypes{
+        {"cons", EValueType::Pair},
+        {"make-vector", EValueType::Vector},
+        {"make-string", EValueType::String},
+        {"vector-length", EValueType::FixNum},
+        {"string-length", EValueType::FixNum},
+        {"char->fixnum", EValueType::FixNum},
+        {"fixnum->char", EValueType::Char},
+        {"fxlognot", EValueType::FixNum},
+        {"fxlogor", EValueType::FixNum},
+        {"fxlogand", EValueType::FixNum},
+        {"symbol->string", EValueType::String}};
+
+    if (!gSafeModeEnabled) {
+        return EValueType::Unknown;
+    }
 
-             << "    movq (%rax), %rax\n"
+    if (IsString(expr)) {
+        return EValueType::String;
+    }
 
-             << (isTail ? "    ret\n" : "");
+    TDatum datum;
 
-    return varValOS.str();
-}
+    if (TryParseQuote(expr, &datum)) {
+        return datum.kind == TDatum::Immediate ? InferType(datum.token)
+               : datum.kind == TDatum::String  ? EValueType::String
+               : datum.kind == TDatum::List    ? EValueType::Pair
+               : datum.kind == TDatum::Vector  ? EValueType::Vector
+                                               : EValueType::Unknown;
+    }
 
-string EmitFxAddImmediate(int stackIdx, TEnvironment env,
-                          const TClosureEnvironment& closEnv, string fxAddArg,
-                          string fxAddImmediate, bool isTail,
-                          int numFormalParamsInContainingLambda) {
-    assert(IsImmediate(fxAddImmediate));
+    if (IsImmediate(expr)) {
+        return IsFixNum(expr) ? EValueType::FixNum
+                              : IsChar(expr) ? EValueType::Char
+                                             : EValueType::Unknown;
+    }
 
-    ostringstream exprEmissionStream;
-    exprEmissionStream << "    # Add imm.\n"
+    if (IsVarName(expr)) {
+        const auto& facts = gEmission->typeFacts;
 
-                       << EmitExpr(stackIdx, env, closEnv, fxAddArg)
+        for (auto fact = facts.rbegin(); fact != facts.rend(); ++fact) {
+            if (fact->first == expr) {
+                return fact->second;
+            }
+        }
 
-                       << "    addq $" << ImmediateRep(fxAddImmediate)
-                       << ", %rax\n"
+        return EValueType::Unknown;
+    }
 
-                       << (isTail ? "    ret\n" : "");
+    string primitiveName;
 
-    return exprEmissionStream.str();
-}
+    if (TryParseUnaryPrimitive(expr, &primitiveName) ||
+        TryParseBinaryPrimitive(expr, &primitiveName)) {
+        auto resultType = resultTypes.find(primitiveName);
+        return resultType == resultTypes.end() ? EValueType::Unknown
+                                               : resultType->second;
+    }
 
-string EmitFxAdd1(int stackIdx, TEnvironment env,
-                  const TClosureEnvironment& closEnv, string fxAdd1Arg,
-                  bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitFxAddImmediate(stackIdx, env, closEnv, fxAdd1Arg, "1", isTail,
-                              numFormalParamsInContainingLambda);
+    return TryParseLambda(expr) ? EValueType::Procedure : EValueType::Unknown;
 }
 
-string EmitFxSub1(int stackIdx, TEnvironment env,
-                  const TClosureEnvironment& closEnv, string fxSub1Arg,
-                  bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitFxAddImmediate(stackIdx, env, closEnv, fxSub1Arg, "-1", isTail,
-                              numFormalParamsInContainingLambda);
-}
+// Makes var's type known to the code emitted next. A variable bound anew
+// gets a fact of its own, which hides what was known of the one it shadows.
+void AddTypeFact(string var, EValueType type) {
+    if (!gSafeModeEnabled) {
+        return;
+    }
 
-string EmitFixNumToChar(int stackIdx, TEnvironment env,
-                        const TClosureEnvironment& closEnv,
-                        string fixNumToCharArg, bool isTail,
-                        int numFormalParamsInContainingLambda) {
-    ostringstream exprEmissionStream;
-    exprEmissionStream << "    # fixnum->char.\n"
-                       << EmitExpr(stackIdx, env, closEnv, fixNumToCharArg)
-                       << "    shlq $" << (CharShift - FxShift) << ", %rax\n"
-                       << "    orq $" << CharTag << ", %rax\n"
-                       << (isTail ? "    ret\n" : "");
+    if (gCompilation->assignedVars.count(var) != 0) {
+        type = EValueType::Unknown;
+    }
 
-    return exprEmissionStream.str();
+    gEmission->typeFacts.push_back({var, type});
 }
 
-string EmitCharToFixNum(int stackIdx, TEnvironment env,
-                        const TClosureEnvironment& closEnv,
-                        string charToFixNumArg, bool isTail,
-                        int numFormalParamsInContainingLambda) {
-    ostringstream exprEmissionStream;
-    exprEmissionStream << "    # char->fixnum.\n"
-                       << EmitExpr(stackIdx, env, closEnv, charToFixNumArg)
-                       << "    shrq $" << (CharShift - FxShift) << ", %rax\n"
-                       << (isTail ? "    ret\n" : "");
+// What cond evaluating to true, or to false, tells of the types of the
+// variables it tests with type predicates.
+vector<pair<string, EValueType>> TypeFactsWhen(string cond, bool isTrue) {
+    static const unordered_map<string, EValueType> predicateTypes{
+        {"fixnum?", EValueType::FixNum},
+        {"char?", EValueType::Char},
+        {"pair?", EValueType::Pair},
+        {"vector?", EValueType::Vector},
+        {"string?", EValueType::String},
+        {"procedure?", EValueType::Procedure}};
+    vector<pair<string, EValueType>> facts;
+    string primitiveName;
+    vector<string> args;
 
-    return exprEmissionStream.str();
-}
+    if (!gSafeModeEnabled) {
+        return facts;
+    }
 
-string EmitIsFixNum(int stackIdx, TEnvironment env,
-                    const TClosureEnvironment& closEnv, string isFixNumArg,
-                    bool isTail, int numFormalParamsInContainingLambda) {
-    ostringstream exprEmissionStream;
-    exprEmissionStream << "    # fixnum?.\n"
+    if (TryParseUnaryPrimitive(cond, &primitiveName, &args)) {
+        if (primitiveName == "not") {
+            return TypeFactsWhen(args[0], !isTrue);
+        }
 
-                       << EmitExpr(stackIdx, env, closEnv, isFixNumArg)
+        auto type = predicateTypes.find(primitiveName);
 
-                       << "    and $" << FxMask << ", %al\n"
+        if (isTrue && type != predicateTypes.end() && IsVarName(args[0])) {
+            facts.push_back({args[0], type->second});
+        }
+    } else if (TryParseVariableArityPrimitive(cond, &primitiveName, &args) &&
+               ((primitiveName == "and" && isTrue) ||
+                (primitiveName == "or" && !isTrue))) {
+        for (const auto& arg : args) {
+            auto argFacts = TypeFactsWhen(arg, isTrue);
+            facts.insert(facts.end(), argFacts.begin(), argFacts.end());
+        }
+    }
 
-                       << "    cmp $" << FxTag << ", %al\n"
+    return facts;
+}
 
-                       << "    sete %al\n"
+void AddTypeFacts(const vector<pair<string, EValueType>>& facts) {
+    for (const auto& fact : facts) {
+        AddTypeFact(fact.first, fact.second);
+    }
+}
 
-                       << "    movzbq %al, %rax\n"
+// Range analysis. Terms stand for tagged fixnums, which compare like the
+// fixnums they tag.
+string LengthTerm(string obj, EValueType objType) {
+    return string(objType == EValueType::Vector ? "(vector-length "
+                                                : "(string-length ") +
+           obj + ")";
+}
 
-                       << "    sal $" << BoolBit << ", %al\n"
+// expr as a range term, or empty when it isn't one.
+string RangeTerm(string expr) {
+    string primitiveName;
+    vector<string> args;
 
-                       << "    or $" << BoolF << ", %al\n"
+    if (IsFixNum(expr) || IsVarName(expr)) {
+        return expr;
+    }
 
-                       << (isTail ? "    ret\n" : "");
+    if (TryParseUnaryPrimitive(expr, &primitiveName, &args) &&
+        IsVarName(args[0])) {
+        if (primitiveName == "vector-length") {
+            return LengthTerm(args[0], EValueType::Vector);
+        }
 
-    return exprEmissionStream.str();
+        if (primitiveName == "string-length") {
+            return LengthTerm(args[0], EValueType::String);
+        }
+    }
+
+    return "";
 }
 
-string EmitIsFxZero(int stackIdx, TEnvironment env,
-                    const TClosureEnvironment& closEnv, string isFxZeroArg,
-                    bool isTail, int numFormalParamsInContainingLambda) {
-    ostringstream exprEmissionStream;
-    exprEmissionStream << "    # zero?.\n"
-                       << EmitExpr(stackIdx, env, closEnv, isFxZeroArg)
-                       << "    cmpq $0, %rax\n"
-                       << "    sete %al\n"
-                       << "    movzbq %al, %rax\n"
-                       << "    sal $" << BoolBit << ", %al\n"
-                       << "    or $" << BoolF << ", %al\n"
-                       << (isTail ? "    ret\n" : "");
+// The variable a range term depends on; empty for literals.
+string RangeTermVar(string term) {
+    if (IsFixNum(term)) {
+        return "";
+    }
 
-    return exprEmissionStream.str();
+    if (IsVarName(term)) {
+        return term;
+    }
+
+    vector<string> args;
+    TryParseUnaryPrimitive(term, nullptr, &args);
+
+    return args[0];
 }
 
-string EmitIsNull(int stackIdx, TEnvironment env,
+void AddRangeFact(string lhs, string rhs, bool isStrict) {
+    if (!gSafeModeEnabled || lhs.empty() || rhs.empty()) {
+        return;
+    }
+
+    const auto& assignedVars = gCompilation->assignedVars;
+
+    if (assignedVars.count(RangeTermVar(lhs)) != 0 ||
+        assignedVars.count(RangeTermVar(rhs)) != 0) {
+        return;
+    }
+
+    gEmission->rangeFacts.push_back({lhs, rhs, isStrict});
+}
+
+void AddRangeBinding(string var) {
+    if (gSafeModeEnabled) {
+        gEmission->rangeFacts.push_back({var, "", false});
+    }
+}
+
+// The range facts that hold where code is being emitted.
+vector<TRangeFact> ValidRangeFacts() {
+    vector<TRangeFact> facts;
+    unordered_set<string> boundAnew;
+    const auto& rangeFacts = gEmission->rangeFacts;
+
+    for (auto fact = rangeFacts.rbegin(); fact != rangeFacts.rend(); ++fact) {
+        if (fact->rhs.empty()) {
+            boundAnew.insert(fact->lhs);
+        } else if (boundAnew.count(RangeTermVar(fact->lhs)) == 0 &&
+                   boundAnew.count(RangeTermVar(fact->rhs)) == 0) {
+            facts.push_back(*fact);
+        }
+    }
+
+    return facts;
+}
+
+// Whether a < b, or a <= b, follows from the range facts: from a chain of
+// facts leading from a to b, where a literal is below the literals it is less
+// than, and lengths aren't negative.
+bool IsKnownBelow(string a, string b, bool isStrict) {
+    if (a.empty() || b.empty()) {
+        return false;
+    }
+
+    if (a == b) {
+        return !isStrict;
+    }
+
+    if (IsFixNum(a) && IsFixNum(b)) {
+        return isStrict ? stol(a) < stol(b) : stol(a) <= stol(b);
+    }
+
+    if (IsFixNum(a) && !IsVarName(b) && !IsFixNum(b) &&
+        (isStrict ? stol(a) < 0 : stol(a) <= 0)) {
+        return true;
+    }
+
+    auto facts = ValidRangeFacts();
+    // The terms known to be above a, and whether strictly.
+    unordered_map<string, bool> reached{{a, false}};
+    vector<string> toVisit{a};
+
+    while (!toVisit.empty()) {
+        auto term = toVisit.back();
+        auto isTermStrict = reached[term];
+        toVisit.pop_back();
+
+        for (const auto& fact : facts) {
+            bool isViaLiteral = fact.lhs != term && IsFixNum(term) &&
+                                IsFixNum(fact.lhs) &&
+                                stol(term) <= stol(fact.lhs);
+
+            if (fact.lhs != term && !isViaLiteral) {
+                continue;
+            }
+
+            bool isRhsStrict = isTermStrict || fact.isStrict ||
+                               (isViaLiteral && stol(term) < stol(fact.lhs));
+
+            if (fact.rhs == b && (isRhsStrict || !isStrict)) {
+                return true;
+            }
+
+            auto rhsReached = reached.find(fact.rhs);
+
+            if (rhsReached == reached.end() ||
+                (isRhsStrict && !rhsReached->second)) {
+                reached[fact.rhs] = isRhsStrict;
+                toVisit.push_back(fact.rhs);
+            }
+        }
+    }
+
+    return false;
+}
+
+// What cond evaluating to true, or to false, tells of how the fixnums it
+// compares are ordered.
+vector<TRangeFact> RangeFactsWhen(string cond, bool isTrue) {
+    vector<TRangeFact> facts;
+    string primitiveName;
+    vector<string> args;
+
+    if (!gSafeModeEnabled) {
+        return facts;
+    }
+
+    if (TryParseUnaryPrimitive(cond, &primitiveName, &args) &&
+        primitiveName == "not") {
+        return RangeFactsWhen(args[0], !isTrue);
+    }
+
+    if (TryParseVariableArityPrimitive(cond, &primitiveName, &args)) {
+        if ((primitiveName == "and" && isTrue) ||
+            (primitiveName == "or" && !isTrue)) {
+            for (const auto& arg : args) {
+                auto argFacts = RangeFactsWhen(arg, isTrue);
+                facts.insert(facts.end(), argFacts.begin(), argFacts.end());
+            }
+        }
+
+        return facts;
+    }
+
+    if (!TryParseBinaryPrimitive(cond, &primitiveName, &args)) {
+        return facts;
+    }
+
+    auto lhs = RangeTerm(args[0]);
+    auto rhs = RangeTerm(args[1]);
+
+    if (lhs.empty() || rhs.empty()) {
+        return facts;
+    }
+
+    if (primitiveName == "fx>" || primitiveName == "fx>=") {
+        swap(lhs, rhs);
+        primitiveName = primitiveName == "fx>" ? "fx<" : "fx<=";
+    }
+
+    if (primitiveName == "fx<") {
+        facts.push_back(isTrue ? TRangeFact{lhs, rhs, true}
+                               : TRangeFact{rhs, lhs, false});
+    } else if (primitiveName == "fx<=") {
+        facts.push_back(isTrue ? TRangeFact{lhs, rhs, false}
+                               : TRangeFact{rhs, lhs, true});
+    } else if (primitiveName == "fx=" && isTrue) {
+        facts.push_back({lhs, rhs, false});
+        facts.push_back({rhs, lhs, false});
+    } else if (primitiveName == "fx=") {
+        // Unequal terms known to be ordered are strictly ordered.
+        if (IsKnownBelow(lhs, rhs, false)) {
+            facts.push_back({lhs, rhs, true});
+        }
+
+        if (IsKnownBelow(rhs, lhs, false)) {
+            facts.push_back({rhs, lhs, true});
+        }
+    }
+
+    return facts;
+}
+
+void AddFactsWhen(string cond, bool isTrue) {
+    AddTypeFacts(TypeFactsWhen(cond, isTrue));
+
+    for (const auto& fact : RangeFactsWhen(cond, isTrue)) {
+        AddRangeFact(fact.lhs, fact.rhs, fact.isStrict);
+    }
+}
+
+// Makes the variables bound anew to the values of their inits, which are
+// evaluated where the variables aren't bound yet.
+void AddBindingFacts(const TOrderedBindings& bindings) {
+    vector<pair<string, EValueType>> types;
+    vector<string> terms;
+    unordered_set<string> vars;
+
+    for (const auto& b : bindings) {
+        types.push_back({b.first, InferType(b.second)});
+        terms.push_back(RangeTerm(b.second));
+        vars.insert(b.first);
+    }
+
+    AddTypeFacts(types);
+
+    for (const auto& b : bindings) {
+        AddRangeBinding(b.first);
+    }
+
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        if (types[i].second == EValueType::FixNum && !terms[i].empty() &&
+            vars.count(RangeTermVar(terms[i])) == 0) {
+            AddRangeFact(bindings[i].first, terms[i], false);
+            AddRangeFact(terms[i], bindings[i].first, false);
+        }
+    }
+}
+
+// Where the facts known at a point of the code end, so that the ones learnt
+// past it can be dropped once the code they hold for is emitted.
+struct TFactsMark {
+    size_t numTypeFacts;
+    size_t numRangeFacts;
+};
+
+TFactsMark MarkFacts() {
+    return {gEmission->typeFacts.size(), gEmission->rangeFacts.size()};
+}
+
+void DropFactsSince(const TFactsMark& mark) {
+    gEmission->typeFacts.resize(mark.numTypeFacts);
+    gEmission->rangeFacts.resize(mark.numRangeFacts);
+}
+
+// Label of the out-of-line code that reports a failed check of the value in
+// valueReg. The runtime's sil_check_failed takes the check in %rdi and the
+// value in %rax.
+string CheckFailedLabel(int check, string valueReg = "rax") {
+    auto key = to_string(check) + valueReg;
+    auto label = gEmission->checkFailedLabels.find(key);
+
+    if (label != gEmission->checkFailedLabels.end()) {
+        return label->second;
+    }
+
+    auto newLabel = UniqueLabel();
+    gEmission->checkFailedLabels[key] = newLabel;
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << newLabel << ":\n";
+
+    if (valueReg != "rax") {
+        coldCodeOS << "    movq %" << valueReg << ", %rax\n";
+    }
+
+    coldCodeOS << "    movq $" << check << ", %rdi\n"
+               << "    jmp sil_check_failed\n";
+
+    return newLabel;
+}
+
+// Sets ZF when the value in %rax has the given type.
+string EmitTypeTest(EValueType type) {
+    static const unordered_map<EValueType, unsigned int> heapObjTags{
+        {EValueType::Pair, PairTag},
+        {EValueType::Vector, VectorTag},
+        {EValueType::String, StringTag},
+        {EValueType::Procedure, ClosureTag}};
+    ostringstream testOS;
+
+    if (type == EValueType::FixNum) {
+        testOS << "    test $" << FxMask << ", %al\n";
+    } else if (type == EValueType::Char) {
+        testOS << "    cmp $" << CharTag << ", %al\n";
+    } else {
+        testOS << "    leaq -" << heapObjTags.at(type) << "(%rax), %r11\n"
+               << "    test $" << HeapObjMask << ", %r11b\n";
+    }
+
+    return testOS.str();
+}
+
+// In safe mode, checks that expr's value, in %rax, has the given type, unless
+// tag inference knows it does. A variable that passed the check is known to
+// have the type from then on.
+string EmitTypeCheck(string expr, EValueType type) {
+    if (!gSafeModeEnabled || type == EValueType::Unknown) {
+        return "";
+    }
+
+    if (InferType(expr) == type) {
+        return "    " + ElidedCheckComment + ValueTypeName(type) + ".\n";
+    }
+
+    if (IsVarName(expr)) {
+        AddTypeFact(expr, type);
+    }
+
+    return "    " + CheckComment + ValueTypeName(type) + ".\n" +
+           EmitTypeTest(type) + "    jne " +
+           CheckFailedLabel(static_cast<int>(type)) + "\n";
+}
+
+// In safe mode, checks that the length make-vector or make-string is passed,
+// a fixnum in %rax, isn't negative, unless range analysis knows it isn't. A
+// negative length would make the object's bounds checks pass any index.
+string EmitLengthCheck(string lengthExpr) {
+    if (!gSafeModeEnabled) {
+        return "";
+    }
+
+    auto lengthTerm = RangeTerm(lengthExpr);
+
+    if (IsKnownBelow("0", lengthTerm, false)) {
+        return "    " + ElidedCheckComment + "length.\n";
+    }
+
+    AddRangeFact("0", lengthTerm, false);
+
+    return "    " + CheckComment + "length.\n" + "    testq %rax, %rax\n" +
+           "    js " + CheckFailedLabel(LengthCheck) + "\n";
+}
+
+string EmitVarRef(TEnvironment env, const TClosureEnvironment& closEnv,
+                  string expr, bool isTail,
+                  int numFormalParamsInContainingLambda) {
+    assert(IsLocalOrCapturedVar(env, closEnv, expr));
+
+    if (env.count(expr)) {
+        auto stackIdx = env.at(expr);
+        return "    # Local var ref: " + expr + ".\n" + "    movq " +
+               to_string(stackIdx) + "(%rsp), %rax\n" +
+               (isTail ? "    ret\n" : "");
+    }
+
+    auto heapIdx = closEnv.at(expr) - ClosureTag;
+    return "    # Free var ref: " + expr + ".\n" + "    movq " +
+           to_string(heapIdx) + "(%rdi), %rax\n" + (isTail ? "    ret\n" : "");
+}
+
+string EmitVarVal(TEnvironment env, const TClosureEnvironment& closEnv,
+                  string expr, bool isTail,
+                  int numFormalParamsInContainingLambda) {
+    assert(IsLocalOrCapturedVar(env, closEnv, expr));
+    ostringstream varValOS;
+
+    varValOS << EmitVarRef(env, closEnv, expr, false,
+                           numFormalParamsInContainingLambda)
+
+             << "    movq (%rax), %rax\n"
+
+             << (isTail ? "    ret\n" : "");
+
+    return varValOS.str();
+}
+
+string EmitFxAddImmediate(int stackIdx, TEnvironment env,
+                          const TClosureEnvironment& closEnv, string fxAddArg,
+                          string fxAddImmediate, bool isTail,
+                          int numFormalParamsInContainingLambda) {
+    assert(IsImmediate(fxAddImmediate));
+    assert(FitsInImm32(ImmediateRep(fxAddImmediate)));
+
+    auto overflowLabel = UniqueLabel();
+    auto doneLabel = UniqueLabel();
+    auto imm = ImmediateRep(fxAddImmediate);
+
+    ostringstream exprEmissionStream;
+    exprEmissionStream << "    # Add imm.\n"
+
+                       << EmitExpr(stackIdx, env, closEnv, fxAddArg)
+
+                       << EmitTypeCheck(fxAddArg, EValueType::FixNum)
+
+                       << "    addq $" << imm << ", %rax\n"
+
+                       << "    jo " << overflowLabel << "\n"
+
+                       << doneLabel << ":\n"
+
+                       << (isTail ? "    ret\n" : "");
+
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << overflowLabel << ":\n"
+               << "    subq $" << imm << ", %rax\n"
+               << EmitRuntimeCall(stackIdx, "generic_add",
+                                  {"%rax", "$" + to_string(imm)})
+               << "    jmp " << doneLabel << "\n";
+
+    return exprEmissionStream.str();
+}
+
+string EmitFxAdd1(int stackIdx, TEnvironment env,
+                  const TClosureEnvironment& closEnv, string fxAdd1Arg,
+                  bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitFxAddImmediate(stackIdx, env, closEnv, fxAdd1Arg, "1", isTail,
+                              numFormalParamsInContainingLambda);
+}
+
+string EmitFxSub1(int stackIdx, TEnvironment env,
+                  const TClosureEnvironment& closEnv, string fxSub1Arg,
+                  bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitFxAddImmediate(stackIdx, env, closEnv, fxSub1Arg, "-1", isTail,
+                              numFormalParamsInContainingLambda);
+}
+
+string EmitFixNumToChar(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv,
+                        string fixNumToCharArg, bool isTail,
+                        int numFormalParamsInContainingLambda) {
+    ostringstream exprEmissionStream;
+    exprEmissionStream << "    # fixnum->char.\n"
+                       << EmitExpr(stackIdx, env, closEnv, fixNumToCharArg)
+                       << EmitTypeCheck(fixNumToCharArg, EValueType::FixNum)
+                       << "    shlq $" << (CharShift - FxShift) << ", %rax\n"
+                       << "    orq $" << CharTag << ", %rax\n"
+                       << (isTail ? "    ret\n" : "");
+
+    return exprEmissionStream.str();
+}
+
+string EmitCharToFixNum(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv,
+                        string charToFixNumArg, bool isTail,
+                        int numFormalParamsInContainingLambda) {
+    ostringstream exprEmissionStream;
+    exprEmissionStream << "    # char->fixnum.\n"
+                       << EmitExpr(stackIdx, env, closEnv, charToFixNumArg)
+                       << EmitTypeCheck(charToFixNumArg, EValueType::Char)
+                       << "    shrq $" << (CharShift - FxShift) << ", %rax\n"
+                       << (isTail ? "    ret\n" : "");
+
+    return exprEmissionStream.str();
+}
+
+string EmitIsFixNum(int stackIdx, TEnvironment env,
+                    const TClosureEnvironment& closEnv, string isFixNumArg,
+                    bool isTail, int numFormalParamsInContainingLambda) {
+    ostringstream exprEmissionStream;
+    exprEmissionStream << "    # fixnum?.\n"
+
+                       << EmitExpr(stackIdx, env, closEnv, isFixNumArg)
+
+                       << "    and $" << FxMask << ", %al\n"
+
+                       << "    cmp $" << FxTag << ", %al\n"
+
+                       << "    sete %al\n"
+
+                       << "    movzbq %al, %rax\n"
+
+                       << "    sal $" << BoolBit << ", %al\n"
+
+                       << "    or $" << BoolF << ", %al\n"
+
+                       << (isTail ? "    ret\n" : "");
+
+    return exprEmissionStream.str();
+}
+
+string EmitIsFxZero(int stackIdx, TEnvironment env,
+                    const TClosureEnvironment& closEnv, string isFxZeroArg,
+                    bool isTail, int numFormalParamsInContainingLambda) {
+    ostringstream exprEmissionStream;
+    exprEmissionStream << "    # zero?.\n"
+                       << EmitExpr(stackIdx, env, closEnv, isFxZeroArg)
+                       << EmitTypeCheck(isFxZeroArg, EValueType::FixNum)
+                       << "    cmpq $0, %rax\n"
+                       << "    sete %al\n"
+                       << "    movzbq %al, %rax\n"
+                       << "    sal $" << BoolBit << ", %al\n"
+                       << "    or $" << BoolF << ", %al\n"
+                       << (isTail ? "    ret\n" : "");
+
+    return exprEmissionStream.str();
+}
+
+string EmitIsNull(int stackIdx, TEnvironment env,
                   const TClosureEnvironment& closEnv, string isNullArg,
                   bool isTail, int numFormalParamsInContainingLambda) {
     ostringstream exprEmissionStream;
@@ -323,6 +1436,8 @@ string EmitFxLogNot(int stackIdx, TEnvironment env,
 
                        << EmitExpr(stackIdx, env, closEnv, fxLogNotArg)
 
+                       << EmitTypeCheck(fxLogNotArg, EValueType::FixNum)
+
                        << "    xor $" << FxMaskNeg << ", %rax\n"
 
                        << (isTail ? "    ret\n" : "");
@@ -330,62 +1445,125 @@ string EmitFxLogNot(int stackIdx, TEnvironment env,
     return exprEmissionStream.str();
 }
 
+// fx+, fx- and fx* return a bignum on overflow. Their operands are only
+// checked to be fixnums in safe mode, so that bignum is for generic arithmetic
+// to take, not another fx primitive.
 string EmitFxAdd(int stackIdx, TEnvironment env,
                  const TClosureEnvironment& closEnv, string lhs, string rhs,
                  bool isTail, int numFormalParamsInContainingLambda) {
+    auto overflowLabel = UniqueLabel();
+    auto doneLabel = UniqueLabel();
+
     ostringstream exprEmissionStream;
     exprEmissionStream << "    # fx+.\n"
 
                        << EmitExpr(stackIdx, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, EValueType::FixNum)
+
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, EValueType::FixNum)
+
                        << "    addq " << stackIdx << "(%rsp), %rax\n"
 
+                       << "    jo " << overflowLabel << "\n"
+
+                       << doneLabel << ":\n"
+
                        << (isTail ? "    ret\n" : "");
 
+    // On overflow, recover rhs and let the runtime produce a bignum.
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << overflowLabel << ":\n"
+               << "    subq " << stackIdx << "(%rsp), %rax\n"
+               << EmitRuntimeCall(stackIdx - WordSize, "generic_add",
+                                  {to_string(stackIdx) + "(%rsp)", "%rax"})
+               << "    jmp " << doneLabel << "\n";
+
     return exprEmissionStream.str();
 }
 
 string EmitFxSub(int stackIdx, TEnvironment env,
                  const TClosureEnvironment& closEnv, string lhs, string rhs,
                  bool isTail, int numFormalParamsInContainingLambda) {
+    auto overflowLabel = UniqueLabel();
+    auto doneLabel = UniqueLabel();
+
     ostringstream exprEmissionStream;
     exprEmissionStream << "    # fx-.\n"
 
                        << EmitExpr(stackIdx, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, EValueType::FixNum)
+
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, EValueType::FixNum)
+
                        << "    subq " << stackIdx << "(%rsp), %rax\n"
 
+                       << "    jo " << overflowLabel << "\n"
+
+                       << doneLabel << ":\n"
+
                        << (isTail ? "    ret\n" : "");
 
+    // On overflow, recover lhs and let the runtime produce a bignum.
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << overflowLabel << ":\n"
+               << "    addq " << stackIdx << "(%rsp), %rax\n"
+               << EmitRuntimeCall(stackIdx - WordSize, "generic_sub",
+                                  {"%rax", to_string(stackIdx) + "(%rsp)"})
+               << "    jmp " << doneLabel << "\n";
+
     return exprEmissionStream.str();
 }
 
 string EmitFxMul(int stackIdx, TEnvironment env,
                  const TClosureEnvironment& closEnv, string lhs, string rhs,
                  bool isTail, int numFormalParamsInContainingLambda) {
+    auto overflowLabel = UniqueLabel();
+    auto doneLabel = UniqueLabel();
+
     ostringstream exprEmissionStream;
     exprEmissionStream << "    # fx*.\n"
 
                        << EmitExpr(stackIdx, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, EValueType::FixNum)
+
                        << "    sarq $" << FxShift << ", %rax\n"
 
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, EValueType::FixNum)
+
+                       << "    movq %rax, %r8\n"
+
                        << "    imul " << stackIdx << "(%rsp), %rax\n"
 
+                       << "    jo " << overflowLabel << "\n"
+
+                       << doneLabel << ":\n"
+
                        << (isTail ? "    ret\n" : "");
 
+    // On overflow, retag lhs and let the runtime produce a bignum.
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << overflowLabel << ":\n"
+               << "    movq " << stackIdx << "(%rsp), %rax\n"
+               << "    salq $" << FxShift << ", %rax\n"
+               << EmitRuntimeCall(stackIdx - WordSize, "generic_mul",
+                                  {"%rax", "%r8"})
+               << "    jmp " << doneLabel << "\n";
+
     return exprEmissionStream.str();
 }
 
@@ -397,10 +1575,14 @@ string EmitFxLogOr(int stackIdx, TEnvironment env,
 
                        << EmitExpr(stackIdx, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, EValueType::FixNum)
+
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, EValueType::FixNum)
+
                        << "    or " << stackIdx << "(%rsp), %rax\n"
 
                        << (isTail ? "    ret\n" : "");
@@ -416,10 +1598,14 @@ string EmitFxLogAnd(int stackIdx, TEnvironment env,
 
                        << EmitExpr(stackIdx, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, EValueType::FixNum)
+
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, EValueType::FixNum)
+
                        << "    and " << stackIdx << "(%rsp), %rax\n"
 
                        << (isTail ? "    ret\n" : "");
@@ -427,19 +1613,25 @@ string EmitFxLogAnd(int stackIdx, TEnvironment env,
     return exprEmissionStream.str();
 }
 
+// In safe mode, both operands are checked to be of operandType, unless it is
+// EValueType::Unknown.
 string EmitCmp(int stackIdx, TEnvironment env,
                const TClosureEnvironment& closEnv, string lhs, string rhs,
-               string setcc, bool isTail,
+               string setcc, EValueType operandType, bool isTail,
                int numFormalParamsInContainingLambda) {
     ostringstream exprEmissionStream;
     exprEmissionStream << "    # cmp(" << setcc << ").\n"
 
                        << EmitExpr(stackIdx, env, closEnv, lhs)
 
+                       << EmitTypeCheck(lhs, operandType)
+
                        << "    movq %rax, " << stackIdx << "(%rsp)\n"
 
                        << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
 
+                       << EmitTypeCheck(rhs, operandType)
+
                        << "    cmpq  %rax, " << stackIdx << "(%rsp)\n"
 
                        << "    " << setcc << " %al\n"
@@ -458,49 +1650,238 @@ string EmitCmp(int stackIdx, TEnvironment env,
 string EmitIsEq(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string lhs, string rhs,
                 bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "sete", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "sete",
+                   EValueType::Unknown, isTail,
                    numFormalParamsInContainingLambda);
 }
 
 string EmitIsCharEq(int stackIdx, TEnvironment env,
                     const TClosureEnvironment& closEnv, string lhs, string rhs,
                     bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "sete", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "sete", EValueType::Char,
+                   isTail, numFormalParamsInContainingLambda);
+}
+
+string EmitFxEq(int stackIdx, TEnvironment env,
+                const TClosureEnvironment& closEnv, string lhs, string rhs,
+                bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "sete",
+                   EValueType::FixNum, isTail,
                    numFormalParamsInContainingLambda);
 }
 
 string EmitFxLT(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string lhs, string rhs,
                 bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setl", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setl",
+                   EValueType::FixNum, isTail,
                    numFormalParamsInContainingLambda);
 }
 
 string EmitFxLE(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string lhs, string rhs,
                 bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setle", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setle",
+                   EValueType::FixNum, isTail,
                    numFormalParamsInContainingLambda);
 }
 
 string EmitFxGT(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string lhs, string rhs,
                 bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setg", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setg",
+                   EValueType::FixNum, isTail,
                    numFormalParamsInContainingLambda);
 }
 
 string EmitFxGE(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string lhs, string rhs,
                 bool isTail, int numFormalParamsInContainingLambda) {
-    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setge", isTail,
+    return EmitCmp(stackIdx, env, closEnv, lhs, rhs, "setge",
+                   EValueType::FixNum, isTail,
                    numFormalParamsInContainingLambda);
 }
 
+// Jumps to notFlonumLabel unless the value in reg is a boxed flonum.
+string EmitFlonumCheck(string reg, string notFlonumLabel) {
+    ostringstream checkOS;
+    checkOS << "    movq %" << reg << ", %r9\n"
+            << "    andq $" << HeapObjMask << ", %r9\n"
+            << "    cmpq $" << ObjTag << ", %r9\n"
+            << "    jne " << notFlonumLabel << "\n"
+            << "    cmpq $" << FlonumType << ", -" << ObjTag << "(%" << reg
+            << ")\n"
+            << "    jne " << notFlonumLabel << "\n";
+
+    return checkOS.str();
+}
+
+// Generic + - * and <. Operands that are both fixnums take an inline fast path
+// (falling back on overflow), two flonums are handled with inline SSE2 code
+// and everything else goes through the runtime.
+string EmitGenericNumOp(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv, string lhs,
+                        string rhs, string op, bool isTail,
+                        int numFormalParamsInContainingLambda) {
+    static const unordered_map<string, string> runtimeFuncs{
+        {"+", "generic_add"},
+        {"-", "generic_sub"},
+        {"*", "generic_mul"},
+        {"<", "generic_lt"}};
+    static const unordered_map<string, string> sse2Ops{
+        {"+", "addsd"}, {"-", "subsd"}, {"*", "mulsd"}};
+
+    auto slowLabel = UniqueLabel();
+    auto overflowLabel = UniqueLabel();
+    auto runtimeLabel = UniqueLabel();
+    auto doneLabel = UniqueLabel();
+
+    ostringstream exprOS;
+    exprOS << "    # " << op << ".\n"
+
+           << EmitExpr(stackIdx, env, closEnv, lhs)
+
+           << EmitStackSave(stackIdx)
+
+           << EmitExpr(stackIdx - WordSize, env, closEnv, rhs)
+
+           << "    movq " << stackIdx << "(%rsp), %r8\n"
+
+           // Both fixnums iff the OR of the two has clear fixnum tag bits.
+           << "    movq %rax, %r9\n"
+
+           << "    orq %r8, %r9\n"
+
+           << "    testq $" << FxMask << ", %r9\n"
+
+           << "    jnz " << slowLabel << "\n";
+
+    // Fast paths, starting with lhs in %r8 and rhs in %rax. Arithmetic leaves
+    // rhs in %r9 for the overflow path.
+    if (op == "+") {
+        exprOS << "    movq %rax, %r9\n"
+               << "    addq %r8, %rax\n"
+               << "    jo " << overflowLabel << "\n";
+    } else if (op == "-") {
+        exprOS << "    movq %rax, %r9\n"
+               << "    movq %r8, %rax\n"
+               << "    subq %r9, %rax\n"
+               << "    jo " << overflowLabel << "\n";
+    } else if (op == "*") {
+        exprOS << "    movq %rax, %r9\n"
+               << "    sarq $" << FxShift << ", %rax\n"
+               << "    imul %r8, %rax\n"
+               << "    jo " << overflowLabel << "\n";
+    } else {
+        assert(op == "<");
+        exprOS << "    cmpq %rax, %r8\n"
+               << "    setl %al\n"
+               << "    movzbq %al, %rax\n"
+               << "    sal $" << BoolBit << ", %al\n"
+               << "    or $" << BoolF << ", %al\n";
+    }
+
+    exprOS << doneLabel << ":\n"
+
+           << (isTail ? "    ret\n" : "");
+
+    // Slow paths, starting with lhs on the stack and rhs in %rax.
+    auto& coldCodeOS = gEmission->coldCodeOS;
+    coldCodeOS << overflowLabel << ":\n"
+               << "    movq %r9, %rax\n"
+               << slowLabel << ":\n"
+               << "    movq " << stackIdx << "(%rsp), %r8\n"
+               << EmitFlonumCheck("r8", runtimeLabel)
+               << EmitFlonumCheck("rax", runtimeLabel);
+
+    // A flonum's double lives right after its header word.
+    auto valueOffset = WordSize - ObjTag;
+
+    if (op == "<") {
+        // rhs > lhs is false for unordered operands, as it should be.
+        coldCodeOS << "    movsd " << valueOffset << "(%rax), %xmm0\n"
+                   << "    ucomisd " << valueOffset << "(%r8), %xmm0\n"
+                   << "    seta %al\n"
+                   << "    movzbq %al, %rax\n"
+                   << "    sal $" << BoolBit << ", %al\n"
+                   << "    or $" << BoolF << ", %al\n";
+    } else {
+        coldCodeOS << "    movsd " << valueOffset << "(%r8), %xmm0\n"
+                   << "    " << sse2Ops.at(op) << " " << valueOffset
+                   << "(%rax), %xmm0\n"
+                   << "    movq $" << FlonumType << ", (%rbp)\n"
+                   << "    movsd %xmm0, " << WordSize << "(%rbp)\n"
+                   << "    leaq " << ObjTag << "(%rbp), %rax\n"
+                   << "    addq $" << (2 * WordSize) << ", %rbp\n"
+                   << EmitAllocationCount(
+                          "flonum", "(" + op + " " + lhs + " " + rhs + ")",
+                          "$" + to_string(2 * WordSize));
+    }
+
+    coldCodeOS << "    jmp " << doneLabel << "\n"
+               << runtimeLabel << ":\n"
+               << EmitRuntimeCall(stackIdx - WordSize, runtimeFuncs.at(op),
+                                  {to_string(stackIdx) + "(%rsp)", "%rax"})
+               << "    jmp " << doneLabel << "\n";
+
+    return exprOS.str();
+}
+
+string EmitAdd(int stackIdx, TEnvironment env,
+               const TClosureEnvironment& closEnv, string lhs, string rhs,
+               bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitGenericNumOp(stackIdx, env, closEnv, lhs, rhs, "+", isTail,
+                            numFormalParamsInContainingLambda);
+}
+
+string EmitSub(int stackIdx, TEnvironment env,
+               const TClosureEnvironment& closEnv, string lhs, string rhs,
+               bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitGenericNumOp(stackIdx, env, closEnv, lhs, rhs, "-", isTail,
+                            numFormalParamsInContainingLambda);
+}
+
+string EmitMul(int stackIdx, TEnvironment env,
+               const TClosureEnvironment& closEnv, string lhs, string rhs,
+               bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitGenericNumOp(stackIdx, env, closEnv, lhs, rhs, "*", isTail,
+                            numFormalParamsInContainingLambda);
+}
+
+string EmitLT(int stackIdx, TEnvironment env,
+              const TClosureEnvironment& closEnv, string lhs, string rhs,
+              bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitGenericNumOp(stackIdx, env, closEnv, lhs, rhs, "<", isTail,
+                            numFormalParamsInContainingLambda);
+}
+
+// Where in the frame the object an emitter is about to make is laid out, if
+// it is to be (see EmitLetExpr), else 0. Emitters take it before emitting their
+// operands, which go on the heap.
+int TakeStackObjectIdx() {
+    auto objStackIdx = gEmission->stackObjectIdx;
+    gEmission->stackObjectIdx = 0;
+    return objStackIdx;
+}
+
 string EmitCons(int stackIdx, TEnvironment env,
                 const TClosureEnvironment& closEnv, string first, string second,
                 bool isTail, int numFormalParamsInContainingLambda) {
     ostringstream exprOS;
+    auto objStackIdx = TakeStackObjectIdx();
+
+    if (objStackIdx != 0) {
+        exprOS << "    # cons in the frame.\n"
+               << EmitExpr(stackIdx, env, closEnv, first)
+               << EmitStackSave(objStackIdx)
+               << EmitExpr(stackIdx, env, closEnv, second)
+               << EmitStackSave(objStackIdx + WordSize)
+               << "    leaq " << objStackIdx + static_cast<int>(PairTag)
+               << "(%rsp), %rax\n"
+               << (isTail ? "    ret\n" : "");
+
+        return exprOS.str();
+    }
 
     exprOS << "    # cons.\n"
 
@@ -523,6 +1904,9 @@ string EmitCons(int stackIdx, TEnvironment env,
 
            << "    addq $16, %rbp\n"  // Move the heap forward by pair size.
 
+           << EmitAllocationCount("pair",
+                                  "(cons " + first + " " + second + ")", "$16")
+
            << (isTail ? "    ret\n" : "");
 
     return exprOS.str();
@@ -561,8 +1945,8 @@ string EmitCar(int stackIdx, TEnvironment env,
     ostringstream exprOS;
 
     exprOS << "    # car.\n"
-           << EmitExpr(stackIdx, env, closEnv, carArg, isTail,
-                       numFormalParamsInContainingLambda)
+           << EmitExpr(stackIdx, env, closEnv, carArg)
+           << EmitTypeCheck(carArg, EValueType::Pair)
            << "    movq -1(%rax), %rax\n"
            << (isTail ? "    ret\n" : "");
 
@@ -576,8 +1960,9 @@ string EmitCdr(int stackIdx, TEnvironment env,
 
     exprOS << "    # cdr.\n"
 
-           << EmitExpr(stackIdx, env, closEnv, carArg, isTail,
-                       numFormalParamsInContainingLambda)
+           << EmitExpr(stackIdx, env, closEnv, carArg)
+
+           << EmitTypeCheck(carArg, EValueType::Pair)
 
            << "    movq 7(%rax), %rax\n"
 
@@ -601,6 +1986,8 @@ string EmitSetPairElement(int stackIdx, TEnvironment env,
 
            << EmitExpr(stackIdx - WordSize, env, closEnv, oldPair)
 
+           << EmitTypeCheck(oldPair, EValueType::Pair)
+
            << "    movq %rax, %r8\n"
 
            << EmitStackLoad(stackIdx)
@@ -632,11 +2019,36 @@ string EmitMakeVector(int stackIdx, TEnvironment env,
                       const TClosureEnvironment& closEnv, string lengthExpr,
                       bool isTail, int numFormalParamsInContainingLambda) {
     ostringstream exprOS;
+    auto objStackIdx = TakeStackObjectIdx();
+
+    // The length is then a literal. The elements are zeroed like those of a
+    // fresh heap.
+    if (objStackIdx != 0) {
+        auto length = stol(lengthExpr);
+        exprOS << "    # make-vector in the frame.\n"
+               << "    movq $" << (length << FxShift) << ", " << objStackIdx
+               << "(%rsp)\n";
+
+        for (int i = 1; i <= length; ++i) {
+            exprOS << "    movq $0, " << objStackIdx + WordSize * i
+                   << "(%rsp)\n";
+        }
+
+        exprOS << "    leaq " << objStackIdx + static_cast<int>(VectorTag)
+               << "(%rsp), %rax\n"
+               << (isTail ? "    ret\n" : "");
+
+        return exprOS.str();
+    }
 
     exprOS << "    # make-vector.\n"
 
            << EmitExpr(stackIdx, env, closEnv, lengthExpr)
 
+           << EmitTypeCheck(lengthExpr, EValueType::FixNum)
+
+           << EmitLengthCheck(lengthExpr)
+
            << "    movq %rax, (%rbp)\n"
 
            << "    sarq $" << FxShift << ", %rax\n"
@@ -645,6 +2057,9 @@ string EmitMakeVector(int stackIdx, TEnvironment env,
 
            << "    addq $" << WordSize << ", %rax\n"
 
+           << EmitAllocationCount("vector", "(make-vector " + lengthExpr + ")",
+                                  "%rax")
+
            << "    movq %rbp, %r8\n"
 
            << "    addq %rax, %rbp\n"
@@ -693,6 +2108,8 @@ string EmitVectorLength(int stackIdx, TEnvironment env,
 
            << EmitExpr(stackIdx, env, closEnv, expr)
 
+           << EmitTypeCheck(expr, EValueType::Vector)
+
            << "    movq -" << VectorTag << "(%rax), %rax\n"
 
            << (isTail ? "    ret\n" : "");
@@ -700,10 +2117,76 @@ string EmitVectorLength(int stackIdx, TEnvironment env,
     return exprOS.str();
 }
 
+// Safe mode vector-ref, vector-set!, string-ref and string-set!, which check
+// their operands' types and that the index is within the object's length.
+// val is empty for the refs.
+string EmitCheckedElementAccess(int stackIdx, TEnvironment env,
+                                const TClosureEnvironment& closEnv,
+                                string obj, string idx, string val,
+                                EValueType objType, bool isTail) {
+    auto tag = objType == EValueType::Vector ? VectorTag : StringTag;
+    // Element i is at obj - tag + WordSize * (i + 1), with the index tagged
+    // in %r8.
+    auto elementOperand = to_string(WordSize - tag) + "(%rax,%r8," +
+                          to_string(WordSize >> FxShift) + ")";
+    auto idxStackIdx = val.empty() ? stackIdx : stackIdx - WordSize;
+    ostringstream exprOS;
+    exprOS << "    # " << (objType == EValueType::Vector ? "vector" : "string")
+           << (val.empty() ? "-ref" : "-set!") << ".\n";
+
+    if (!val.empty()) {
+        exprOS << EmitExpr(stackIdx, env, closEnv, val)
+               << (objType == EValueType::String
+                       ? EmitTypeCheck(val, EValueType::Char)
+                       : "")
+               << EmitStackSave(stackIdx);
+    }
+
+    exprOS << EmitExpr(idxStackIdx, env, closEnv, idx)
+           << EmitTypeCheck(idx, EValueType::FixNum)
+           << EmitStackSave(idxStackIdx)
+           << EmitExpr(idxStackIdx - WordSize, env, closEnv, obj)
+           << EmitTypeCheck(obj, objType)
+           << EmitStackLoad(idxStackIdx, "r8");
+
+    // Range analysis may know the index to be within the object's length,
+    // e.g. in the check-free version of a counted loop.
+    auto idxTerm = RangeTerm(idx);
+    auto lengthTerm = IsVarName(obj) ? LengthTerm(obj, objType) : "";
+
+    if (IsKnownBelow("0", idxTerm, false) &&
+        IsKnownBelow(idxTerm, lengthTerm, true)) {
+        exprOS << "    " << ElidedCheckComment << "index.\n";
+    } else {
+        // Negative indices compare as too large.
+        exprOS << "    " << CheckComment << "index.\n"
+               << "    cmpq -" << tag << "(%rax), %r8\n"
+               << "    jae " << CheckFailedLabel(IndexCheck, "r8") << "\n";
+        AddRangeFact("0", idxTerm, false);
+        AddRangeFact(idxTerm, lengthTerm, true);
+    }
+
+    if (val.empty()) {
+        exprOS << "    movq " << elementOperand << ", %rax\n";
+    } else {
+        exprOS << EmitStackLoad(stackIdx, "r9")
+               << "    movq %r9, " << elementOperand << "\n";
+    }
+
+    exprOS << (isTail ? "    ret\n" : "");
+
+    return exprOS.str();
+}
+
 string EmitVectorSet(int stackIdx, TEnvironment env,
                      const TClosureEnvironment& closEnv, string vec, string idx,
                      string val, bool isTail,
                      int numFormalParamsInContainingLambda) {
+    if (gSafeModeEnabled) {
+        return EmitCheckedElementAccess(stackIdx, env, closEnv, vec, idx,
+                                        val, EValueType::Vector, isTail);
+    }
+
     ostringstream exprOS;
 
     exprOS << "    # vector-set!.\n"
@@ -738,6 +2221,11 @@ string EmitVectorSet(int stackIdx, TEnvironment env,
 string EmitVectorRef(int stackIdx, TEnvironment env,
                      const TClosureEnvironment& closEnv, string vec, string idx,
                      bool isTail, int numFormalParamsInContainingLambda) {
+    if (gSafeModeEnabled) {
+        return EmitCheckedElementAccess(stackIdx, env, closEnv, vec, idx,
+                                        "", EValueType::Vector, isTail);
+    }
+
     ostringstream exprOS;
 
     exprOS << "    # vector-ref.\n"
@@ -775,6 +2263,10 @@ string EmitMakeString(int stackIdx, TEnvironment env,
 
            << EmitExpr(stackIdx, env, closEnv, lengthExpr)
 
+           << EmitTypeCheck(lengthExpr, EValueType::FixNum)
+
+           << EmitLengthCheck(lengthExpr)
+
            << "    movq %rax, (%rbp)\n"
 
            << "    sarq $" << FxShift << ", %rax\n"
@@ -783,6 +2275,9 @@ string EmitMakeString(int stackIdx, TEnvironment env,
 
            << "    addq $" << WordSize << ", %rax\n"
 
+           << EmitAllocationCount("string", "(make-string " + lengthExpr + ")",
+                                  "%rax")
+
            << "    movq %rbp, %r8\n"
 
            << "    addq %rax, %rbp\n"
@@ -831,6 +2326,8 @@ string EmitStringLength(int stackIdx, TEnvironment env,
 
            << EmitExpr(stackIdx, env, closEnv, expr)
 
+           << EmitTypeCheck(expr, EValueType::String)
+
            << "    movq -" << StringTag << "(%rax), %rax\n"
 
            << (isTail ? "    ret\n" : "");
@@ -868,6 +2365,11 @@ string EmitStringSet(int stackIdx, TEnvironment env,
                      const TClosureEnvironment& closEnv, string str, string idx,
                      string val, bool isTail,
                      int numFormalParamsInContainingLambda) {
+    if (gSafeModeEnabled) {
+        return EmitCheckedElementAccess(stackIdx, env, closEnv, str, idx,
+                                        val, EValueType::String, isTail);
+    }
+
     ostringstream exprOS;
 
     exprOS << "    # string-set!.\n"
@@ -902,6 +2404,11 @@ string EmitStringSet(int stackIdx, TEnvironment env,
 string EmitStringRef(int stackIdx, TEnvironment env,
                      const TClosureEnvironment& closEnv, string str, string idx,
                      bool isTail, int numFormalParamsInContainingLambda) {
+    if (gSafeModeEnabled) {
+        return EmitCheckedElementAccess(stackIdx, env, closEnv, str, idx,
+                                        "", EValueType::String, isTail);
+    }
+
     ostringstream exprOS;
 
     exprOS << "    # string-ref.\n"
@@ -928,21 +2435,380 @@ string EmitStringRef(int stackIdx, TEnvironment env,
 
     return exprOS.str();
 }
+// Evaluates args into the stack slots from stackIdx down and passes them to
+// funcName in runtime.c.
+string EmitRuntimePrimitive(int stackIdx, TEnvironment env,
+                            const TClosureEnvironment& closEnv,
+                            string primitiveName, string funcName,
+                            const vector<string>& args, bool isTail) {
+    ostringstream exprOS;
+    vector<string> argOperands;
+    exprOS << "    # " << primitiveName << ".\n";
+
+    for (const auto& arg : args) {
+        exprOS << EmitExpr(stackIdx, env, closEnv, arg)
+               << EmitStackSave(stackIdx);
+        argOperands.push_back(to_string(stackIdx) + "(%rsp)");
+        stackIdx -= WordSize;
+    }
+
+    exprOS << EmitRuntimeCall(stackIdx, funcName, argOperands)
+           << (isTail ? "    ret\n" : "");
+
+    return exprOS.str();
+}
+
+// Eq hashtables are objects of the runtime's, which checks the tables it is
+// passed, in and out of safe mode. (make-eq-hashtable k) makes one with room
+// for k entries before it grows.
+string EmitMakeEqHashtable(int stackIdx, TEnvironment env,
+                           const TClosureEnvironment& closEnv,
+                           const vector<string>& args, bool isTail,
+                           int numFormalParamsInContainingLambda) {
+    if (args.size() > 1) {
+        throw TCompileError("make-eq-hashtable takes at most 1 argument.");
+    }
+
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "make-eq-hashtable",
+                                "make_eq_hashtable",
+                                args.empty() ? vector<string>{"0"} : args,
+                                isTail);
+}
+
+string EmitHashtableRef(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv, string table,
+                        string key, string defaultValue, bool isTail,
+                        int numFormalParamsInContainingLambda) {
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "hashtable-ref",
+                                "hashtable_ref", {table, key, defaultValue},
+                                isTail);
+}
+
+string EmitHashtableSet(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv, string table,
+                        string key, string value, bool isTail,
+                        int numFormalParamsInContainingLambda) {
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "hashtable-set!",
+                                "hashtable_set", {table, key, value}, isTail);
+}
+
+string EmitHashtableDelete(int stackIdx, TEnvironment env,
+                           const TClosureEnvironment& closEnv, string table,
+                           string key, bool isTail,
+                           int numFormalParamsInContainingLambda) {
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "hashtable-delete!",
+                                "hashtable_delete", {table, key}, isTail);
+}
+
+// Symbols. The symbols quoted in a program are laid out in its read-only data,
+// one per name however many objects of the program quote it, so that they are
+// eq? to one another and to what string->symbol returns for their names.
+// Layout matches symbol in runtime.c: a header and the name, whose string
+// follows.
+const string SymbolLabelPrefix = "sil_sym.";
+
+string SymbolLabel(string name) {
+    return SymbolLabelPrefix + MangleName(name);
+}
+
+// Lays out an object in the procedure's literal data. Objects with addresses
+// in them are relocated at startup.
+void EmitLiteralObject(string label, const vector<string>& words) {
+    bool hasAddresses = any_of(words.begin(), words.end(), [](const auto& w) {
+        return !isdigit(w[0]) && w[0] != '-';
+    });
+    auto& dataOS = gEmission->literalDataOS;
+    dataOS << "    .pushsection "
+           << (hasAddresses ? ".data.rel.ro, \"aw\"" : ".rodata") << "\n"
+           << "    .balign 8\n"
+           << label << ":\n";
+
+    for (const auto& word : words) {
+        dataOS << "    .quad " << word << "\n";
+    }
+
+    dataOS << "    .popsection\n";
+}
+
+string DatumText(const TDatum& datum) {
+    if (datum.kind != TDatum::List && datum.kind != TDatum::Vector) {
+        return datum.token;
+    }
+
+    string text = datum.kind == TDatum::Vector ? "#(" : "(";
+
+    for (size_t i = 0; i < datum.elements.size(); ++i) {
+        text += (i == 0 ? "" : " ") +
+                string(datum.isDotted && i + 1 == datum.elements.size()
+                           ? ". "
+                           : "") +
+                DatumText(datum.elements[i]);
+    }
+
+    return text + ")";
+}
+
+// Literal data: quoted data, string literals and flonums are laid out once
+// per procedure, after its code, as tagged objects. They are read-only;
+// changing one ends the program. Returns the datum's value as an operand of
+// .quad, the tagged address of its object unless it's an immediate.
+string LiteralValue(const TDatum& datum) {
+    if (datum.kind == TDatum::Immediate && !IsFlonum(datum.token)) {
+        return to_string(ImmediateRep(datum.token));
+    }
+
+    if (datum.kind == TDatum::Symbol) {
+        return SymbolLabel(datum.token) + "+" + to_string(ObjTag);
+    }
+
+    auto text = DatumText(datum);
+    auto& literalLabels = gEmission->literalLabels;
+    auto found = literalLabels.find(text);
+
+    if (found != literalLabels.end()) {
+        return found->second;
+    }
+
+    auto label = UniqueLabel("literal");
+    const auto& elements = datum.elements;
+    vector<string> words;
+    unsigned int tag;
+
+    if (datum.kind == TDatum::Immediate) {
+        double value = stod(datum.token);
+        long bits;
+        memcpy(&bits, &value, sizeof(bits));
+        tag = ObjTag;
+        words = {to_string(FlonumType), to_string(bits)};
+    } else if (datum.kind == TDatum::String) {
+        auto chars = StringLiteralChars(datum.token);
+        tag = StringTag;
+        words.push_back(to_string(chars.size() << FxShift));
+
+        for (auto c : chars) {
+            words.push_back(to_string(
+                (static_cast<unsigned char>(c) << CharShift) | CharTag));
+        }
+    } else if (datum.kind == TDatum::Vector) {
+        tag = VectorTag;
+        words.push_back(to_string(elements.size() << FxShift));
+
+        for (const auto& element : elements) {
+            words.push_back(LiteralValue(element));
+        }
+    } else {
+        // The pairs of a list follow one another, each one's cdr pointing to
+        // the next.
+        auto numPairs = elements.size() - (datum.isDotted ? 1 : 0);
+        tag = PairTag;
+
+        for (size_t i = 0; i < numPairs; ++i) {
+            words.push_back(LiteralValue(elements[i]));
+            words.push_back(i + 1 < numPairs
+                                ? label + "+" +
+                                      to_string((i + 1) * 2 * WordSize +
+                                                PairTag)
+                            : datum.isDotted ? LiteralValue(elements.back())
+                                             : to_string(Null));
+        }
+    }
+
+    EmitLiteralObject(label, words);
+
+    return literalLabels[text] = label + "+" + to_string(tag);
+}
+
+string EmitQuote(int stackIdx, TEnvironment env,
+                 const TClosureEnvironment& closEnv, const TDatum& datum,
+                 bool isTail) {
+    if (datum.kind == TDatum::Immediate && !IsFlonum(datum.token)) {
+        return EmitLoadImmediate(ImmediateRep(datum.token)) +
+               (isTail ? "    ret\n" : "");
+    }
+
+    ostringstream exprOS;
+
+    exprOS << "    # Literal: " << AbbreviateSource(DatumText(datum)) << ".\n"
+           << "    leaq " << LiteralValue(datum) << "(%rip), %rax\n"
+           << (isTail ? "    ret\n" : "");
+
+    return exprOS.str();
+}
+
+string EmitIsSymbol(int stackIdx, TEnvironment env,
+                    const TClosureEnvironment& closEnv, string isSymbolArg,
+                    bool isTail, int numFormalParamsInContainingLambda) {
+    auto doneLabel = UniqueLabel();
+    ostringstream exprOS;
+
+    exprOS << "    # symbol?.\n"
+
+           << EmitExpr(stackIdx, env, closEnv, isSymbolArg)
+
+           << "    leaq -" << ObjTag << "(%rax), %r8\n"
+
+           << "    movq $" << BoolF << ", %rax\n"
+
+           << "    test $" << HeapObjMask << ", %r8b\n"
+
+           << "    jne " << doneLabel << "\n"
+
+           << "    cmpb $" << SymbolType << ", (%r8)\n"
+
+           << "    jne " << doneLabel << "\n"
+
+           << "    movq $" << BoolT << ", %rax\n"
+
+           << doneLabel << ":\n"
+
+           << (isTail ? "    ret\n" : "");
+
+    return exprOS.str();
+}
+
+// The runtime interns the symbols made at run time, and checks what it is
+// passed, in and out of safe mode. The string a symbol is named by is the
+// symbol's own, not to be changed.
+string EmitStringToSymbol(int stackIdx, TEnvironment env,
+                          const TClosureEnvironment& closEnv, string str,
+                          bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "string->symbol",
+                                "string_to_symbol", {str}, isTail);
+}
+
+string EmitSymbolToString(int stackIdx, TEnvironment env,
+                          const TClosureEnvironment& closEnv, string symbol,
+                          bool isTail, int numFormalParamsInContainingLambda) {
+    return EmitRuntimePrimitive(stackIdx, env, closEnv, "symbol->string",
+                                "symbol_to_string", {symbol}, isTail);
+}
+
+// Lays out the symbols code refers to. Each is in a COMDAT group of its own,
+// named by its label, so that the linker keeps one per name, and listed in the
+// sil_symbols section for the runtime to intern.
+string EmitSymbolTable(const string& code) {
+    set<string> labels;
+
+    for (auto pos = code.find(SymbolLabelPrefix); pos != string::npos;
+         pos = code.find(SymbolLabelPrefix, pos + 1)) {
+        auto end = pos + SymbolLabelPrefix.size();
+
+        while (end < code.size() &&
+               (isalnum(static_cast<unsigned char>(code[end])) ||
+                code[end] == '_' || code[end] == '$')) {
+            ++end;
+        }
+
+        labels.insert(code.substr(pos, end - pos));
+    }
+
+    ostringstream tableOS;
+
+    for (const auto& label : labels) {
+        auto name = DemangleName(label.substr(SymbolLabelPrefix.size()));
+        tableOS << "    .section .data.rel.ro." << label
+                << ", \"awG\", @progbits, "
+                << label << ", comdat\n"
+                << "    .balign 8\n"
+                << "    .weak " << label << "\n"
+                << label << ":\n"
+                << "    .quad " << SymbolType << ", " << label << "+"
+                << (2 * WordSize + StringTag) << "\n"
+                << "    .quad " << (name.size() << FxShift) << "\n";
+
+        for (auto c : name) {
+            tableOS << "    .quad "
+                    << ((static_cast<unsigned char>(c) << CharShift) | CharTag)
+                    << "\n";
+        }
+
+        tableOS << "    .section sil_symbols, \"awG\", @progbits, " << label
+                << ", comdat\n"
+                << "    .balign 8\n"
+                << "    .quad " << label << "+" << ObjTag << "\n";
+    }
+
+    if (!labels.empty()) {
+        tableOS << "    .text\n";
+    }
+
+    return tableOS.str();
+}
+
+// Emits a test of cond that jumps to falseLabel when cond is #f and falls
+// through otherwise. and/or conditions branch on each argument in turn,
+// without building their values. What tag inference learns holds where the
+// code falls through.
+string EmitBranchIfFalse(int stackIdx, TEnvironment env,
+                         const TClosureEnvironment& closEnv, string cond,
+                         string falseLabel) {
+    string primitiveName;
+    vector<string> args;
+    ostringstream branchOS;
+
+    if (!TryParseVariableArityPrimitive(cond, &primitiveName, &args) ||
+        (primitiveName != "and" && primitiveName != "or")) {
+        branchOS << EmitExpr(stackIdx, env, closEnv, cond)
+                 << "    cmp $" << BoolF << ", %al\n"
+                 << "    je " << falseLabel << "\n";
+        AddFactsWhen(cond, true);
+
+        return branchOS.str();
+    }
+
+    // Each argument of an and falls through to the next, all of them to the
+    // code after the and.
+    if (primitiveName == "and") {
+        for (const auto& arg : args) {
+            branchOS << EmitBranchIfFalse(stackIdx, env, closEnv, arg,
+                                          falseLabel);
+        }
+
+        return branchOS.str();
+    }
+
+    if (args.empty()) {
+        return "    jmp " + falseLabel + "\n";
+    }
+
+    // Any true argument but the last skips the rest. Only the first argument
+    // is evaluated whichever is true.
+    auto trueLabel = UniqueLabel();
+    auto factsMark = MarkFacts();
+
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        branchOS << EmitExpr(stackIdx, env, closEnv, args[i])
+                 << "    cmp $" << BoolF << ", %al\n"
+                 << "    jne " << trueLabel << "\n";
+
+        if (i == 0) {
+            factsMark = MarkFacts();
+        }
+
+        AddFactsWhen(args[i], false);
+    }
+
+    branchOS << EmitBranchIfFalse(stackIdx, env, closEnv, args.back(),
+                                  falseLabel)
+             << trueLabel << ":\n";
+    DropFactsSince(factsMark);
+
+    return branchOS.str();
+}
+
 string EmitIfExpr(int stackIdx, TEnvironment env,
                   const TClosureEnvironment& closEnv, string cond,
                   string conseq, string alt, bool isTail,
                   int numFormalParamsInContainingLambda) {
     string altLabel = UniqueLabel();
     string endLabel = UniqueLabel();
+    auto factsMark = MarkFacts();
 
     ostringstream exprEmissionStream;
     exprEmissionStream << "    # if.\n"
 
-                       << EmitExpr(stackIdx, env, closEnv, cond)
-
-                       << "    cmp $" << BoolF << ", %al\n"
-
-                       << "    je " << altLabel << "\n"
+                       << EmitBranchIfFalse(stackIdx, env, closEnv, cond,
+                                            altLabel)
 
                        << EmitExpr(stackIdx, env, closEnv, conseq, isTail,
                                    numFormalParamsInContainingLambda);
@@ -951,6 +2817,9 @@ string EmitIfExpr(int stackIdx, TEnvironment env,
         exprEmissionStream << "    jmp " << endLabel << "\n";
     }
 
+    DropFactsSince(factsMark);
+    AddFactsWhen(cond, false);
+
     exprEmissionStream << altLabel << ":\n"
 
                        << EmitExpr(stackIdx, env, closEnv, alt, isTail,
@@ -960,46 +2829,68 @@ string EmitIfExpr(int stackIdx, TEnvironment env,
         exprEmissionStream << endLabel << ":\n";
     }
 
+    DropFactsSince(factsMark);
+
     return exprEmissionStream.str();
 }
 
+// (and a b c) is the first #f argument or the value of c; (or a b c) is #t if
+// a or b is true, or the value of c. Both evaluate their arguments in turn
+// and, on the first one that decides the value, leave through a label shared
+// by all of them.
 string EmitLogicalExpr(int stackIdx, TEnvironment env,
                        const TClosureEnvironment& closEnv,
                        const vector<string>& args, bool isAnd, bool isTail,
                        int numFormalParamsInContainingLambda) {
+    if (args.size() <= 1) {
+        auto value = args.empty() ? (isAnd ? "#t" : "#f") : args[0];
+        return EmitExpr(stackIdx, env, closEnv, value, isTail,
+                        numFormalParamsInContainingLambda);
+    }
+
+    // An #f leaving an and is its value already; a true value leaving an or
+    // becomes #t.
+    auto exitLabel = UniqueLabel();
     ostringstream exprEmissionStream;
+    exprEmissionStream << (isAnd ? "    # and.\n" : "    # or.\n");
+    // Each argument is only evaluated when the ones before it didn't decide
+    // the value. Only the first one always is.
+    auto factsMark = MarkFacts();
+
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        exprEmissionStream << EmitExpr(stackIdx, env, closEnv, args[i])
+                           << "    cmp $" << BoolF << ", %al\n"
+                           << (isAnd ? "    je " : "    jne ") << exitLabel
+                           << "\n";
+
+        if (i == 0) {
+            factsMark = MarkFacts();
+        }
 
-    if (args.size() == 0) {
-        exprEmissionStream << EmitExpr(stackIdx, env, closEnv, "#t", isTail,
-                                       numFormalParamsInContainingLambda);
-    } else if (args.size() == 1) {
-        exprEmissionStream << EmitExpr(stackIdx, env, closEnv, args[0], isTail,
-                                       numFormalParamsInContainingLambda);
-    } else {
-        ostringstream newExpr;
-        newExpr << "(" << (isAnd ? "and" : "or");
+        AddFactsWhen(args[i], isAnd);
+    }
 
-        for (int i = 1; i < args.size(); ++i) {
-            newExpr << " " << args[i];
-        }
+    exprEmissionStream << EmitExpr(stackIdx, env, closEnv, args.back(), isTail,
+                                   numFormalParamsInContainingLambda);
+    DropFactsSince(factsMark);
 
-        newExpr << ")";
+    if (isAnd) {
+        exprEmissionStream << exitLabel << ":\n"
+                           << (isTail ? "    ret\n" : "");
 
-        if (isAnd) {
-            exprEmissionStream
-                << "    # and.\n"
+        return exprEmissionStream.str();
+    }
 
-                << EmitIfExpr(stackIdx, env, closEnv, args[0], newExpr.str(),
-                              "#f", isTail, numFormalParamsInContainingLambda);
-        } else {
-            exprEmissionStream << "    # or.\n"
+    auto endLabel = UniqueLabel();
 
-                               << EmitIfExpr(stackIdx, env, closEnv, args[0],
-                                             "#t", newExpr.str(), isTail,
-                                             numFormalParamsInContainingLambda);
-        }
+    if (!isTail) {
+        exprEmissionStream << "    jmp " << endLabel << "\n";
     }
 
+    exprEmissionStream << exitLabel << ":\n"
+                       << EmitLoadImmediate(BoolT)
+                       << (isTail ? "    ret\n" : endLabel + ":\n");
+
     return exprEmissionStream.str();
 }
 
@@ -1019,20 +2910,320 @@ string EmitOrExpr(int stackIdx, TEnvironment env,
                            numFormalParamsInContainingLambda);
 }
 
-string EmitLetExpr(int stackIdx, TEnvironment env,
-                   const TClosureEnvironment& closEnv,
-                   const TBindings& bindings, vector<string> letBody,
-                   bool isTail, int numFormalParamsInContainingLambda) {
-    ostringstream exprEmissionStream;
-    int si = stackIdx;
-    TEnvironment envExtension;
+bool IsNameUsedIn(string name, string source);
 
-    exprEmissionStream << "    # let.\n";
+// Whether name is only used in expr to be called with numArgs arguments, where
+// freeVars are bound as where name is. Uses in lambdas don't count as calls:
+// the lambdas may be called from anywhere.
+bool IsOnlyCalledIn(string name, string expr, int numArgs,
+                    const vector<string>& freeVars) {
+    if (IsVarName(expr)) {
+        return expr != name;
+    }
+
+    if (TryParseQuote(expr)) {
+        return true;
+    }
+
+    vector<string> formalArgs;
+    string body;
+
+    if (TryParseLambda(expr, &formalArgs, &body)) {
+        return find(formalArgs.begin(), formalArgs.end(), name) !=
+                   formalArgs.end() ||
+               !IsNameUsedIn(name, body);
+    }
+
+    // Past a binding of name, the uses are of another variable; past a
+    // binding of one of freeVars, no call can be lifted.
+    bool isFreeVarBound = false;
+    auto isOnlyCalledIn = [&](const string& subExpr) {
+        return isFreeVarBound
+                   ? !IsNameUsedIn(name, subExpr)
+                   : IsOnlyCalledIn(name, subExpr, numArgs, freeVars);
+    };
+    TBindings bindings;
+    TOrderedBindings orderedBindings;
+    vector<string> letBody;
+    bool isLet = TryParseLetExpr(expr, &bindings, &letBody);
+
+    if (isLet || TryParseLetAsteriskExpr(expr, &orderedBindings, &letBody)) {
+        if (isLet) {
+            orderedBindings.assign(bindings.begin(), bindings.end());
+        }
+
+        bool isNameBound = false;
+
+        for (const auto& b : orderedBindings) {
+            if (!isNameBound && !isOnlyCalledIn(b.second)) {
+                return false;
+            }
+
+            if (!isLet) {
+                isNameBound = isNameBound || b.first == name;
+                isFreeVarBound =
+                    isFreeVarBound || find(freeVars.begin(), freeVars.end(),
+                                           b.first) != freeVars.end();
+            }
+        }
+
+        for (const auto& b : orderedBindings) {
+            isNameBound = isNameBound || b.first == name;
+            isFreeVarBound = isFreeVarBound ||
+                             find(freeVars.begin(), freeVars.end(), b.first) !=
+                                 freeVars.end();
+        }
+
+        return isNameBound ||
+               all_of(letBody.begin(), letBody.end(), isOnlyCalledIn);
+    }
+
+    string procName;
+    vector<string> params;
+
+    if (!TryParseProcCallExpr(expr, &procName, &params)) {
+        return true;
+    }
+
+    if (procName == name) {
+        return params.size() == numArgs &&
+               all_of(params.begin(), params.end(), isOnlyCalledIn);
+    }
+
+    return isOnlyCalledIn(procName) &&
+           all_of(params.begin(), params.end(), isOnlyCalledIn);
+}
+
+// Lambdas with more free variables than this are left closures: their boxes
+// are passed on every call.
+const int MaxLiftedFreeVars = 4;
+
+// Lifts the lambda value bound to name by a let expression with bindings and
+// letBody when its calls are all known: queues its code to be emitted as a
+// procedure of its own and returns true.
+bool TryLiftLambda(TEnvironment env, const TClosureEnvironment& closEnv,
+                   string name, string value, const TBindings& bindings,
+                   const vector<string>& letBody, TLiftedLambda* outLifted) {
+    vector<string> formalArgs;
+    string body;
+    vector<string> possibleFreeVars;
+
+    if (IsCapturedVar(closEnv, name) ||
+        !TryParseLambda(value, &formalArgs, &body, &possibleFreeVars)) {
+        return false;
+    }
+
+    auto freeVars = LambdaFreeVars(env, closEnv, possibleFreeVars);
+
+    if (freeVars.size() > MaxLiftedFreeVars) {
+        return false;
+    }
+
+    // The boxes of the free variables are passed where the lambda is called,
+    // in letBody, so none of them may be bound anew by the let; name neither,
+    // when the lambda refers to the variable it shadows.
+    for (const auto& var : freeVars) {
+        if (bindings.count(var) != 0) {
+            return false;
+        }
+    }
+
+    for (const auto& expr : letBody) {
+        if (!IsOnlyCalledIn(name, expr, formalArgs.size(), freeVars)) {
+            return false;
+        }
+    }
+
+    auto label = UniqueLabel();
+    gEmission->pendingLambdas.push_back(
+        {label, label, value, formalArgs, body, TClosureEnvironment(),
+         label.substr(label.find("_L_") + 3) + ".",
+         gCompilation->emitLineInfo ? LocateSubExpr(value) : TSourceSpan(),
+         freeVars});
+    *outLifted = {label, freeVars};
+
+    return true;
+}
+
+// The lifted lambda a call to procName goes to, if any.
+const TLiftedLambda* FindLiftedLambda(TEnvironment env,
+                                      const TClosureEnvironment& closEnv,
+                                      string procName) {
+    auto lifted = gEmission->liftedLambdas.find(procName);
+
+    if (lifted == gEmission->liftedLambdas.end() ||
+        IsLocalOrCapturedVar(env, closEnv, procName)) {
+        return nullptr;
+    }
+
+    return &lifted->second;
+}
+
+// Primitives that neither keep nor return their operands.
+const unordered_set<string> OperandKeepingNothingPrimitives = {
+    "car", "cdr", "pair?", "vector?", "vector-length", "procedure?", "null?",
+    "eq?"};
+// Primitives that read or change the object that is their first operand.
+const unordered_set<string> ObjectAccessPrimitives = {
+    "set-car!", "set-cdr!", "vector-ref", "vector-set!"};
+
+// Whether the value of the variable name can't outlive expr: whether expr
+// only calls it, accesses it with primitives and compares it.
+bool IsNotEscapingIn(string name, string expr) {
+    if (IsVarName(expr)) {
+        return expr != name;
+    }
+
+    if (TryParseQuote(expr)) {
+        return true;
+    }
+
+    vector<string> formalArgs;
+    string body;
+
+    if (TryParseLambda(expr, &formalArgs, &body)) {
+        return find(formalArgs.begin(), formalArgs.end(), name) !=
+                   formalArgs.end() ||
+               !IsNameUsedIn(name, body);
+    }
+
+    auto isNotEscapingIn = [&](const string& subExpr) {
+        return IsNotEscapingIn(name, subExpr);
+    };
+    TBindings bindings;
+    TOrderedBindings orderedBindings;
+    vector<string> letBody;
+    bool isLet = TryParseLetExpr(expr, &bindings, &letBody);
+
+    if (isLet || TryParseLetAsteriskExpr(expr, &orderedBindings, &letBody)) {
+        if (isLet) {
+            orderedBindings.assign(bindings.begin(), bindings.end());
+        }
+
+        for (const auto& b : orderedBindings) {
+            if (!IsNotEscapingIn(name, b.second)) {
+                return false;
+            }
+
+            if (!isLet && b.first == name) {
+                return true;
+            }
+        }
+
+        return any_of(orderedBindings.begin(), orderedBindings.end(),
+                      [&](const pair<string, string>& b) {
+                          return b.first == name;
+                      }) ||
+               all_of(letBody.begin(), letBody.end(), isNotEscapingIn);
+    }
+
+    string procName;
+    vector<string> params;
+
+    if (!TryParseProcCallExpr(expr, &procName, &params)) {
+        return true;
+    }
+
+    if (OperandKeepingNothingPrimitives.count(procName) != 0) {
+        return all_of(params.begin(), params.end(), [&](const string& p) {
+            return p == name || isNotEscapingIn(p);
+        });
+    }
+
+    if (ObjectAccessPrimitives.count(procName) != 0 && !params.empty() &&
+        params[0] == name) {
+        return all_of(params.begin() + 1, params.end(), isNotEscapingIn);
+    }
+
+    return (procName == name || isNotEscapingIn(procName)) &&
+           all_of(params.begin(), params.end(), isNotEscapingIn);
+}
+
+// Vectors longer than this aren't laid out in frames.
+const int MaxStackVectorLength = 16;
+
+// The number of words of the frame a let binding's value is laid out in:
+// those of the pair, vector or closure it makes if the value can't outlive the
+// let's body, else 0.
+int StackObjectSize(TEnvironment env, const TClosureEnvironment& closEnv,
+                    string name, string value, const vector<string>& letBody) {
+    string primitiveName;
+    vector<string> args;
+    vector<string> formalArgs;
+    string body;
+    vector<string> possibleFreeVars;
+    int size = 0;
+
+    if (TryParseBinaryPrimitive(value, &primitiveName, &args) &&
+        primitiveName == "cons") {
+        size = 2;
+    } else if (TryParseUnaryPrimitive(value, &primitiveName, &args) &&
+               primitiveName == "make-vector" && IsFixNum(args[0])) {
+        // Fixnum literals can be wider than an int.
+        auto length = stol(args[0]);
+        size = (0 <= length && length <= MaxStackVectorLength) ? length + 1 : 0;
+    } else if (TryParseLambda(value, &formalArgs, &body, &possibleFreeVars)) {
+        // Closures without free variables are laid out statically.
+        size = LambdaFreeVars(env, closEnv, possibleFreeVars).size();
+        size = size == 0 ? 0 : size + 1;
+    }
+
+    if (size == 0 || !all_of(letBody.begin(), letBody.end(),
+                             [&](const string& expr) {
+                                 return IsNotEscapingIn(name, expr);
+                             })) {
+        return 0;
+    }
+
+    return size;
+}
+
+// Lambdas bound by let that are only called in its body are lifted (see
+// TryLiftLambda) instead of bound. Pairs, vectors and closures that can't
+// outlive the let's body are laid out in the frame, above the slots the body
+// uses, instead of on the heap.
+string EmitLetExpr(int stackIdx, TEnvironment env,
+                   const TClosureEnvironment& closEnv,
+                   const TBindings& bindings, vector<string> letBody,
+                   bool isTail, int numFormalParamsInContainingLambda) {
+    ostringstream exprEmissionStream;
+    int si = stackIdx;
+    TEnvironment envExtension;
+    unordered_map<string, TLiftedLambda> liftedLambdas;
+    auto outerStackClosures = gEmission->stackClosures;
+    auto factsMark = MarkFacts();
+
+    exprEmissionStream << "    # let.\n";
 
     for (auto b : bindings) {
+        TLiftedLambda lifted;
+
+        if (TryLiftLambda(env, closEnv, b.first, b.second, bindings, letBody,
+                          &lifted)) {
+            exprEmissionStream << "      # binding: " << b.first
+                               << " (lifted to " << lifted.label << ").\n";
+            liftedLambdas[b.first] = lifted;
+            continue;
+        }
+
+        // An object laid out in the frame goes right below the variable's
+        // slot.
+        auto objSize =
+            StackObjectSize(env, closEnv, b.first, b.second, letBody);
+        auto valueStackIdx = si;
+
+        if (objSize != 0) {
+            valueStackIdx = si - WordSize * (objSize + 1);
+            gEmission->stackObjectIdx = valueStackIdx + WordSize;
+
+            if (TryParseLambda(b.second)) {
+                gEmission->stackClosures[b.first] = si;
+            }
+        }
+
         exprEmissionStream << "      # binding: " << b.first << ".\n"
 
-                           << EmitExpr(si, env, closEnv, b.second)
+                           << EmitExpr(valueStackIdx, env, closEnv, b.second)
 
                            << "    # Promote var from stack to heap.\n"
 
@@ -1042,22 +3233,38 @@ string EmitLetExpr(int stackIdx, TEnvironment env,
 
                            << EmitStackSave(si)
 
-                           << "    addq $" << WordSize << ", %rbp\n";
+                           << "    addq $" << WordSize << ", %rbp\n"
+
+                           << EmitAllocationCount("box", "let " + b.first,
+                                                  "$" + to_string(WordSize));
 
         envExtension.insert({b.first, si});
-        si -= WordSize;
+        si -= WordSize * (objSize + 1);
     }
 
     for (auto v : envExtension) {
         env[v.first] = v.second;
     }
 
+    auto outerLiftedLambdas = gEmission->liftedLambdas;
+
+    for (const auto& l : liftedLambdas) {
+        env.erase(l.first);
+        gEmission->liftedLambdas[l.first] = l.second;
+    }
+
+    AddBindingFacts(TOrderedBindings(bindings.begin(), bindings.end()));
+
     for (int i = 0; i < letBody.size(); ++i) {
         exprEmissionStream << EmitExpr(si, env, closEnv, letBody[i],
                                        isTail && (i == letBody.size() - 1),
                                        numFormalParamsInContainingLambda);
     }
 
+    DropFactsSince(factsMark);
+    gEmission->liftedLambdas.swap(outerLiftedLambdas);
+    gEmission->stackClosures.swap(outerStackClosures);
+
     return exprEmissionStream.str();
 }
 
@@ -1068,6 +3275,7 @@ string EmitLetAsteriskExpr(int stackIdx, TEnvironment env,
                            int numFormalParamsInContainingLambda) {
     ostringstream exprEmissionStream;
     int si = stackIdx;
+    auto factsMark = MarkFacts();
 
     exprEmissionStream << "    # let*.\n";
 
@@ -1083,9 +3291,13 @@ string EmitLetAsteriskExpr(int stackIdx, TEnvironment env,
 
                            << EmitStackSave(si)
 
-                           << "    addq $" << WordSize << ", %rbp\n";
+                           << "    addq $" << WordSize << ", %rbp\n"
+
+                           << EmitAllocationCount("box", "let " + b.first,
+                                                  "$" + to_string(WordSize));
 
         env[b.first] = si;
+        AddBindingFacts({b});
         si -= WordSize;
     }
 
@@ -1094,14 +3306,92 @@ string EmitLetAsteriskExpr(int stackIdx, TEnvironment env,
                                        isTail && (i == letBody.size() - 1));
     }
 
+    DropFactsSince(factsMark);
+
     return exprEmissionStream.str();
 }
 
-static TLambdaTable gLambdaTable;
+// Label of a top-level or imported procedure, which calls go straight to.
+string DirectCallLabel(string procName, int numArgs) {
+    auto label = gCompilation->lambdaTable.find(procName);
+
+    if (label == gCompilation->lambdaTable.end()) {
+        throw TCompileError("Call to undefined procedure " + procName + ".");
+    }
+
+    auto importedNumArgs = gCompilation->importedProcNumArgs.find(procName);
+
+    if (importedNumArgs != gCompilation->importedProcNumArgs.end() &&
+        importedNumArgs->second != numArgs) {
+        throw TCompileError("Imported procedure " + procName + " takes " +
+                            to_string(importedNumArgs->second) +
+                            " arguments, called with " + to_string(numArgs) +
+                            ".");
+    }
+
+    return label->second;
+}
+
+// Label a direct call to procName with params goes to: that of the check-free
+// version of the counted loop being emitted, when the call is the loop's and
+// keeps its index within range, else the procedure's own.
+string DirectCallTarget(string procName, const vector<string>& params) {
+    auto label = DirectCallLabel(procName, params.size());
+    const auto& loop = gEmission->countedLoop;
+
+    if (loop.procName != procName ||
+        params.size() != loop.formalArgs.size()) {
+        return label;
+    }
+
+    string indexParam;
+
+    for (size_t i = 0; i < params.size(); ++i) {
+        auto arg = loop.formalArgs[i];
+        bool isObj = find_if(loop.objs.begin(), loop.objs.end(),
+                             [&](const pair<string, EValueType>& obj) {
+                                 return obj.first == arg;
+                             }) != loop.objs.end();
+
+        if ((arg == loop.bound || isObj) && params[i] != arg) {
+            return label;
+        }
+
+        if (arg == loop.index) {
+            indexParam = params[i];
+        }
+    }
+
+    if (InferType(loop.index) != EValueType::FixNum ||
+        (IsVarName(loop.bound) &&
+         InferType(loop.bound) != EValueType::FixNum)) {
+        return label;
+    }
+
+    for (const auto& obj : loop.objs) {
+        if (InferType(obj.first) != obj.second ||
+            !IsKnownBelow(loop.bound, LengthTerm(obj.first, obj.second),
+                          false)) {
+            return label;
+        }
+    }
+
+    bool isStep = indexParam == "(fxadd1 " + loop.index + ")" ||
+                  indexParam == "(fx+ " + loop.index + " 1)";
+
+    if ((indexParam != loop.index && !isStep) ||
+        !IsKnownBelow("0", loop.index, false) ||
+        !IsKnownBelow(loop.index, loop.bound, isStep)) {
+        return label;
+    }
+
+    return loop.fastLabel;
+}
 
 string EmitSaveProcParamsOnStack(int stackIdx, TEnvironment env,
                                  const TClosureEnvironment& closEnv,
-                                 vector<string> params, bool promoteToHeap) {
+                                 string procName, vector<string> params,
+                                 bool promoteToHeap) {
     ostringstream callOS;
     // Leave room to store the return address and %rbp on the stack.
     auto paramStackIdx = stackIdx - (WordSize * 2);
@@ -1121,7 +3411,10 @@ string EmitSaveProcParamsOnStack(int stackIdx, TEnvironment env,
         callOS << EmitStackSave(paramStackIdx);
 
         if (promoteToHeap) {
-            callOS << "    addq $" << WordSize << ", %rbp\n";
+            callOS << "    addq $" << WordSize << ", %rbp\n"
+                   << EmitAllocationCount("box",
+                                          "argument " + p + " of " + procName,
+                                          "$" + to_string(WordSize));
         }
 
         paramStackIdx -= WordSize;
@@ -1130,12 +3423,43 @@ string EmitSaveProcParamsOnStack(int stackIdx, TEnvironment env,
     return callOS.str();
 }
 
+// Stores the boxes of the lifted lambda's free variables after the params of
+// a call to it.
+string EmitSaveLiftedFreeVarsOnStack(int stackIdx, TEnvironment env,
+                                     const TClosureEnvironment& closEnv,
+                                     const TLiftedLambda& lifted,
+                                     int numParams) {
+    ostringstream callOS;
+    auto paramStackIdx = stackIdx - WordSize * (2 + numParams);
+
+    for (const auto& var : lifted.freeVars) {
+        callOS << "    # Emit free var box on stack: " << var << ".\n"
+               << EmitVarRef(env, closEnv, var, false, -1)
+               << EmitStackSave(paramStackIdx);
+        paramStackIdx -= WordSize;
+    }
+
+    return callOS.str();
+}
+
 string EmitProcCall(int stackIdx, TEnvironment env,
                     const TClosureEnvironment& closEnv, string procName,
                     vector<string> params,
                     int numFormalParamsInContainingLambda) {
     ostringstream callOS;
-    callOS << EmitSaveProcParamsOnStack(stackIdx, env, closEnv, params, true);
+    auto lifted = FindLiftedLambda(env, closEnv, procName);
+    callOS << EmitSaveProcParamsOnStack(stackIdx, env, closEnv, procName,
+                                        params, true);
+
+    if (lifted != nullptr) {
+        callOS << EmitSaveLiftedFreeVarsOnStack(stackIdx, env, closEnv,
+                                                *lifted, params.size());
+    }
+
+    // Calls to closures change %rdi, and so may direct calls, which a
+    // closure's code needs kept for its free variables.
+    bool savesClosure = IsLocalOrCapturedVar(env, closEnv, procName) ||
+                        !IsVarName(procName) || !closEnv.empty();
 
     // 1 - Adjust the base pointer to the current top of the stack.
     //
@@ -1145,148 +3469,872 @@ string EmitProcCall(int stackIdx, TEnvironment env,
 
     callOS << "    # Call: " + procName << ".\n";
 
-    if (IsLocalOrCapturedVar(env, closEnv, procName)) {
+    if (savesClosure) {
         callOS << EmitStackSave(stackIdx, "rdi");
+    }
+
+    if (IsLocalOrCapturedVar(env, closEnv, procName)) {
+        callOS << EmitVarVal(env, closEnv, procName, false,
+                             numFormalParamsInContainingLambda)
+
+               << EmitTypeCheck(procName, EValueType::Procedure)
+
+               << "    movq %rax, %rdi\n"
+
+               << "    movq -" << ClosureTag << "(%rax), %rax\n"
+
+               << "    addq $" << stackIdx << ", %rsp\n"
+               << EmitCfiFrameBase(-stackIdx)
+
+               << "    call *%rax\n";
+    } else if (!IsVarName(procName)) {
+        // Evaluate the operator below the already stored params.
+        callOS << EmitExpr(stackIdx - WordSize * (2 + params.size()), env,
+                           closEnv, procName)
+
+               << EmitTypeCheck(procName, EValueType::Procedure)
+
+               << "    movq %rax, %rdi\n"
+
+               << "    movq -" << ClosureTag << "(%rax), %rax\n"
+
+               << "    addq $" << stackIdx << ", %rsp\n"
+               << EmitCfiFrameBase(-stackIdx)
+
+               << "    call *%rax\n";
+
+    } else {
+        auto target = lifted != nullptr ? lifted->label
+                                        : DirectCallTarget(procName, params);
+
+        // A new frame goes through the stack check at the procedure's start.
+        if (target == gEmission->countedLoop.fastLabel) {
+            target = DirectCallLabel(procName, params.size());
+        }
+
+        callOS << "    addq $" << stackIdx << ", %rsp\n"
+               << EmitCfiFrameBase(-stackIdx)
+               << "    call " << target << "\n";
+    }
+
+    callOS << EmitCallSiteInfo(stackIdx)
+           << "    subq $" << stackIdx << ", %rsp\n"
+           << EmitCfiFrameBase(0);
+
+    if (savesClosure) {
+        callOS << EmitStackLoad(stackIdx, "rdi");
+        stackIdx += WordSize;
+    }
+
+    return callOS.str();
+}
+
+string EmitTailProcCall(int stackIdx, TEnvironment env,
+                        const TClosureEnvironment& closEnv, string procName,
+                        vector<string> params,
+                        int numFormalParamsInContainingLambda) {
+    auto stackClosure = gEmission->stackClosures.find(procName);
+
+    // The callee's frame would take the place of a closure in the current
+    // one.
+    if (stackClosure != gEmission->stackClosures.end() &&
+        IsLocalVar(env, procName) && env[procName] == stackClosure->second) {
+        return EmitProcCall(stackIdx, env, closEnv, procName, params,
+                            numFormalParamsInContainingLambda) +
+               "    ret\n";
+    }
+
+    ostringstream callOS;
+    auto lifted = FindLiftedLambda(env, closEnv, procName);
+    callOS << "    # Tail call: " << procName << ".\n"
+           << EmitSaveProcParamsOnStack(stackIdx, env, closEnv, procName,
+                                        params, false);
+
+    if (lifted != nullptr) {
+        callOS << EmitSaveLiftedFreeVarsOnStack(stackIdx, env, closEnv,
+                                                *lifted, params.size());
+    }
 
+    auto oldParamStackIdx = stackIdx - WordSize * 2;
+    auto newParamStackIdx = -WordSize;
+
+    if (IsLocalOrCapturedVar(env, closEnv, procName)) {
         callOS << EmitVarVal(env, closEnv, procName, false,
                              numFormalParamsInContainingLambda)
 
-               << "    movq %rax, %rdi\n"
+               << EmitTypeCheck(procName, EValueType::Procedure)
+
+               << "    movq %rax, %rdi\n"
+
+               << "    movq -" << ClosureTag << "(%rax), %r9\n";
+    } else if (!IsVarName(procName)) {
+        callOS << EmitExpr(stackIdx - WordSize * (2 + params.size()), env,
+                           closEnv, procName)
+
+               << EmitTypeCheck(procName, EValueType::Procedure)
+
+               << "    movq %rax, %rdi\n"
+
+               << "    movq -" << ClosureTag << "(%rax), %r9\n";
+    }
+
+    int paramIdx = 0;
+
+    for (auto p : params) {
+        callOS << "    movq " << oldParamStackIdx << "(%rsp), %rbx\n";
+
+        // The lifted lambda may see the boxes of the current arguments as
+        // those of its free variables.
+        if (paramIdx >= numFormalParamsInContainingLambda ||
+            lifted != nullptr) {
+            callOS << "    # Promote var from stack to heap.\n"
+
+                   << "    movq %rax, (%rbp)\n"
+
+                   << "    movq %rbp, %rax\n"
+
+                   << "    addq $" << WordSize << ", %rbp\n"
+
+                   << EmitAllocationCount("box",
+                                          "argument " + p +
+                                              " of tail call to " + procName,
+                                          "$" + to_string(WordSize));
+        } else {
+            callOS << "    movq " << newParamStackIdx << "(%rsp), %rax\n";
+        }
+
+        callOS << "    movq %rbx, (%rax)\n"
+
+               << "    movq %rax, " << newParamStackIdx << "(%rsp)\n";
+        oldParamStackIdx -= WordSize;
+        newParamStackIdx -= WordSize;
+        ++paramIdx;
+    }
+
+    if (lifted != nullptr) {
+        for (size_t i = 0; i < lifted->freeVars.size(); ++i) {
+            callOS << "    movq " << oldParamStackIdx << "(%rsp), %rbx\n"
+                   << "    movq %rbx, " << newParamStackIdx << "(%rsp)\n";
+            oldParamStackIdx -= WordSize;
+            newParamStackIdx -= WordSize;
+        }
+    }
+
+    if (IsLocalOrCapturedVar(env, closEnv, procName) ||
+        !IsVarName(procName)) {
+        callOS << "    jmp *%r9\n";
+    } else {
+        auto target = lifted != nullptr ? lifted->label
+                                        : DirectCallTarget(procName, params);
+
+        // The procedure's frame, which it reuses, was checked on entry.
+        if (target == gEmission->currentProcLabel) {
+            target = ProcBodyLabel(target);
+        }
+
+        callOS << "    jmp " << target << "\n";
+    }
+
+    return callOS.str();
+}
+
+// (call/cc proc) calls proc with an escape continuation: a procedure that,
+// called with a value before proc returns, returns the value from call/cc
+// right away, whatever the depth of the calls in between, by cutting the stack
+// back to the current frame. The continuation holds the code, the address to
+// resume at, %rsp, %rdi and the stack segment there, as sil_escape in
+// runtime.c expects; the address is cleared once call/cc returns, either way.
+string EmitCallCC(int stackIdx, TEnvironment env,
+                  const TClosureEnvironment& closEnv, string procExpr,
+                  bool isTail, int numFormalParamsInContainingLambda) {
+    auto resumeLabel = UniqueLabel();
+    // The continuation is kept at stackIdx, the call made below it.
+    auto callStackIdx = stackIdx - WordSize;
+    auto size = 5 * WordSize;
+    ostringstream exprOS;
+
+    exprOS << "    # call/cc.\n"
+
+           << "    leaq sil_escape(%rip), %rax\n"
+
+           << "    movq %rax, (%rbp)\n"
+
+           << "    leaq " << resumeLabel << "(%rip), %rax\n"
+
+           << "    movq %rax, 8(%rbp)\n"
+
+           << "    movq %rsp, 16(%rbp)\n"
+
+           << "    movq %rdi, 24(%rbp)\n"
+
+           << "    movq gStackSegment(%rip), %rax\n"
+
+           << "    movq %rax, 32(%rbp)\n"
+
+           << "    leaq " << ClosureTag << "(%rbp), %rax\n"
+
+           << "    addq $" << size << ", %rbp\n"
+
+           << EmitAllocationCount("continuation", "(call/cc " + procExpr + ")",
+                                  "$" + to_string(size))
+
+           << EmitStackSave(stackIdx)
+
+           << "    # Promote var from stack to heap.\n"
+
+           << "    movq %rax, (%rbp)\n"
+
+           << "    movq %rbp, %rax\n"
+
+           << EmitStackSave(callStackIdx - WordSize * 2)
+
+           << "    addq $" << WordSize << ", %rbp\n"
+
+           << EmitAllocationCount("box", "argument of call/cc " + procExpr,
+                                  "$" + to_string(WordSize))
+
+           << EmitStackSave(callStackIdx, "rdi")
+
+           << EmitExpr(callStackIdx - WordSize * 3, env, closEnv, procExpr)
+
+           << EmitTypeCheck(procExpr, EValueType::Procedure)
+
+           << "    movq %rax, %rdi\n"
+
+           << "    movq -" << ClosureTag << "(%rax), %rax\n"
+
+           << "    addq $" << callStackIdx << ", %rsp\n"
+           << EmitCfiFrameBase(-callStackIdx)
+
+           << "    call *%rax\n"
+
+           << EmitCallSiteInfo(callStackIdx)
+           << "    subq $" << callStackIdx << ", %rsp\n"
+           << EmitCfiFrameBase(0)
+
+           << EmitStackLoad(callStackIdx, "rdi")
+
+           << resumeLabel << ":\n"
+
+           << "    movq " << stackIdx << "(%rsp), %r8\n"
+
+           << "    movq $0, " << WordSize - ClosureTag << "(%r8)\n"
+
+           << (isTail ? "    ret\n" : "");
+
+    return exprOS.str();
+}
+
+// Makes a compilation and procedure the ones the calling thread emits code for
+// while in scope.
+class TEmissionScope {
+  public:
+    TEmissionScope(TCompilation* compilation, TEmission* emission)
+        : outerCompilation(gCompilation), outerEmission(gEmission) {
+        gCompilation = compilation;
+        gEmission = emission;
+    }
+
+    ~TEmissionScope() {
+        gCompilation = outerCompilation;
+        gEmission = outerEmission;
+    }
+
+  private:
+    TCompilation* outerCompilation;
+    TEmission* outerEmission;
+};
+
+struct TEmittedLambda {
+    string code;
+    vector<TPendingLambda> pendingLambdas;
+    // The instruction counts of the lambda's code, when collected.
+    map<string, long> instructionStats;
+    // The phases timed while emitting it on a worker thread.
+    vector<TPhaseStats> phaseStats;
+};
+
+// Labels of top-level procedures only depend on their names and module, so
+// that cached code calling them stays valid. A module's own procedures shadow
+// the imported ones.
+void CreateLambdaTable(const TBindings& lambdas,
+                       const TLambdaTable& importedProcs) {
+    gCompilation->lambdaTable = importedProcs;
+
+    for (auto l : lambdas) {
+        gCompilation->lambdaTable[l.first] =
+            gCompilation->modulePrefix + MangleName(l.first) + "_L";
+    }
+}
+
+// Every parenthesized sub-expression of expr, innermost first.
+vector<string> ParenthesizedSubExprs(string expr) {
+    vector<string> subExprs;
+    vector<size_t> openParens;
+
+    for (size_t i = 0; i < expr.size(); ++i) {
+        // Skip the parentheses of character literals.
+        if (i > 0 && expr[i - 1] == '\\') {
+            continue;
+        }
+
+        if (expr[i] == '(') {
+            openParens.push_back(i);
+        } else if (expr[i] == ')' && !openParens.empty()) {
+            subExprs.push_back(expr.substr(openParens.back(),
+                                           i + 1 - openParens.back()));
+            openParens.pop_back();
+        }
+    }
+
+    return subExprs;
+}
+
+// Finds whether the top-level procedure procName is a counted loop: whether
+// it indexes objects it passes on to itself unchanged with a parameter it
+// passes on unchanged or incremented, and compares the index with a bound it
+// passes on unchanged. What the analysis finds is only a guess, which
+// DirectCallTarget checks at each of the procedure's calls to itself.
+bool TryFindCountedLoop(string procName, const vector<string>& formalArgs,
+                        string body, TCountedLoop* outLoop) {
+    static const unordered_map<string, EValueType> accessTypes{
+        {"vector-ref", EValueType::Vector},
+        {"vector-set!", EValueType::Vector},
+        {"string-ref", EValueType::String},
+        {"string-set!", EValueType::String}};
+    static const unordered_set<string> comparisons{"fx=", "fx<", "fx<=",
+                                                   "fx>", "fx>="};
+    auto subExprs = ParenthesizedSubExprs(body);
+    vector<vector<string>> selfCalls;
+
+    for (const auto& subExpr : subExprs) {
+        string name;
+        vector<string> params;
+
+        if (TryParseProcCallExpr(subExpr, &name, &params) &&
+            name == procName) {
+            selfCalls.push_back(params);
+        }
+    }
+
+    // Whether the procedure passes var, or var incremented, on to itself.
+    auto isPassedOn = [&](string var, bool canStep) {
+        auto arg = find(formalArgs.begin(), formalArgs.end(), var);
+
+        if (arg == formalArgs.end() ||
+            gCompilation->assignedVars.count(var) != 0) {
+            return false;
+        }
+
+        for (const auto& params : selfCalls) {
+            auto param = params[arg - formalArgs.begin()];
+
+            if (param != var &&
+                !(canStep && (param == "(fxadd1 " + var + ")" ||
+                              param == "(fx+ " + var + " 1)"))) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+    // Adds obj to the loop's objects, unless it is one already. An object
+    // used as both a vector and a string isn't one.
+    auto addObj = [](string obj, EValueType type, TCountedLoop* loop) {
+        for (const auto& o : loop->objs) {
+            if (o.first == obj) {
+                return o.second == type;
+            }
+        }
+
+        loop->objs.push_back({obj, type});
+        return true;
+    };
+
+    for (const auto& params : selfCalls) {
+        if (params.size() != formalArgs.size()) {
+            return false;
+        }
+    }
+
+    if (selfCalls.empty()) {
+        return false;
+    }
+
+    TCountedLoop loop{procName, formalArgs};
+
+    for (const auto& subExpr : subExprs) {
+        string primitiveName;
+        vector<string> args;
+
+        if (!TryParseBinaryPrimitive(subExpr, &primitiveName, &args) &&
+            !TryParseTernaryPrimitive(subExpr, &primitiveName, &args)) {
+            continue;
+        }
+
+        auto accessType = accessTypes.find(primitiveName);
+
+        if (accessType == accessTypes.end()) {
+            continue;
+        }
+
+        if (loop.index.empty() && isPassedOn(args[1], true)) {
+            loop.index = args[1];
+        }
+
+        if (args[1] == loop.index && isPassedOn(args[0], false) &&
+            !addObj(args[0], accessType->second, &loop)) {
+            return false;
+        }
+    }
+
+    if (loop.index.empty()) {
+        return false;
+    }
+
+    for (const auto& subExpr : subExprs) {
+        string primitiveName;
+        vector<string> args;
+
+        if (!TryParseBinaryPrimitive(subExpr, &primitiveName, &args) ||
+            comparisons.count(primitiveName) == 0 ||
+            (args[0] != loop.index && args[1] != loop.index)) {
+            continue;
+        }
+
+        auto bound = RangeTerm(args[0] == loop.index ? args[1] : args[0]);
+        auto boundVar = RangeTermVar(bound);
+
+        if (bound.empty() || boundVar.empty() || boundVar == loop.index ||
+            !isPassedOn(boundVar, false)) {
+            continue;
+        }
+
+        if (bound != boundVar) {
+            auto boundObjType =
+                bound == LengthTerm(boundVar, EValueType::Vector)
+                    ? EValueType::Vector
+                    : EValueType::String;
+
+            if (!addObj(boundVar, boundObjType, &loop)) {
+                return false;
+            }
+        }
+
+        loop.bound = bound;
+        break;
+    }
+
+    if (loop.bound.empty() || loop.objs.empty()) {
+        return false;
+    }
+
+    *outLoop = loop;
+    return true;
+}
+
+// Loop versioning. Emits a check, hoisted out of the counted loop, that the
+// loop's index is within the bound and the bound within the length of the
+// objects, then a version of the body where the index needs no bounds checks
+// and the loop's calls to itself that keep the index within range skip the
+// hoisted check. The procedure goes on to the checked body, at checkedLabel,
+// when the hoisted check fails.
+string EmitCountedLoop(int stackIdx, TEnvironment env,
+                       const TClosureEnvironment& closEnv, string body,
+                       int numFormalParams, TCountedLoop loop,
+                       string checkedLabel) {
+    auto objTag = [](EValueType type) {
+        return type == EValueType::Vector ? VectorTag : StringTag;
+    };
+    ostringstream loopOS;
+
+    loopOS << "    " << CheckComment << "loop over " << loop.index << ".\n"
+           << EmitVarVal(env, closEnv, loop.index, false, numFormalParams)
+           << EmitTypeTest(EValueType::FixNum)
+           << "    jne " << checkedLabel << "\n"
+           << "    test %rax, %rax\n"
+           << "    js " << checkedLabel << "\n"
+           << "    movq %rax, %r8\n";
+
+    if (IsVarName(loop.bound)) {
+        loopOS << EmitVarVal(env, closEnv, loop.bound, false, numFormalParams)
+               << EmitTypeTest(EValueType::FixNum)
+               << "    jne " << checkedLabel << "\n";
+    }
+
+    for (const auto& obj : loop.objs) {
+        if (LengthTerm(obj.first, obj.second) == loop.bound) {
+            loopOS << EmitVarVal(env, closEnv, obj.first, false,
+                                 numFormalParams)
+                   << EmitTypeTest(obj.second)
+                   << "    jne " << checkedLabel << "\n"
+                   << "    movq -" << objTag(obj.second) << "(%rax), %rax\n";
+        }
+    }
+
+    loopOS << "    cmpq %rax, %r8\n"
+           << "    jg " << checkedLabel << "\n"
+           << "    movq %rax, %r9\n";
+
+    for (const auto& obj : loop.objs) {
+        if (LengthTerm(obj.first, obj.second) != loop.bound) {
+            loopOS << EmitVarVal(env, closEnv, obj.first, false,
+                                 numFormalParams)
+                   << EmitTypeTest(obj.second)
+                   << "    jne " << checkedLabel << "\n"
+                   << "    cmpq -" << objTag(obj.second) << "(%rax), %r9\n"
+                   << "    jg " << checkedLabel << "\n";
+        }
+    }
+
+    loop.fastLabel = UniqueLabel();
+    loopOS << loop.fastLabel << ":\n";
+    auto factsMark = MarkFacts();
+    AddTypeFact(loop.index, EValueType::FixNum);
+    AddRangeFact("0", loop.index, false);
+    AddRangeFact(loop.index, loop.bound, false);
+
+    if (IsVarName(loop.bound)) {
+        AddTypeFact(loop.bound, EValueType::FixNum);
+    }
+
+    for (const auto& obj : loop.objs) {
+        AddTypeFact(obj.first, obj.second);
+        AddRangeFact(loop.bound, LengthTerm(obj.first, obj.second), false);
+    }
+
+    gEmission->countedLoop = loop;
+    loopOS << EmitExpr(stackIdx, env, closEnv, body, /* isTail */ true,
+                       numFormalParams)
+           << checkedLabel << ":\n";
+    gEmission->countedLoop = TCountedLoop();
+    DropFactsSince(factsMark);
+
+    return loopOS.str();
+}
+
+// procName and source only serve to describe the procedure to the profiler.
+// The boxes of a lifted lambda's free variables follow its arguments; tail
+// calls leave them alone, as they aren't the procedure's own.
+string EmitLambda(string lambdaLabel, string procName, string source,
+                  const vector<string>& formalArgs, string body,
+                  const TClosureEnvironment& closEnv,
+                  const vector<string>& liftedFreeVars = {}) {
+    TEnvironment lambdaEnv;
+    auto stackIdx = -WordSize;
+
+    for (auto arg : formalArgs) {
+        lambdaEnv[arg] = stackIdx;
+        stackIdx -= WordSize;
+    }
+
+    for (auto var : liftedFreeVars) {
+        lambdaEnv[var] = stackIdx;
+        stackIdx -= WordSize;
+    }
 
-               << "    movq -" << ClosureTag << "(%rax), %rax\n"
+    // Keep the cold code of the procedure the lambda is emitted from, if any,
+    // aside.
+    auto outerColdCode = gEmission->coldCodeOS.str();
+    gEmission->coldCodeOS.str("");
+    // The body's code isn't part of the enclosing expression's code.
+    vector<long> outerSubExprInstructionCounts;
+    outerSubExprInstructionCounts.swap(gEmission->subExprInstructionCounts);
+    auto outerProcLabel = gEmission->currentProcLabel;
+    gEmission->currentProcLabel = lambdaLabel;
+    // Nothing known where the lambda is made holds when it's called.
+    vector<pair<string, EValueType>> outerTypeFacts;
+    outerTypeFacts.swap(gEmission->typeFacts);
+    vector<TRangeFact> outerRangeFacts;
+    outerRangeFacts.swap(gEmission->rangeFacts);
+    TCountedLoop outerCountedLoop;
+    swap(outerCountedLoop, gEmission->countedLoop);
+    unordered_map<string, string> outerCheckFailedLabels;
+    outerCheckFailedLabels.swap(gEmission->checkFailedLabels);
+    auto outerLiteralData = gEmission->literalDataOS.str();
+    gEmission->literalDataOS.str("");
+    unordered_map<string, string> outerLiteralLabels;
+    outerLiteralLabels.swap(gEmission->literalLabels);
+
+    if (gCompilation->emitLineInfo) {
+        gEmission->sourceSpans.push_back(LocateSubExpr(source));
+    }
 
-               << "    addq $" << stackIdx << ", %rsp\n"
+    auto stackCheck = EmitStackCheck(
+        lambdaLabel, formalArgs.size() + liftedFreeVars.size());
 
-               << "    call *%rax\n";
-    } else if (!IsVarName(procName)) {
-        callOS << EmitStackSave(stackIdx, "rdi");
+    // In safe mode, top-level procedures that are counted loops get a version
+    // without bounds checks.
+    string countedLoopCode;
+    TCountedLoop countedLoop;
 
-        callOS << EmitExpr(stackIdx, env, closEnv, procName)
+    if (gSafeModeEnabled && gCompilation->lambdaTable.count(procName) != 0 &&
+        gCompilation->lambdaTable.at(procName) == lambdaLabel &&
+        TryFindCountedLoop(procName, formalArgs, body, &countedLoop)) {
+        countedLoopCode =
+            EmitCountedLoop(stackIdx, lambdaEnv, closEnv, body,
+                            formalArgs.size(), countedLoop, UniqueLabel());
+    }
 
-               << "    movq %rax, %rdi\n"
+    auto bodyCode =
+        countedLoopCode + EmitExpr(stackIdx, lambdaEnv, closEnv, body,
+                                   /* isTail */ true, formalArgs.size());
+    bodyCode += gEmission->coldCodeOS.str();
 
-               << "    movq -" << ClosureTag << "(%rax), %rax\n"
+    // A local label, so that it doesn't show up in the symbol table.
+    auto endLabel = ".L" + lambdaLabel + "_end";
+    ostringstream lambdaOS;
+    lambdaOS << "    .globl " << lambdaLabel << "\n"
+             << "    .type " << lambdaLabel << ", @function\n"
+             << lambdaLabel << ":\n"
+             << "    .cfi_startproc\n"
+             << stackCheck
+             << bodyCode
+             << "    .cfi_endproc\n"
+             << endLabel << ":\n"
+             << "    .size " << lambdaLabel << ", " << endLabel << " - "
+             << lambdaLabel << "\n"
+             << "    .set " << FrameSizeSymbol(lambdaLabel) << ", "
+             << FrameSize(bodyCode) << "\n"
+             << EmitProcInfo(lambdaLabel, endLabel, procName, source);
+
+    if (gCompilation->emitLineInfo) {
+        gEmission->sourceSpans.pop_back();
+    }
 
-               << "    addq $" << stackIdx << ", %rsp\n"
+    gEmission->coldCodeOS.str(outerColdCode);
+    gEmission->coldCodeOS.seekp(0, ios_base::end);
+    gEmission->subExprInstructionCounts.swap(outerSubExprInstructionCounts);
+    gEmission->currentProcLabel = outerProcLabel;
+    gEmission->typeFacts.swap(outerTypeFacts);
+    gEmission->rangeFacts.swap(outerRangeFacts);
+    swap(gEmission->countedLoop, outerCountedLoop);
+    gEmission->checkFailedLabels.swap(outerCheckFailedLabels);
+    auto literalData = gEmission->literalDataOS.str();
+    gEmission->literalDataOS.str(outerLiteralData);
+    gEmission->literalDataOS.seekp(0, ios_base::end);
+    gEmission->literalLabels.swap(outerLiteralLabels);
+
+    return OptimizeProc(lambdaOS.str()) + literalData;
+}
 
-               << "    call *%rax\n";
+bool IsNameUsedIn(string name, string source) {
+    auto pos = source.find(name);
 
-    } else {
-        callOS << "    addq $" << stackIdx << ", %rsp\n"
-               << "    call " << gLambdaTable[procName] << "\n";
-    }
+    while (pos != string::npos) {
+        auto end = pos + name.size();
 
-    callOS << "    subq $" << stackIdx << ", %rsp\n";
+        if ((pos == 0 || IsExprDelimiter(source[pos - 1])) &&
+            (end == source.size() || IsExprDelimiter(source[end]))) {
+            return true;
+        }
 
-    if (IsLocalOrCapturedVar(env, closEnv, procName) || !IsVarName(procName)) {
-        callOS << EmitStackLoad(stackIdx, "rdi");
-        stackIdx += WordSize;
+        pos = source.find(name, pos + 1);
     }
 
-    return callOS.str();
+    return false;
 }
 
-string EmitTailProcCall(int stackIdx, TEnvironment env,
-                        const TClosureEnvironment& closEnv, string procName,
-                        vector<string> params,
-                        int numFormalParamsInContainingLambda) {
-    ostringstream callOS;
-    callOS << "    # Tail call: " << procName << ".\n"
-           << EmitSaveProcParamsOnStack(stackIdx, env, closEnv, params, false);
-    auto oldParamStackIdx = stackIdx - WordSize * 2;
-    auto newParamStackIdx = -WordSize;
+// Everything the code emitted for a top-level lambda depends on: its name,
+// label and source, the labels of the other top-level and imported procedures
+// it refers to and the number of arguments of the imported ones, the
+// compilation options and, with line info, where it is in the program.
+string CompileCacheKey(string name, string source) {
+    vector<string> usedProcs;
+
+    for (const auto& p : gCompilation->lambdaTable) {
+        if (p.first != name && IsNameUsedIn(p.first, source)) {
+            auto usedProc = p.first + "=" + p.second;
+            auto importedNumArgs =
+                gCompilation->importedProcNumArgs.find(p.first);
+
+            if (importedNumArgs != gCompilation->importedProcNumArgs.end()) {
+                usedProc += "/" + to_string(importedNumArgs->second);
+            }
 
-    if (IsLocalOrCapturedVar(env, closEnv, procName)) {
-        callOS << EmitVarVal(env, closEnv, procName, false,
-                             numFormalParamsInContainingLambda)
+            usedProcs.push_back(usedProc);
+        }
+    }
 
-               << "    movq %rax, %rdi\n"
+    sort(usedProcs.begin(), usedProcs.end());
+
+    ostringstream keyOS;
+    keyOS << "compiler " << CompilerVersion() << "\n"
+          << "alloc-profiling " << gAllocationProfilingEnabled << "\n"
+          << "peephole " << gPeepholeEnabled << "\n"
+          << "safe " << gSafeModeEnabled << "\n"
+          << "line-info "
+          << (gCompilation->emitLineInfo
+                  ? EmitLoc(gEmission->sourceSpans.back()) +
+                        SourceTextOf(gEmission->sourceSpans.back()) + "\n"
+                  : "none\n")
+          << "procs";
+
+    for (auto p : usedProcs) {
+        keyOS << " " << p;
+    }
 
-               << "    movq -" << ClosureTag << "(%rax), %r9\n";
-    } else if (!IsVarName(procName)) {
-        callOS << EmitExpr(stackIdx, env, closEnv, procName)
+    keyOS << "\n"
+          << name << "=" << gCompilation->lambdaTable[name] << "\n"
+          << NormalizeCacheKeySource(source) << "\n";
 
-               << "    movq %rax, %rdi\n"
+    return keyOS.str();
+}
 
-               << "    movq -" << ClosureTag << "(%rax), %r9\n";
+// Emits a lambda on the calling thread, which becomes the one emitting code
+// for the compilation.
+TEmittedLambda EmitPendingLambda(TCompilation* compilation,
+                                 const TPendingLambda& lambda) {
+    // Top-level lambdas are timed one by one, the lambdas nested in them
+    // together.
+    TPhaseTimer phaseTimer(lambda.isTopLevel ? "lambda " + lambda.procName
+                                             : "hoist lambdas");
+    TEmission emission;
+    emission.labelScope = lambda.labelScope;
+    emission.sourceSpans = {lambda.span};
+    TEmissionScope emissionScope(compilation, &emission);
+
+    TEmittedLambda emitted;
+    emitted.code =
+        EmitLambda(lambda.label, lambda.procName, lambda.source,
+                   lambda.formalArgs, lambda.body, lambda.closEnv,
+                   lambda.liftedFreeVars) +
+        "\n\n";
+    emitted.pendingLambdas.swap(emission.pendingLambdas);
+
+    if (IsInstructionStatsEnabled()) {
+        emitted.instructionStats = TakeInstructionStats();
     }
 
-    int paramIdx = 0;
-
-    for (auto p : params) {
-        callOS << "    movq " << oldParamStackIdx << "(%rsp), %rbx\n";
+    return emitted;
+}
 
-        if (paramIdx >= numFormalParamsInContainingLambda) {
-            callOS << "    # Promote var from stack to heap.\n"
+// Emits the lambdas, then the lambdas found in them and so on, a round at a
+// time, each round in parallel. Each lambda's code is followed by the code of
+// the lambdas found in it, so that the output doesn't depend on the order the
+// lambdas were emitted in.
+vector<string> EmitPendingLambdas(const vector<TPendingLambda>& lambdas) {
+    vector<TEmittedLambda> emitted(lambdas.size());
+    auto compilation = gCompilation;
+    auto callingThread = this_thread::get_id();
+    auto emitLambda = [&](int i) {
+        emitted[i] = EmitPendingLambda(compilation, lambdas[i]);
+
+        if (IsPhaseTimingEnabled() && this_thread::get_id() != callingThread) {
+            emitted[i].phaseStats = TakePhaseStats();
+        }
+    };
 
-                   << "    movq %rax, (%rbp)\n"
+    if (gCodegenPool != nullptr) {
+        gCodegenPool->ParallelFor(lambdas.size(), emitLambda);
+    } else {
+        for (int i = 0; i < lambdas.size(); ++i) {
+            emitLambda(i);
+        }
+    }
 
-                   << "    movq %rbp, %rax\n"
+    vector<TPendingLambda> nestedLambdas;
+    vector<size_t> nestedLambdasEnd;
 
-                   << "    addq $" << WordSize << ", %rbp\n";
-        } else {
-            callOS << "    movq " << newParamStackIdx << "(%rsp), %rax\n";
+    for (auto& e : emitted) {
+        for (const auto& kindCount : e.instructionStats) {
+            AddInstructionCount(kindCount.first, kindCount.second);
         }
 
-        callOS << "    movq %rbx, (%rax)\n"
+        AddPhaseStats(e.phaseStats);
 
-               << "    movq %rax, " << newParamStackIdx << "(%rsp)\n";
-        oldParamStackIdx -= WordSize;
-        newParamStackIdx -= WordSize;
-        ++paramIdx;
+        move(e.pendingLambdas.begin(), e.pendingLambdas.end(),
+             back_inserter(nestedLambdas));
+        nestedLambdasEnd.push_back(nestedLambdas.size());
     }
 
-    if (!IsLocalOrCapturedVar(env, closEnv, procName)) {
-        callOS << "    jmp " << gLambdaTable[procName] << "\n";
-    } else {
-        callOS << "    jmp *%r9\n";
+    vector<string> nestedCode;
+
+    if (!nestedLambdas.empty()) {
+        nestedCode = EmitPendingLambdas(nestedLambdas);
     }
 
-    return callOS.str();
-}
+    vector<string> code;
+    size_t nestedIdx = 0;
 
-void CreateLambdaTable(const TBindings& lambdas) {
-    for (auto l : lambdas) {
-        gLambdaTable.insert({l.first, UniqueLabel(l.first)});
+    for (int i = 0; i < emitted.size(); ++i) {
+        code.push_back(emitted[i].code);
+
+        for (; nestedIdx < nestedLambdasEnd[i]; ++nestedIdx) {
+            code.back() += nestedCode[nestedIdx];
+        }
     }
+
+    return code;
 }
 
-string EmitLambda(string lambdaLabel, const vector<string>& formalArgs,
-                  string body, const TClosureEnvironment& closEnv) {
-    TEnvironment lambdaEnv;
-    auto stackIdx = -WordSize;
+// Emits each top-level lambda along with the lambdas nested in it, reusing the
+// code cached for it when there is one.
+string EmitLetrecLambdas(const TBindings& lambdas,
+                         const TLambdaTable& importedProcs = TLambdaTable()) {
+    TPhaseTimer phaseTimer("letrec lambdas");
+    CreateLambdaTable(lambdas, importedProcs);
+    // Instruction stats are collected while emitting.
+    bool useCache = IsCompileCacheEnabled() && !IsInstructionStatsEnabled();
+    vector<string> lambdaCode;
+    vector<string> keys;
+    vector<TPendingLambda> pendingLambdas;
+    // Where the code of each pending lambda goes in lambdaCode.
+    vector<int> pendingLambdaIdx;
 
-    for (auto arg : formalArgs) {
-        lambdaEnv[arg] = stackIdx;
-        stackIdx -= WordSize;
-    }
+    for (auto l : lambdas) {
+        TSourceSpan span{};
 
-    ostringstream lambdaOS;
-    lambdaOS << "    .globl " << lambdaLabel << "\n"
-             << "    .type " << lambdaLabel << ", @function\n"
-             << lambdaLabel << ":\n"
-             << EmitExpr(stackIdx, lambdaEnv, closEnv, body, /* isTail */ true,
-                         formalArgs.size());
+        if (gCompilation->emitLineInfo) {
+            span = LocateSubExpr(l.second);
+            gEmission->sourceSpans.push_back(span);
+        }
 
-    return lambdaOS.str();
-}
+        string key;
+        lambdaCode.emplace_back();
 
-string EmitLetrecLambdas(const TBindings& lambdas) {
-    CreateLambdaTable(lambdas);
-    ostringstream allLambdasOS;
+        if (useCache) {
+            key = CompileCacheKey(l.first, l.second);
+        }
 
-    for (auto l : lambdas) {
-        vector<string> formalArgs;
-        string body;
+        if (gCompilation->emitLineInfo) {
+            gEmission->sourceSpans.pop_back();
+        }
+
+        if (useCache && LookUpCompileCache(key, &lambdaCode.back())) {
+            continue;
+        }
+
+        TPendingLambda lambda{gCompilation->lambdaTable[l.first], l.first,
+                              l.second};
+
+        if (!TryParseLambda(l.second, &lambda.formalArgs, &lambda.body)) {
+            throw TCompileError("Error trying to emit lambda.");
+        }
+
+        lambda.labelScope =
+            gCompilation->modulePrefix + MangleName(l.first) + ".";
+        lambda.span = span;
+        lambda.isTopLevel = true;
+        pendingLambdas.push_back(lambda);
+        pendingLambdaIdx.push_back(lambdaCode.size() - 1);
+        keys.push_back(key);
+    }
+
+    auto emittedCode = EmitPendingLambdas(pendingLambdas);
+
+    for (int i = 0; i < emittedCode.size(); ++i) {
+        lambdaCode[pendingLambdaIdx[i]] = emittedCode[i];
 
-        if (!TryParseLambda(l.second, &formalArgs, &body)) {
-            std::cerr << "Error trying to emit lambda.\n";
-            exit(1);
+        if (useCache) {
+            StoreInCompileCache(keys[i], emittedCode[i]);
         }
+    }
+
+    ostringstream allLambdasOS;
 
-        allLambdasOS << EmitLambda(gLambdaTable[l.first], formalArgs, body,
-                                   TClosureEnvironment())
-                     << "\n\n";
+    for (const auto& code : lambdaCode) {
+        allLambdasOS << code;
     }
 
     return allLambdasOS.str();
@@ -1327,82 +4375,110 @@ string EmitSet(int stackIdx, TEnvironment env,
     return exprOS.str();
 }
 
-string EmitExpr(int stackIdx, TEnvironment env,
-                const TClosureEnvironment& closEnv, string expr, bool isTail,
-                int numFormalParamsInContainingLambda) {
-    assert(IsExpr(expr));
+string EmitExprImpl(int stackIdx, TEnvironment env,
+                    const TClosureEnvironment& closEnv, string expr,
+                    bool isTail, int numFormalParamsInContainingLambda) {
+    {
+        TPhaseTimer phaseTimer("validate");
+        assert(IsExpr(expr));
+    }
 
     if (IsImmediate(expr)) {
         ostringstream exprEmissionStream;
-        exprEmissionStream << "    movq $" << ImmediateRep(expr) << ", %rax\n"
+        exprEmissionStream << EmitLoadImmediate(ImmediateRep(expr))
                            << (isTail ? "    ret\n" : "");
 
         return exprEmissionStream.str();
     }
 
+    if (IsFlonum(expr) || IsString(expr)) {
+        return EmitQuote(stackIdx, env, closEnv,
+                         {IsString(expr) ? TDatum::String : TDatum::Immediate,
+                          expr},
+                         isTail);
+    }
+
     if (IsVarName(expr)) {
         return EmitVarVal(env, closEnv, expr, isTail,
                           numFormalParamsInContainingLambda);
     }
 
+    TDatum datum;
+
+    if (TryParseQuote(expr, &datum)) {
+        return EmitQuote(stackIdx, env, closEnv, datum, isTail);
+    }
+
     string primitiveName;
     vector<string> unaryArgs;
 
     if (TryParseUnaryPrimitive(expr, &primitiveName, &unaryArgs)) {
         assert(unaryArgs.size() == 1);
-        static unordered_map<string, TUnaryPrimitiveEmitter> unaryEmitters{
-            {"fxadd1", EmitFxAdd1},
-            {"fxsub1", EmitFxSub1},
-            {"fixnum->char", EmitFixNumToChar},
-            {"char->fixnum", EmitCharToFixNum},
-            {"fixnum?", EmitIsFixNum},
-            {"fxzero?", EmitIsFxZero},
-            {"null?", EmitIsNull},
-            {"boolean?", EmitIsBoolean},
-            {"char?", EmitIsChar},
-            {"not", EmitNot},
-            {"fxlognot", EmitFxLogNot},
-            {"pair?", EmitIsPair},
-            {"car", EmitCar},
-            {"cdr", EmitCdr},
-            {"make-vector", EmitMakeVector},
-            {"vector?", EmitIsVector},
-            {"vector-length", EmitVectorLength},
-            {"make-string", EmitMakeString},
-            {"string?", EmitIsString},
-            {"string-length", EmitStringLength},
-            {"procedure?", EmitIsProcedure}};
-        assert(unaryEmitters[primitiveName] != nullptr);
-        return unaryEmitters[primitiveName](stackIdx, env, closEnv,
-                                            unaryArgs[0], isTail,
-                                            numFormalParamsInContainingLambda);
+        static const unordered_map<string, TUnaryPrimitiveEmitter>
+            unaryEmitters{
+                {"fxadd1", EmitFxAdd1},
+                {"fxsub1", EmitFxSub1},
+                {"fixnum->char", EmitFixNumToChar},
+                {"char->fixnum", EmitCharToFixNum},
+                {"fixnum?", EmitIsFixNum},
+                {"fxzero?", EmitIsFxZero},
+                {"null?", EmitIsNull},
+                {"boolean?", EmitIsBoolean},
+                {"char?", EmitIsChar},
+                {"not", EmitNot},
+                {"fxlognot", EmitFxLogNot},
+                {"pair?", EmitIsPair},
+                {"car", EmitCar},
+                {"cdr", EmitCdr},
+                {"make-vector", EmitMakeVector},
+                {"vector?", EmitIsVector},
+                {"vector-length", EmitVectorLength},
+                {"make-string", EmitMakeString},
+                {"string?", EmitIsString},
+                {"string-length", EmitStringLength},
+                {"procedure?", EmitIsProcedure},
+                {"symbol?", EmitIsSymbol},
+                {"string->symbol", EmitStringToSymbol},
+                {"symbol->string", EmitSymbolToString},
+                {"call/cc", EmitCallCC},
+                {"call-with-current-continuation", EmitCallCC}};
+        assert(unaryEmitters.count(primitiveName) != 0);
+        return unaryEmitters.at(primitiveName)(
+            stackIdx, env, closEnv, unaryArgs[0], isTail,
+            numFormalParamsInContainingLambda);
     }
 
     vector<string> binaryArgs;
 
     if (TryParseBinaryPrimitive(expr, &primitiveName, &binaryArgs)) {
         assert(binaryArgs.size() == 2);
-        static unordered_map<string, TBinaryPrimitiveEmitter> binaryEmitters{
-            {"fx+", EmitFxAdd},
-            {"fx-", EmitFxSub},
-            {"fx*", EmitFxMul},
-            {"fxlogor", EmitFxLogOr},
-            {"fxlogand", EmitFxLogAnd},
-            {"fx=", EmitIsEq},
-            {"fx<", EmitFxLT},
-            {"fx<=", EmitFxLE},
-            {"fx>", EmitFxGT},
-            {"fx>=", EmitFxGE},
-            {"cons", EmitCons},
-            {"set-car!", EmitSetCar},
-            {"set-cdr!", EmitSetCdr},
-            {"eq?", EmitIsEq},
-            {"vector-ref", EmitVectorRef},
-            {"string-ref", EmitStringRef},
-            {"char=", EmitIsCharEq},
-            {"set!", EmitSet}};
-        assert(binaryEmitters[primitiveName] != nullptr);
-        return binaryEmitters[primitiveName](
+        static const unordered_map<string, TBinaryPrimitiveEmitter>
+            binaryEmitters{
+                {"fx+", EmitFxAdd},
+                {"fx-", EmitFxSub},
+                {"fx*", EmitFxMul},
+                {"fxlogor", EmitFxLogOr},
+                {"fxlogand", EmitFxLogAnd},
+                {"fx=", EmitFxEq},
+                {"fx<", EmitFxLT},
+                {"fx<=", EmitFxLE},
+                {"fx>", EmitFxGT},
+                {"fx>=", EmitFxGE},
+                {"cons", EmitCons},
+                {"set-car!", EmitSetCar},
+                {"set-cdr!", EmitSetCdr},
+                {"eq?", EmitIsEq},
+                {"vector-ref", EmitVectorRef},
+                {"string-ref", EmitStringRef},
+                {"char=", EmitIsCharEq},
+                {"set!", EmitSet},
+                {"+", EmitAdd},
+                {"-", EmitSub},
+                {"*", EmitMul},
+                {"<", EmitLT},
+                {"hashtable-delete!", EmitHashtableDelete}};
+        assert(binaryEmitters.count(primitiveName) != 0);
+        return binaryEmitters.at(primitiveName)(
             stackIdx, env, closEnv, binaryArgs[0], binaryArgs[1], isTail,
             numFormalParamsInContainingLambda);
     }
@@ -1411,12 +4487,15 @@ string EmitExpr(int stackIdx, TEnvironment env,
 
     if (TryParseTernaryPrimitive(expr, &primitiveName, &ternaryArgs)) {
         assert(ternaryArgs.size() == 3);
-        static unordered_map<string, TTernaryPrimitiveEmitter> ternaryEmitters{
-            {"if", EmitIfExpr},
-            {"vector-set!", EmitVectorSet},
-            {"string-set!", EmitStringSet}};
-        assert(ternaryEmitters[primitiveName] != nullptr);
-        return ternaryEmitters[primitiveName](
+        static const unordered_map<string, TTernaryPrimitiveEmitter>
+            ternaryEmitters{
+                {"if", EmitIfExpr},
+                {"vector-set!", EmitVectorSet},
+                {"string-set!", EmitStringSet},
+                {"hashtable-ref", EmitHashtableRef},
+                {"hashtable-set!", EmitHashtableSet}};
+        assert(ternaryEmitters.count(primitiveName) != 0);
+        return ternaryEmitters.at(primitiveName)(
             stackIdx, env, closEnv, ternaryArgs[0], ternaryArgs[1],
             ternaryArgs[2], isTail, numFormalParamsInContainingLambda);
     }
@@ -1424,11 +4503,14 @@ string EmitExpr(int stackIdx, TEnvironment env,
     vector<string> varArgs;
 
     if (TryParseVariableArityPrimitive(expr, &primitiveName, &varArgs)) {
-        static unordered_map<string, TVaribaleArityPrimitiveEmitter>
+        static const unordered_map<string, TVaribaleArityPrimitiveEmitter>
             varArityEmitters{
-                {"and", EmitAndExpr}, {"or", EmitOrExpr}, {"begin", EmitBegin}};
-        assert(varArityEmitters[primitiveName] != nullptr);
-        return varArityEmitters[primitiveName](
+                {"and", EmitAndExpr},
+                {"or", EmitOrExpr},
+                {"begin", EmitBegin},
+                {"make-eq-hashtable", EmitMakeEqHashtable}};
+        assert(varArityEmitters.count(primitiveName) != 0);
+        return varArityEmitters.at(primitiveName)(
             stackIdx, env, closEnv, varArgs, isTail,
             numFormalParamsInContainingLambda);
     }
@@ -1455,39 +4537,71 @@ string EmitExpr(int stackIdx, TEnvironment env,
 
     if (TryParseLambda(expr, &formalArgs, &body, &possibleFreeVars)) {
         auto label = UniqueLabel();
+        auto objStackIdx = TakeStackObjectIdx();
+        auto freeVars = LambdaFreeVars(env, closEnv, possibleFreeVars);
+        TClosureEnvironment newClosEnv;
+
+        for (size_t i = 0; i < freeVars.size(); ++i) {
+            newClosEnv[freeVars[i]] = (i + 1) * WordSize;
+        }
+
         // TODO Get the naming for lambda and closure related parts right.
         ostringstream exprOS;
-        exprOS
-            << "    # Create lambda object.\n"
-            << "    leaq " << label << "(%rip), %rax\n"
-            << "    movq %rax, (%rbp)\n";  // Save the lambda ptr on the heap.
-        auto numFreeVars = 0;
-        TClosureEnvironment newClosEnv;
 
-        for (int i = 0; i < possibleFreeVars.size(); ++i) {
-            if (IsLocalOrCapturedVar(env, newClosEnv, possibleFreeVars[i])) {
-                auto fvHeapIdx = numFreeVars * WordSize;
-                exprOS << "      # Capturing: " << possibleFreeVars[i] << ".\n"
-                       << EmitVarRef(env, newClosEnv, possibleFreeVars[i],
-                                     false, numFormalParamsInContainingLambda)
-                       << "    movq %rax, " << (fvHeapIdx + WordSize)
-                       << "(%rbp)\n";
-                newClosEnv[possibleFreeVars[i]] = fvHeapIdx + WordSize;
-                ++numFreeVars;
+        // A lambda without free variables needs a single closure, which is
+        // laid out with the literal data.
+        if (freeVars.empty()) {
+            EmitLiteralObject(label + "_closure", {label});
+            exprOS << "    # Static lambda object.\n"
+                   << "    leaq " << label << "_closure+" << ClosureTag
+                   << "(%rip), %rax\n";
+        } else if (objStackIdx != 0) {
+            exprOS << "    # Create lambda object in the frame.\n"
+                   << "    leaq " << label << "(%rip), %rax\n"
+                   << EmitStackSave(objStackIdx);
+
+            for (const auto& var : freeVars) {
+                exprOS << "      # Capturing: " << var << ".\n"
+                       << EmitVarRef(env, closEnv, var, false,
+                                     numFormalParamsInContainingLambda)
+                       << EmitStackSave(objStackIdx + newClosEnv[var]);
             }
-        }
 
-        exprOS << "    movq %rbp, %rax\n"
+            exprOS << "    leaq " << objStackIdx + static_cast<int>(ClosureTag)
+                   << "(%rsp), %rax\n";
+        } else {
+            exprOS << "    # Create lambda object.\n"
+                   << "    leaq " << label << "(%rip), %rax\n"
+                   // Save the lambda ptr on the heap.
+                   << "    movq %rax, (%rbp)\n";
+
+            for (const auto& var : freeVars) {
+                exprOS << "      # Capturing: " << var << ".\n"
+                       << EmitVarRef(env, closEnv, var, false,
+                                     numFormalParamsInContainingLambda)
+                       << "    movq %rax, " << newClosEnv[var] << "(%rbp)\n";
+            }
 
-               << "    orq $" << ClosureTag << ", %rax\n"
+            auto size = (freeVars.size() + 1) * WordSize;
+            exprOS << "    movq %rbp, %rax\n"
 
-               << "    addq $" << (WordSize + (numFreeVars * WordSize))
-               << ", %rbp\n"
+                   << "    orq $" << ClosureTag << ", %rax\n"
 
-               << (isTail ? "    ret\n" : "");
+                   << "    addq $" << size << ", %rbp\n"
+
+                   << EmitAllocationCount("closure", expr,
+                                          "$" + to_string(size));
+        }
+
+        exprOS << (isTail ? "    ret\n" : "");
 
-        gAllLambdasOS << EmitLambda(label, formalArgs, body, newClosEnv)
-                      << "\n\n";
+        // The lambda's labels are in a scope of its own, so its code doesn't
+        // depend on the enclosing procedure's.
+        gEmission->pendingLambdas.push_back(
+            {label, label, expr, formalArgs, body, newClosEnv,
+             label.substr(label.find("_L_") + 3) + ".",
+             gCompilation->emitLineInfo ? gEmission->sourceSpans.back()
+                                        : TSourceSpan()});
 
         return exprOS.str();
     }
@@ -1508,53 +4622,373 @@ string EmitExpr(int stackIdx, TEnvironment env,
     assert(false);
 }
 
-string EmitProgram(string programSource) {
-    gAllLambdasOS.str("");
-    gAllLambdasOS.clear();
+// The kind of expression instructions are attributed to in the stats: the
+// primitive or syntax name, or one of immediate, variable and call.
+string ExprKind(string expr) {
+    if (IsImmediate(expr) || IsFlonum(expr) || IsString(expr)) {
+        return "immediate";
+    }
 
-    ostringstream programEmissionStream;
-    programEmissionStream << "    .text\n\n";
+    if (IsVarName(expr)) {
+        return "variable";
+    }
 
-    TBindings lambdas;
-    vector<string> progBody;
+    if (TryParseQuote(expr)) {
+        return "quote";
+    }
 
-    if (TryParseLetrec(programSource, &lambdas, &progBody)) {
-        programEmissionStream << EmitLetrecLambdas(lambdas);
-    } else {
-        progBody.push_back(programSource);
+    string primitiveName;
+
+    if (TryParseUnaryPrimitive(expr, &primitiveName) ||
+        TryParseBinaryPrimitive(expr, &primitiveName) ||
+        TryParseTernaryPrimitive(expr, &primitiveName) ||
+        TryParseVariableArityPrimitive(expr, &primitiveName)) {
+        return primitiveName;
+    }
+
+    if (TryParseLetExpr(expr)) {
+        return "let";
+    }
+
+    if (TryParseLetAsteriskExpr(expr)) {
+        return "let*";
+    }
+
+    if (TryParseLambda(expr)) {
+        return "lambda";
+    }
+
+    return "call";
+}
+
+string EmitExpr(int stackIdx, TEnvironment env,
+                const TClosureEnvironment& closEnv, string expr, bool isTail,
+                int numFormalParamsInContainingLambda) {
+    bool collectStats = IsInstructionStatsEnabled();
+
+    if (!collectStats && !gCompilation->emitLineInfo) {
+        return EmitExprImpl(stackIdx, env, closEnv, expr, isTail,
+                            numFormalParamsInContainingLambda);
+    }
+
+    auto coldCodeStart = gEmission->coldCodeOS.str().size();
+    string locBefore;
+    string locAfter;
+
+    if (gCompilation->emitLineInfo) {
+        // The parent's code after this expression's is the parent's again.
+        locAfter = EmitLoc(gEmission->sourceSpans.back());
+        gEmission->sourceSpans.push_back(LocateSubExpr(expr));
+        locBefore = EmitLoc(gEmission->sourceSpans.back());
+    }
+
+    if (collectStats) {
+        gEmission->subExprInstructionCounts.push_back(0);
+    }
+
+    auto code = EmitExprImpl(stackIdx, env, closEnv, expr, isTail,
+                             numFormalParamsInContainingLambda);
+
+    if (collectStats) {
+        // Attribute to expr only the instructions it emits itself, including
+        // its out-of-line slow paths.
+        auto subExprCount = gEmission->subExprInstructionCounts.back();
+        gEmission->subExprInstructionCounts.pop_back();
+
+        auto count =
+            CountAsmInstructions(code) +
+            CountAsmInstructions(
+                gEmission->coldCodeOS.str().substr(coldCodeStart));
+        AddInstructionCount(ExprKind(expr), count - subExprCount);
+
+        if (!gEmission->subExprInstructionCounts.empty()) {
+            gEmission->subExprInstructionCounts.back() += count;
+        }
+    }
+
+    if (gCompilation->emitLineInfo) {
+        gEmission->sourceSpans.pop_back();
+        auto coldCode = gEmission->coldCodeOS.str();
+
+        if (coldCode.size() > coldCodeStart) {
+            gEmission->coldCodeOS.str(coldCode.substr(0, coldCodeStart) +
+                                      locBefore +
+                                      coldCode.substr(coldCodeStart) +
+                                      locAfter);
+            gEmission->coldCodeOS.seekp(0, ios_base::end);
+        }
+
+        code = locBefore + code + locAfter;
+    }
+
+    return code;
+}
+
+// Over-approximates the variables set! in the program by their names.
+void FindAssignedVars(string programSource) {
+    string setPrefix = "(set!";
+
+    for (auto pos = programSource.find(setPrefix); pos != string::npos;
+         pos = programSource.find(setPrefix, pos + 1)) {
+        auto begin = pos + setPrefix.size();
+
+        while (begin < programSource.size() && isspace(programSource[begin])) {
+            ++begin;
+        }
+
+        auto end = begin;
+
+        while (end < programSource.size() && !isspace(programSource[end]) &&
+               !IsExprDelimiter(programSource[end])) {
+            ++end;
+        }
+
+        gCompilation->assignedVars.insert(
+            programSource.substr(begin, end - begin));
+    }
+}
+
+void StartCompilation(string programSource, string sourceFileName,
+                      string sourceText) {
+    gCompilation->emitLineInfo = !sourceFileName.empty();
+    gCompilation->programSource = programSource;
+    gEmission->sourceSpans = {{0, programSource.size(), 0}};
+
+    if (gCompilation->emitLineInfo) {
+        // Without the text, the file holds the program as it is.
+        if (sourceText.empty()) {
+            sourceText = programSource;
+            gCompilation->sourceOffsets.resize(programSource.size() + 1);
+            iota(gCompilation->sourceOffsets.begin(),
+                 gCompilation->sourceOffsets.end(), 0);
+        } else {
+            auto normalized =
+                NormalizeSource(sourceText, &gCompilation->sourceOffsets);
+            assert(normalized == programSource);
+            gCompilation->sourceOffsets.push_back(sourceText.size());
+        }
+
+        gCompilation->sourceText = sourceText;
+        gCompilation->lineStarts = {0};
+
+        for (size_t i = 0; i < sourceText.size(); ++i) {
+            if (sourceText[i] == '\n') {
+                gCompilation->lineStarts.push_back(i + 1);
+            }
+        }
     }
 
+    if (gSafeModeEnabled) {
+        FindAssignedVars(programSource);
+    }
+}
+
+string EmitSourceFileDirectives(string sourceFileName) {
+    ostringstream directivesOS;
+
+    if (gCompilation->emitLineInfo) {
+        directivesOS << "    .file 1 \"" << EscapeAsmString(sourceFileName)
+                     << "\"\n";
+    }
+
+    directivesOS << "    .text\n\n";
+
+    return directivesOS.str();
+}
+
+// Emits scheme_entry, which evaluates the program's body, preceded by the
+// lambdas nested in the body.
+string EmitSchemeEntry(const vector<string>& progBody, string programSource) {
     ostringstream schemeEntryOS;
 
-    for (const auto& expr : progBody) {
-        schemeEntryOS << EmitExpr(-WordSize, TEnvironment(),
-                                  TClosureEnvironment(), expr);
+    {
+        TPhaseTimer phaseTimer("scheme_entry");
+
+        for (const auto& expr : progBody) {
+            schemeEntryOS << EmitExpr(-WordSize, TEnvironment(),
+                                      TClosureEnvironment(), expr);
+        }
+    }
+
+    ostringstream programEmissionStream;
+
+    for (const auto& code : EmitPendingLambdas(gEmission->pendingLambdas)) {
+        programEmissionStream << code;
     }
 
-    programEmissionStream
-        << gAllLambdasOS.str()
+    ostringstream schemeEntryProcOS;
+    schemeEntryProcOS
 
         << "    .globl scheme_entry\n"
         << "    .type scheme_entry, @function\n"
         << "scheme_entry:\n"
+        << "    .cfi_startproc\n"
+        // Unwinders find the C caller's %rbp and %rbx on the C stack.
+        << "    pushq %rbp\n"
+        << "    .cfi_adjust_cfa_offset 8\n"
+        << "    .cfi_rel_offset %rbp, 0\n"
+        << "    pushq %rbx\n"
+        << "    .cfi_adjust_cfa_offset 8\n"
+        << "    .cfi_rel_offset %rbx, 0\n"
         << "    movq %rdi, %rcx\n"  // Load context* into %rcx.
         << "    movq %rbx, 8(%rcx)\n"
         << "    movq %rsi, 32(%rcx)\n"
         << "    movq %rdi, 40(%rcx)\n"
         << "    movq %rbp, 48(%rcx)\n"
         << "    movq %rsp, 56(%rcx)\n"
+        // CFA = 56(%rcx) + 24, until the C %rsp is on the Scheme stack.
+        << "    .cfi_escape 0xf, 0x5, 0x72, 0x38, 0x6, 0x23, 0x18\n"
         << "    movq %rsi, %rsp\n"  // Load stack space pointer into %rsp.
+        << "    pushq 56(%rcx)\n"   // Keep the C %rsp at the frame base.
+        << EmitCfiFrameBase(0)
         << "    movq %rdx, %rbp\n"  // Load heap space pointer into %rbp.
 
         << schemeEntryOS.str()
 
+        << "    .cfi_remember_state\n"
         << "    movq 8(%rcx), %rbx\n"
         << "    movq 32(%rcx), %rsi\n"
         << "    movq 40(%rcx), %rdi\n"
         << "    movq 48(%rcx), %rbp\n"
         << "    movq 56(%rcx), %rsp\n"
-        << "    ret\n";
+        << "    .cfi_def_cfa %rsp, 24\n"
+        << "    addq $16, %rsp\n"
+        << "    .cfi_def_cfa_offset 8\n"
+        << "    .cfi_restore %rbp\n"
+        << "    .cfi_restore %rbx\n"
+        << "    ret\n"
+        << "    .cfi_restore_state\n"
+
+        << gEmission->coldCodeOS.str()
+
+        << "    .cfi_endproc\n"
+        << ".Lscheme_entry_end:\n"
+        << "    .size scheme_entry, .Lscheme_entry_end - scheme_entry\n"
+        << EmitProcInfo("scheme_entry", ".Lscheme_entry_end", "scheme_entry",
+                        programSource);
+
+    programEmissionStream << OptimizeProc(schemeEntryProcOS.str())
+                          << gEmission->literalDataOS.str();
 
     return programEmissionStream.str();
 }
 
+string EmitProgram(string programSource, string sourceFileName,
+                   string sourceText) {
+    TCompilation compilation;
+    TEmission entryEmission;
+    TEmissionScope emissionScope(&compilation, &entryEmission);
+    StartCompilation(programSource, sourceFileName, sourceText);
+    ostringstream programEmissionStream;
+    programEmissionStream << EmitSourceFileDirectives(sourceFileName);
+
+    TBindings lambdas;
+    vector<string> progBody;
+    bool isLetrec;
+
+    {
+        TPhaseTimer phaseTimer("parse");
+        isLetrec = TryParseLetrec(programSource, &lambdas, &progBody);
+
+        if (!isLetrec && !IsExpr(programSource)) {
+            throw TCompileError("Syntax error in program.");
+        }
+    }
+
+    if (isLetrec) {
+        programEmissionStream << EmitLetrecLambdas(lambdas);
+    } else {
+        progBody.push_back(programSource);
+    }
+
+    programEmissionStream << EmitSchemeEntry(progBody, programSource);
+    auto code = programEmissionStream.str();
+
+    return code + EmitSymbolTable(code);
+}
+
+string EmitModule(string moduleSource,
+                  const vector<TModuleInterface>& imports,
+                  TModuleInterface* outModuleInterface,
+                  string sourceFileName, string sourceText) {
+    TCompilation compilation;
+    TEmission entryEmission;
+    TEmissionScope emissionScope(&compilation, &entryEmission);
+    StartCompilation(moduleSource, sourceFileName, sourceText);
+
+    string moduleName;
+    vector<string> importNames;
+    vector<string> exportNames;
+    TBindings lambdas;
+    vector<string> moduleBody;
+
+    {
+        TPhaseTimer phaseTimer("parse");
+
+        if (!TryParseModule(moduleSource, &moduleName, &importNames,
+                            &exportNames, &lambdas, &moduleBody)) {
+            throw TCompileError("Error trying to parse module.");
+        }
+    }
+
+    TLambdaTable importedProcs;
+
+    for (auto importName : importNames) {
+        auto moduleInterface =
+            find_if(imports.begin(), imports.end(), [&](const auto& i) {
+                return i.moduleName == importName;
+            });
+
+        if (moduleInterface == imports.end()) {
+            throw TCompileError("No interface for module " + importName +
+                                ", imported by " + moduleName + ".");
+        }
+
+        for (const auto& proc : moduleInterface->procs) {
+            if (importedProcs.count(proc.name) != 0) {
+                throw TCompileError(
+                    "Procedure " + proc.name +
+                    " is exported by more than one module imported by " +
+                    moduleName + ".");
+            }
+
+            importedProcs[proc.name] = proc.label;
+
+            if (lambdas.count(proc.name) == 0) {
+                gCompilation->importedProcNumArgs[proc.name] = proc.numArgs;
+            }
+        }
+    }
+
+    outModuleInterface->moduleName = moduleName;
+    outModuleInterface->procs.clear();
+    gCompilation->modulePrefix = MangleName(moduleName) + ".";
+
+    ostringstream moduleEmissionStream;
+    moduleEmissionStream << EmitSourceFileDirectives(sourceFileName)
+                         << EmitLetrecLambdas(lambdas, importedProcs);
+
+    for (auto exportName : exportNames) {
+        vector<string> formalArgs;
+
+        if (lambdas.count(exportName) == 0 ||
+            !TryParseLambda(lambdas[exportName], &formalArgs)) {
+            throw TCompileError("Module " + moduleName + " exports " +
+                                exportName +
+                                ", which isn't one of its procedures.");
+        }
+
+        outModuleInterface->procs.push_back(
+            {exportName, gCompilation->lambdaTable[exportName],
+             static_cast<int>(formalArgs.size())});
+    }
+
+    // Only the program's main module has a body, and so a scheme_entry.
+    if (!moduleBody.empty()) {
+        moduleEmissionStream << EmitSchemeEntry(moduleBody, moduleSource);
+    }
+
+    auto code = moduleEmissionStream.str();
+
+    return code + EmitSymbolTable(code);
+}
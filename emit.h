@@ -1,8 +1,67 @@
 #ifndef EMIT_H
 #define EMIT_H
 
+#include "module.h"
+
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+// Thrown for programs that can't be compiled, e.g. ones calling undefined
+// procedures.
+struct TCompileError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// With a sourceFileName, the emitted code carries line info pointing into that
+// file, whose text, sourceText, programSource was normalized from (see
+// NormalizeSource). Without sourceText, the file is expected to hold
+// programSource.
+std::string EmitProgram(std::string programSource,
+                        std::string sourceFileName = "",
+                        std::string sourceText = "");
+
+// Emits a separately compiled module:
+//
+//   (module name (import module ...) (export proc ...)
+//     ([proc (lambda ...)] ...)
+//     expr ...)
+//
+// Its procedures get global labels qualified with the module's name, and calls
+// to the procedures of imported modules, described by imports, go straight to
+// their labels. The exported procedures are described in outModuleInterface.
+// Only the program's main module has a body, which becomes scheme_entry.
+// Line info is as for EmitProgram.
+std::string EmitModule(std::string moduleSource,
+                       const std::vector<TModuleInterface> &imports,
+                       TModuleInterface *outModuleInterface,
+                       std::string sourceFileName = "",
+                       std::string sourceText = "");
+
+// Emits the procedures of a program on numThreads threads, the calling one
+// included; with 1, the default, only on the calling one. The emitted code is
+// the same either way. Not to be called while programs are being compiled.
+void SetCodegenThreads(int numThreads);
+
+// When enabled, emitted programs count the bytes and objects allocated at each
+// allocation site and print the counts when they exit.
+void EnableAllocationProfiling(bool enabled);
+
+// Runs the peephole optimizer (see peephole.h) over each emitted procedure;
+// on by default.
+void EnablePeephole(bool enabled);
+
+// In safe mode, primitives check the tags of their operands, vector and
+// string accesses their indices and calls that they call procedures; a failed
+// check ends the program with an error. Checks of values whose type tag
+// inference knows, e.g. from a pair? test they passed or from the cons that
+// made them, are left out, and so are index checks that range analysis finds
+// needless. Counted loops over vectors and strings check their index range
+// once, on entry, and run without bounds checks when it holds.
+void EnableSafeMode(bool enabled);
 
-std::string EmitProgram(std::string programSource);
+// Counts the checks in code emitted in safe mode, and the ones left out.
+void CountSafetyChecks(const std::string &code, long *outNumChecks,
+                       long *outNumElided);
 
 #endif
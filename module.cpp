@@ -0,0 +1,43 @@
+#include "module.h"
+
+#include <sstream>
+
+using namespace std;
+
+string FormatModuleInterface(const TModuleInterface &moduleInterface) {
+    ostringstream interfaceOS;
+    interfaceOS << "module " << moduleInterface.moduleName << "\n";
+
+    for (const auto &proc : moduleInterface.procs) {
+        interfaceOS << "proc " << proc.name << " " << proc.numArgs << " "
+                    << proc.label << "\n";
+    }
+
+    return interfaceOS.str();
+}
+
+bool TryParseModuleInterface(string text,
+                             TModuleInterface *outModuleInterface) {
+    istringstream interfaceIS(text);
+    string keyword;
+
+    if (!(interfaceIS >> keyword) || keyword != "module" ||
+        !(interfaceIS >> outModuleInterface->moduleName)) {
+        return false;
+    }
+
+    outModuleInterface->procs.clear();
+
+    while (interfaceIS >> keyword) {
+        TExportedProc proc;
+
+        if (keyword != "proc" ||
+            !(interfaceIS >> proc.name >> proc.numArgs >> proc.label)) {
+            return false;
+        }
+
+        outModuleInterface->procs.push_back(proc);
+    }
+
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <string>
+#include <vector>
+
+// What a separately compiled module offers to the modules importing it, which
+// are compiled against this instead of its source.
+struct TExportedProc {
+    std::string name;
+    // Global symbol of the procedure's code.
+    std::string label;
+    int numArgs;
+};
+
+struct TModuleInterface {
+    std::string moduleName;
+    std::vector<TExportedProc> procs;
+};
+
+// Interface files are text, one line per exported procedure:
+//
+//   module <name>
+//   proc <name> <number of args> <label>
+std::string FormatModuleInterface(const TModuleInterface &moduleInterface);
+bool TryParseModuleInterface(std::string text,
+                             TModuleInterface *outModuleInterface);
+
+#endif
@@ -3,14 +3,35 @@
 
 #include <algorithm>
 #include <cassert>
+#include <map>
 #include <sstream>
 
 using namespace std;
 
 bool IsFixNum(string token) {
     try {
-        auto intVal = stoi(token);
-        return (FxLower <= intVal) && (intVal <= FxUpper);
+        size_t numParsed;
+        auto intVal = stoll(token, &numParsed);
+        // Reject tokens that merely start with a number, e.g. 1+.
+        return (numParsed == token.size()) && (FxLower <= intVal) &&
+               (intVal <= FxUpper);
+    } catch (exception &) {
+        return false;
+    }
+}
+
+bool IsFlonum(string token) {
+    // Only tokens with a decimal point or an exponent are inexact; everything
+    // else that parses as a number is a fixnum.
+    if (token.find_first_of(".eE") == string::npos ||
+        !(isdigit(token[0]) || token[0] == '-' || token[0] == '.')) {
+        return false;
+    }
+
+    try {
+        size_t numParsed;
+        stod(token, &numParsed);
+        return numParsed == token.size();
     } catch (exception &) {
         return false;
     }
@@ -42,6 +63,31 @@ bool IsChar(string token) {
     return isalnum(token[2]) || specialChars.find(token[2]) != string::npos;
 }
 
+// String literals are normalized so that they hold no delimiters: characters
+// other than printable ones, and delimiters, are written \xHH;.
+bool IsString(string token) {
+    return token.size() >= 2 && token.front() == '"' && token.back() == '"' &&
+           token.find_first_of("\"()[]' ", 1) == token.size() - 1;
+}
+
+string StringLiteralChars(string token) {
+    assert(IsString(token));
+    string chars;
+
+    for (size_t i = 1; i + 1 < token.size(); ++i) {
+        if (token.compare(i, 2, "\\x") == 0) {
+            auto end = token.find(';', i);
+            chars += static_cast<char>(stoi(token.substr(i + 2, end - i - 2),
+                                            nullptr, 16));
+            i = end;
+        } else {
+            chars += token[i];
+        }
+    }
+
+    return chars;
+}
+
 bool IsImmediate(string token) {
     return IsBool(token) || IsNull(token) || IsChar(token) || IsFixNum(token);
 }
@@ -64,6 +110,30 @@ bool IsVarName(string token) {
     return true;
 }
 
+// Any identifier names a symbol, while only some name variables.
+bool IsSymbolName(string token) {
+    static const string initialChars = "!$%&*/:<=>?^_~";
+    static const string subsequentChars = "!$%&*/:<=>?^_~+-.@";
+
+    if (token == "+" || token == "-" || token == "...") {
+        return true;
+    }
+
+    if (token.empty() || !(isalpha(token[0]) ||
+                           initialChars.find(token[0]) != string::npos ||
+                           token.compare(0, 2, "->") == 0)) {
+        return false;
+    }
+
+    for (auto c : token) {
+        if (!isalnum(c) && subsequentChars.find(c) == string::npos) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool IsProperlyParenthesized(string expr) {
     return expr[0] == '(' && expr[expr.size() - 1] == ')';
 }
@@ -184,7 +254,8 @@ bool TryParseUnaryPrimitive(string expr, string *outPrimitiveName,
         "char?",         "not",         "fxlognot",     "pair?",
         "car",           "cdr",         "make-vector",  "vector?",
         "vector-length", "make-string", "string?",      "string-length",
-        "procedure?"};
+        "procedure?",    "symbol?",     "string->symbol", "symbol->string",
+        "call/cc",       "call-with-current-continuation"};
 
     return TryParsePrimitve(1, unaryPrimitiveNames, expr, outPrimitiveName,
                             outArgs);
@@ -195,7 +266,8 @@ bool TryParseBinaryPrimitive(string expr, string *outPrimitiveName,
     static const vector<string> binaryPrimitiveNames{
         "fx+",      "fx-",  "fx*",        "fxlogor",    "fxlogand", "fx=",
         "fx<",      "fx<=", "fx>",        "fx>=",       "cons",     "set-car!",
-        "set-cdr!", "eq?",  "vector-ref", "string-ref", "char=",    "set!"};
+        "set-cdr!", "eq?",  "vector-ref", "string-ref", "char=",    "set!",
+        "+",        "-",    "*",          "<",          "hashtable-delete!"};
 
     return TryParsePrimitve(2, binaryPrimitiveNames, expr, outPrimitiveName,
                             outArgs);
@@ -203,15 +275,16 @@ bool TryParseBinaryPrimitive(string expr, string *outPrimitiveName,
 
 bool TryParseTernaryPrimitive(string expr, string *outPrimitiveName,
                               vector<string> *outArgs) {
-    static const vector<string> ternaryPrimitiveNames{"if", "vector-set!",
-                                                      "string-set!"};
+    static const vector<string> ternaryPrimitiveNames{
+        "if", "vector-set!", "string-set!", "hashtable-ref", "hashtable-set!"};
     return TryParsePrimitve(3, ternaryPrimitiveNames, expr, outPrimitiveName,
                             outArgs);
 }
 
 bool TryParseVariableArityPrimitive(string expr, string *outPrimitiveName,
                                     vector<string> *outArgs) {
-    static const vector<string> primitiveNames{"and", "or", "begin"};
+    static const vector<string> primitiveNames{"and", "or", "begin",
+                                               "make-eq-hashtable"};
     return TryParsePrimitve(-1, primitiveNames, expr, outPrimitiveName,
                             outArgs);
 }
@@ -366,7 +439,8 @@ void CollectLambdaFreeVars(string body, const vector<string> &formalArgs,
 
         string token = body.substr(tokenStart, i - tokenStart);
 
-        if (token == "lambda" || token == "let") {
+        // Symbols in quoted data aren't variables.
+        if (token == "lambda" || token == "let" || token == "quote") {
             int numOfParen = 1;
 
             for (; i < body.size() && numOfParen > 0; ++i) {
@@ -469,6 +543,122 @@ bool TryParseLambda(string expr, vector<string> *outFormalArgs, string *outBody,
     return true;
 }
 
+bool IsDatumDelimiter(char c) {
+    return c == '(' || c == ')' || c == '[' || c == ']' || c == ' ';
+}
+
+// Parses the datum starting at *idx, leaving *idx past it.
+bool TryParseDatum(const string &text, int *idx, TDatum *outDatum) {
+    if (*idx >= text.size()) {
+        return false;
+    }
+
+    bool isVector = text.compare(*idx, 2, "#(") == 0;
+
+    if (text[*idx] != '(' && !isVector) {
+        int tokenEnd = *idx;
+
+        // The character of a char token may be a delimiter, e.g. #\(.
+        if (text.compare(tokenEnd, 2, "#\\") == 0) {
+            tokenEnd += 3;
+        }
+
+        while (tokenEnd < text.size() && !IsDatumDelimiter(text[tokenEnd])) {
+            ++tokenEnd;
+        }
+
+        auto token = text.substr(*idx, tokenEnd - *idx);
+        *idx = tokenEnd;
+
+        if (IsImmediate(token) || IsFlonum(token)) {
+            *outDatum = {TDatum::Immediate, token};
+            return true;
+        }
+
+        if (IsString(token)) {
+            *outDatum = {TDatum::String, token};
+            return true;
+        }
+
+        if (IsSymbolName(token)) {
+            *outDatum = {TDatum::Symbol, token};
+            return true;
+        }
+
+        return false;
+    }
+
+    *idx += isVector ? 2 : 1;
+    *outDatum = {isVector ? TDatum::Vector : TDatum::List, ""};
+
+    while (true) {
+        while (*idx < text.size() && text[*idx] == ' ') {
+            ++*idx;
+        }
+
+        if (*idx >= text.size()) {
+            return false;
+        }
+
+        if (text[*idx] == ')') {
+            ++*idx;
+            break;
+        }
+
+        // The element after the dot of a dotted list is its last.
+        if (text.compare(*idx, 2, ". ") == 0) {
+            if (isVector || outDatum->elements.empty() ||
+                outDatum->isDotted) {
+                return false;
+            }
+
+            outDatum->isDotted = true;
+            *idx += 2;
+        } else if (outDatum->isDotted) {
+            return false;
+        }
+
+        TDatum element;
+
+        if (!TryParseDatum(text, idx, &element)) {
+            return false;
+        }
+
+        outDatum->elements.push_back(element);
+
+        if (outDatum->isDotted && (*idx >= text.size() || text[*idx] != ')')) {
+            return false;
+        }
+    }
+
+    if (outDatum->kind == TDatum::List && outDatum->elements.empty()) {
+        *outDatum = {TDatum::Immediate, "()"};
+    }
+
+    return true;
+}
+
+bool TryParseQuote(string expr, TDatum *outDatum) {
+    auto idx = TryParseSyntaxElementPrefix("quote", expr);
+
+    if (idx == -1 || expr[idx] != ' ') {
+        return false;
+    }
+
+    ++idx;
+    TDatum datum;
+
+    if (!TryParseDatum(expr, &idx, &datum) || idx != expr.size() - 1) {
+        return false;
+    }
+
+    if (outDatum != nullptr) {
+        *outDatum = datum;
+    }
+
+    return true;
+}
+
 bool TryParseProcCallExpr(string expr, string *outProcName,
                           vector<string> *outParams) {
     if (expr.size() < 3) {
@@ -515,12 +705,273 @@ bool TryParseLetrec(string expr, TBindings *outBindings,
            TryParseLetBody(expr, idx, outLetBody);
 }
 
+// Parses "(keyword name ...)" into the list of names.
+bool TryParseNameList(string expr, int *idx, string keyword,
+                      vector<string> *outNames) {
+    if (SkipSpaceAndCheckIfEndOfExpr(expr, idx)) {
+        return false;
+    }
+
+    if (expr.compare(*idx, keyword.size() + 1, "(" + keyword) != 0) {
+        return false;
+    }
+
+    auto listEnd = expr.find(')', *idx);
+
+    if (listEnd == string::npos) {
+        return false;
+    }
+
+    auto namesStart = *idx + keyword.size() + 1;
+    istringstream namesIS(expr.substr(namesStart, listEnd - namesStart));
+    string name;
+
+    while (namesIS >> name) {
+        if (name.find_first_of("([]\"") != string::npos) {
+            return false;
+        }
+
+        if (outNames != nullptr) {
+            outNames->push_back(name);
+        }
+    }
+
+    *idx = listEnd + 1;
+
+    return true;
+}
+
+bool TryParseModule(string expr, string *outName,
+                    vector<string> *outImports, vector<string> *outExports,
+                    TBindings *outBindings, vector<string> *outBody) {
+    auto idx = TryParseSyntaxElementPrefix("module", expr);
+
+    if (idx == -1 || SkipSpaceAndCheckIfEndOfExpr(expr, &idx)) {
+        return false;
+    }
+
+    auto nameEnd = expr.find(' ', idx);
+
+    if (nameEnd == string::npos) {
+        return false;
+    }
+
+    if (outName != nullptr) {
+        *outName = expr.substr(idx, nameEnd - idx);
+    }
+
+    idx = nameEnd;
+
+    if (!TryParseNameList(expr, &idx, "import", outImports) ||
+        !TryParseNameList(expr, &idx, "export", outExports) ||
+        !TryParseLetBindings(expr, &idx, outBindings)) {
+        return false;
+    }
+
+    // Only the program's main module has a body.
+    return TryParseVariableNumOfSubExpr(expr, idx, outBody);
+}
+
 bool IsExpr(string expr) {
-    return IsImmediate(expr) || IsVarName(expr) ||
+    return IsImmediate(expr) || IsFlonum(expr) || IsString(expr) ||
+           IsVarName(expr) ||
            TryParseUnaryPrimitive(expr) || TryParseBinaryPrimitive(expr) ||
            TryParseTernaryPrimitive(expr) ||
            TryParseVariableArityPrimitive(expr) || TryParseLetExpr(expr) ||
            TryParseLetAsteriskExpr(expr) || TryParseLambda(expr) ||
-           TryParseProcCallExpr(expr);
+           TryParseQuote(expr) || TryParseProcCallExpr(expr);
+}
+
+// The end of the datum starting at begin in normalized source.
+size_t DatumEnd(const string &text, size_t begin) {
+    if (begin >= text.size()) {
+        return begin;
+    }
+
+    if (text[begin] == '\'') {
+        return DatumEnd(text, begin + 1);
+    }
+
+    auto end = begin;
+
+    if (text[end] == '(' || text.compare(end, 2, "#(") == 0) {
+        end = text.find('(', end);
+        int numOpenParen = 0;
+
+        do {
+            if (text.compare(end, 2, "#\\") == 0) {
+                end += 3;
+                continue;
+            }
+
+            numOpenParen += text[end] == '(' ? 1 : text[end] == ')' ? -1 : 0;
+            ++end;
+        } while (end < text.size() && numOpenParen > 0);
+
+        return end;
+    }
+
+    if (text.compare(end, 2, "#\\") == 0) {
+        end += 3;
+    }
+
+    while (end < text.size() && !IsDatumDelimiter(text[end])) {
+        ++end;
+    }
+
+    return end;
+}
+
+// Appends str to *out, and offset to *outOffsets for each of its characters.
+void AppendAt(const string &str, size_t offset, string *out,
+              vector<size_t> *outOffsets) {
+    *out += str;
+    outOffsets->insert(outOffsets->end(), str.size(), offset);
+}
+
+// Spells out 'datum as (quote datum). offsets holds where in the program file
+// each character of text comes from, and *outOffsets gets the same for the
+// result. (quote comes from the ' and its ) from the datum's last character.
+string ExpandQuotes(const string &text, const vector<size_t> &offsets,
+                    vector<size_t> *outOffsets) {
+    string expanded;
+
+    for (size_t i = 0; i < text.size();) {
+        if (text.compare(i, 2, "#\\") == 0) {
+            AppendAt(text.substr(i, 3), offsets[i], &expanded, outOffsets);
+            i += 3;
+            continue;
+        }
+
+        if (text[i] != '\'') {
+            AppendAt(string(1, text[i]), offsets[i], &expanded, outOffsets);
+            ++i;
+            continue;
+        }
+
+        auto end = DatumEnd(text, i + 1);
+        AppendAt("(quote ", offsets[i], &expanded, outOffsets);
+        expanded += ExpandQuotes(
+            text.substr(i + 1, end - i - 1),
+            vector<size_t>(offsets.begin() + i + 1, offsets.begin() + end),
+            outOffsets);
+        AppendAt(")", offsets[end - 1], &expanded, outOffsets);
+        i = end;
+    }
+
+    return expanded;
+}
+
+// Copies the string literal starting at text[*idx] in the form IsString
+// expects, leaving *idx at its closing quote.
+string NormalizeStringLiteral(const string &text, size_t *idx) {
+    static const map<char, char> escapedChars{
+        {'n', '\n'}, {'t', '\t'}, {'r', '\r'}, {'a', '\a'}, {'0', '\0'}};
+    static const char *hexDigits = "0123456789abcdef";
+    string normalized = "\"";
+
+    for (++*idx; *idx < text.size() && text[*idx] != '"'; ++*idx) {
+        auto c = text[*idx];
+
+        if (c == '\\' && *idx + 1 < text.size()) {
+            c = text[++*idx];
+            auto semicolon = text.find(';', *idx);
+
+            if (c == 'x' && semicolon != string::npos) {
+                c = static_cast<char>(
+                    strtol(text.substr(*idx + 1, semicolon - *idx - 1).c_str(),
+                           nullptr, 16));
+                *idx = semicolon;
+            } else if (escapedChars.count(c) != 0) {
+                c = escapedChars.at(c);
+            }
+        }
+
+        if (isgraph(static_cast<unsigned char>(c)) &&
+            string("\"()[]'\\;").find(c) == string::npos) {
+            normalized += c;
+        } else {
+            normalized += string("\\x") + hexDigits[(c >> 4) & 0xF] +
+                          hexDigits[c & 0xF] + ";";
+        }
+    }
+
+    return normalized + "\"";
 }
 
+// Turns a program file into the single-line form the parser expects:
+// comments dropped, whitespace runs collapsed into one space, no space right
+// inside parentheses or brackets, quote abbreviations spelled out and string
+// literals normalized.
+string NormalizeSource(const string &text, vector<size_t> *outOffsets) {
+    string collapsed;
+    vector<size_t> collapsedOffsets;
+    bool inComment = false;
+
+    for (size_t i = 0; i < text.size(); ++i) {
+        auto c = text[i];
+
+        if (inComment) {
+            inComment = c != '\n';
+            continue;
+        }
+
+        if (c == ';') {
+            inComment = true;
+            continue;
+        }
+
+        // A char may be a delimiter, a quote or ;.
+        if (text.compare(i, 2, "#\\") == 0 && i + 2 < text.size()) {
+            AppendAt(text.substr(i, 3), i, &collapsed, &collapsedOffsets);
+            i += 2;
+            continue;
+        }
+
+        if (c == '"') {
+            auto begin = i;
+            AppendAt(NormalizeStringLiteral(text, &i), begin, &collapsed,
+                     &collapsedOffsets);
+            continue;
+        }
+
+        if (isspace(c)) {
+            if (!collapsed.empty() && collapsed.back() != ' ') {
+                AppendAt(" ", i, &collapsed, &collapsedOffsets);
+            }
+
+            continue;
+        }
+
+        AppendAt(string(1, c), i, &collapsed, &collapsedOffsets);
+    }
+
+    string normalized;
+    vector<size_t> normalizedOffsets;
+
+    for (int i = 0; i < collapsed.size(); ++i) {
+        auto c = collapsed[i];
+
+        if (c == ' ') {
+            auto prev = normalized.empty() ? '(' : normalized.back();
+            auto next = i + 1 < collapsed.size() ? collapsed[i + 1] : ')';
+
+            if (prev == '(' || prev == '[' || next == ')' || next == ']') {
+                continue;
+            }
+        }
+
+        AppendAt(string(1, c), collapsedOffsets[i], &normalized,
+                 &normalizedOffsets);
+    }
+
+    vector<size_t> expandedOffsets;
+    auto expanded = ExpandQuotes(normalized, normalizedOffsets,
+                                 &expandedOffsets);
+
+    if (outOffsets != nullptr) {
+        *outOffsets = expandedOffsets;
+    }
+
+    return expanded;
+}
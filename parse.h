@@ -6,12 +6,29 @@
 #include <string>
 #include <vector>
 
+// The datum of a quote expression. A list's elements are chained through the
+// cdrs of its pairs; the last element of a dotted list is its final cdr. The
+// empty list is the immediate ().
+struct TDatum {
+    enum EKind { Immediate, Symbol, String, List, Vector };
+
+    EKind kind;
+    // The immediate's, symbol's or string literal's token.
+    std::string token;
+    std::vector<TDatum> elements;
+    bool isDotted = false;
+};
+
 bool IsFixNum(std::string token);
+bool IsFlonum(std::string token);
 bool IsBool(std::string token);
 bool IsNull(std::string token);
 bool IsChar(std::string token);
+bool IsString(std::string token);
+std::string StringLiteralChars(std::string token);
 bool IsImmediate(std::string token);
 bool IsVarName(std::string token);
+bool IsSymbolName(std::string token);
 bool TryParseUnaryPrimitive(std::string expr,
                             std::string *outPrimitiveName = nullptr,
                             std::vector<std::string> *outArgs = nullptr);
@@ -33,10 +50,20 @@ bool TryParseLambda(std::string expr,
                     std::vector<std::string> *outVars = nullptr,
                     std::string *outBody = nullptr,
                     std::vector<std::string> *outPossibleFreeVars = nullptr);
+bool TryParseQuote(std::string expr, TDatum *outDatum = nullptr);
 bool TryParseProcCallExpr(std::string expr, std::string *outProcName = nullptr,
                           std::vector<std::string> *outParams = nullptr);
 bool TryParseLetrec(std::string expr, TBindings *outBindings = nullptr,
                     std::vector<std::string> *outLetBody = nullptr);
+bool TryParseModule(std::string expr, std::string *outName = nullptr,
+                    std::vector<std::string> *outImports = nullptr,
+                    std::vector<std::string> *outExports = nullptr,
+                    TBindings *outBindings = nullptr,
+                    std::vector<std::string> *outBody = nullptr);
 bool IsExpr(std::string expr);
+// Turns a program file's text into the form the parser expects. *outOffsets
+// gets where in text each character of the result comes from.
+std::string NormalizeSource(const std::string &text,
+                            std::vector<size_t> *outOffsets = nullptr);
 
 #endif
@@ -0,0 +1,657 @@
+#include "peephole.h"
+
+#include "defs.h"
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+static bool StartsWith(const string &s, const string &prefix) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Splits at the commas that aren't in parentheses.
+static vector<string> SplitOperands(string_view text, size_t start) {
+    vector<string> operands;
+    int depth = 0;
+
+    for (auto i = start; i <= text.size(); ++i) {
+        if (i == text.size() || (text[i] == ',' && depth == 0)) {
+            auto first = text.find_first_not_of(" \t", start);
+            auto last = text.find_last_not_of(" \t", i - 1);
+            operands.emplace_back(
+                first < i ? text.substr(first, last - first + 1) : "");
+            start = i + 1;
+        } else {
+            depth += text[i] == '(' ? 1 : text[i] == ')' ? -1 : 0;
+        }
+    }
+
+    return operands;
+}
+
+static void ParseAsmLine(TAsmLine *line) {
+    auto text = line->text;
+    auto first = text.find_first_not_of(" \t");
+    line->kind = TAsmLine::Blank;
+
+    if (first == string::npos) {
+        return;
+    }
+
+    // Labels are the only lines that aren't indented.
+    if (first == 0) {
+        line->kind =
+            text.back() == ':' ? TAsmLine::Label : TAsmLine::Directive;
+
+        if (line->kind == TAsmLine::Label) {
+            line->op = text.substr(0, text.size() - 1);
+        }
+
+        return;
+    }
+
+    if (text[first] == '#') {
+        line->kind = TAsmLine::Comment;
+        return;
+    }
+
+    // Instructions with comments or strings are left alone.
+    if (text[first] == '.' ||
+        text.find_first_of("#\"", first) != string::npos) {
+        line->kind = TAsmLine::Directive;
+        line->op = text.substr(first, text.find_first_of(" \t", first) - first);
+        return;
+    }
+
+    line->kind = TAsmLine::Instruction;
+    auto opEnd = text.find_first_of(" \t", first);
+    line->op = text.substr(first, opEnd - first);
+
+    if (opEnd != string::npos &&
+        text.find_first_not_of(" \t", opEnd) != string::npos) {
+        line->operands = SplitOperands(text, opEnd);
+    }
+}
+
+vector<TAsmLine> ParseAsm(const string &code) {
+    vector<TAsmLine> lines(count(code.begin(), code.end(), '\n') +
+                           (code.empty() || code.back() == '\n' ? 0 : 1));
+    size_t lineStart = 0;
+
+    for (auto &line : lines) {
+        auto lineEnd = min(code.find('\n', lineStart), code.size());
+        line.text = string_view(code).substr(lineStart, lineEnd - lineStart);
+        ParseAsmLine(&line);
+        lineStart = lineEnd + 1;
+    }
+
+    return lines;
+}
+
+string FormatAsm(const vector<TAsmLine> &lines) {
+    string code;
+    code.reserve(lines.size() * 24);
+
+    for (const auto &line : lines) {
+        if (line.removed) {
+            continue;
+        }
+
+        if (!line.text.empty() || line.kind != TAsmLine::Instruction) {
+            code.append(line.text);
+            code += '\n';
+            continue;
+        }
+
+        code += "    " + line.op;
+
+        for (int i = 0; i < line.operands.size(); ++i) {
+            code += (i == 0 ? " " : ", ") + line.operands[i];
+        }
+
+        code += "\n";
+    }
+
+    return code;
+}
+
+//
+// What instructions do to registers and flags.
+//
+
+// Maps the names of general purpose registers to the 64-bit register they
+// are part of and their size in bytes.
+static const unordered_map<string, pair<string, int>> &Registers() {
+    static const auto registers = []() {
+        unordered_map<string, pair<string, int>> registers;
+
+        for (string r : {"a", "b", "c", "d"}) {
+            auto family = "r" + r + "x";
+            registers["r" + r + "x"] = {family, 8};
+            registers["e" + r + "x"] = {family, 4};
+            registers[r + "x"] = {family, 2};
+            registers[r + "l"] = {family, 1};
+            registers[r + "h"] = {family, 1};
+        }
+
+        for (string r : {"si", "di", "bp", "sp"}) {
+            auto family = "r" + r;
+            registers["r" + r] = {family, 8};
+            registers["e" + r] = {family, 4};
+            registers[r] = {family, 2};
+            registers[r + "l"] = {family, 1};
+        }
+
+        for (int n = 8; n <= 15; ++n) {
+            auto family = "r" + to_string(n);
+            registers[family] = {family, 8};
+            registers[family + "d"] = {family, 4};
+            registers[family + "w"] = {family, 2};
+            registers[family + "b"] = {family, 1};
+        }
+
+        return registers;
+    }();
+
+    return registers;
+}
+
+static bool IsRegister(const string &operand) {
+    return operand.size() > 1 && operand[0] == '%' &&
+           Registers().count(operand.substr(1)) != 0;
+}
+
+static bool IsImmediate(const string &operand) {
+    return !operand.empty() && operand[0] == '$';
+}
+
+// Whether the operand reads or writes any part of the 64-bit register reg.
+static bool MentionsRegister(const string &operand, const string &reg) {
+    for (size_t pos = operand.find('%'); pos != string::npos;
+         pos = operand.find('%', pos + 1)) {
+        auto end = pos + 1;
+
+        while (end < operand.size() && isalnum(operand[end])) {
+            ++end;
+        }
+
+        auto name = Registers().find(operand.substr(pos + 1, end - pos - 1));
+
+        if (name != Registers().end() && name->second.first == reg) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether op is one of baseOps, with or without an operand size suffix.
+static bool IsOp(const string &op, const set<string> &baseOps) {
+    return baseOps.count(op) != 0 ||
+           (op.size() > 1 && string("bwlq").find(op.back()) != string::npos &&
+            baseOps.count(op.substr(0, op.size() - 1)) != 0);
+}
+
+static bool IsConditionalJump(const string &op) {
+    return op.size() > 1 && op[0] == 'j' && op != "jmp";
+}
+
+enum class EEffect { None, Reads, Kills };
+
+static EEffect FlagsEffect(const TAsmLine &line) {
+    static const set<string> settingOps{"add", "sub",  "cmp",  "test",
+                                        "and", "or",   "xor",  "neg",
+                                        "imul", "ucomisd", "comisd"};
+    static const set<string> shiftOps{"sal", "sar", "shl", "shr"};
+    static const set<string> readingOps{"adc", "sbb"};
+    const auto &op = line.op;
+
+    if (IsConditionalJump(op) || StartsWith(op, "set") ||
+        StartsWith(op, "cmov") || IsOp(op, readingOps)) {
+        return EEffect::Reads;
+    }
+
+    if (op == "call" || op == "ret" || IsOp(op, settingOps)) {
+        return EEffect::Kills;
+    }
+
+    // Shifting by 0 leaves the flags alone.
+    if (IsOp(op, shiftOps) && line.operands.size() == 2 &&
+        IsImmediate(line.operands[0]) && line.operands[0] != "$0") {
+        return EEffect::Kills;
+    }
+
+    return EEffect::None;
+}
+
+static EEffect RegisterEffect(const TAsmLine &line, const string &reg) {
+    // Instructions that use registers they don't name.
+    static const set<string> implicitOps{"cqto", "cltq", "cltd", "cqo",
+                                         "div",  "idiv", "mul",  "rep",
+                                         "leave", "syscall", "cpuid",
+                                         "rdtsc"};
+    static const set<string> multiplyOps{"imul"};
+    static const set<string> movOps{"movq",   "movl",   "movabsq", "leaq",
+                                    "leal",   "movzbq", "movzbl",  "movzwq",
+                                    "movzwl", "movsbq", "movsbl",  "movswq",
+                                    "movslq"};
+    const auto &operands = line.operands;
+    bool mentioned = false;
+
+    for (const auto &operand : operands) {
+        mentioned = mentioned || MentionsRegister(operand, reg);
+    }
+
+    if (!mentioned) {
+        bool implicit = IsOp(line.op, implicitOps) ||
+                        (IsOp(line.op, multiplyOps) && operands.size() == 1);
+        return implicit ? EEffect::Reads : EEffect::None;
+    }
+
+    // Writes of 4 bytes clear the upper half.
+    const auto &dest = operands.back();
+    bool writesAll =
+        IsRegister(dest) && Registers().at(dest.substr(1)).second >= 4;
+
+    if (line.op == "popq" && writesAll) {
+        return EEffect::Kills;
+    }
+
+    if (movOps.count(line.op) != 0 && operands.size() == 2 && writesAll &&
+        !MentionsRegister(operands[0], reg)) {
+        return EEffect::Kills;
+    }
+
+    return EEffect::Reads;
+}
+
+using TLabelIndex = unordered_map<string, size_t>;
+
+// Whether resource, a 64-bit register or "flags", is overwritten before being
+// read on every path from line idx on. Gives up, answering no, after following
+// maxBranches conditional jumps.
+static bool IsDeadFrom(const vector<TAsmLine> &lines, const TLabelIndex &labels,
+                       size_t idx, const string &resource, int *maxBranches,
+                       set<size_t> *visitedLabels) {
+    bool isFlags = resource == "flags";
+
+    for (auto i = idx; i < lines.size(); ++i) {
+        const auto &line = lines[i];
+
+        if (line.removed || line.kind == TAsmLine::Comment ||
+            line.kind == TAsmLine::Blank) {
+            continue;
+        }
+
+        if (line.kind == TAsmLine::Label) {
+            // The paths through it are being followed already.
+            if (!visitedLabels->insert(i).second) {
+                return true;
+            }
+
+            continue;
+        }
+
+        if (line.kind == TAsmLine::Directive) {
+            if (line.op == ".pushsection") {
+                while (i + 1 < lines.size() &&
+                       lines[i + 1].op != ".popsection") {
+                    ++i;
+                }
+
+                ++i;
+                continue;
+            }
+
+            if (line.op == ".loc" || StartsWith(line.op, ".cfi")) {
+                continue;
+            }
+
+            return false;
+        }
+
+        auto effect =
+            isFlags ? FlagsEffect(line) : RegisterEffect(line, resource);
+
+        if (effect != EEffect::None) {
+            return effect == EEffect::Kills;
+        }
+
+        // Procedures return their value in %rax and take the closure in %rdi.
+        if (line.op == "ret" || line.op == "call") {
+            return false;
+        }
+
+        if (line.op != "jmp" && !IsConditionalJump(line.op)) {
+            continue;
+        }
+
+        auto target = line.operands.size() == 1
+                          ? labels.find(line.operands[0])
+                          : labels.end();
+
+        if (target == labels.end()) {
+            return false;
+        }
+
+        if (line.op == "jmp") {
+            // Goes on from the target's label.
+            i = target->second - 1;
+            continue;
+        }
+
+        if (--*maxBranches < 0 ||
+            !IsDeadFrom(lines, labels, target->second, resource, maxBranches,
+                        visitedLabels)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static bool IsDeadFrom(const vector<TAsmLine> &lines, const TLabelIndex &labels,
+                       size_t idx, const string &resource) {
+    int maxBranches = 16;
+    set<size_t> visitedLabels;
+    return IsDeadFrom(lines, labels, idx, resource, &maxBranches,
+                      &visitedLabels);
+}
+
+//
+// Rewrites. Each looks at the instruction at lines[i] and the ones after it.
+//
+
+// Comments, removed lines and line info don't separate instructions.
+static size_t NextLine(const vector<TAsmLine> &lines, size_t i) {
+    for (++i; i < lines.size(); ++i) {
+        const auto &line = lines[i];
+
+        if (!line.removed && line.kind != TAsmLine::Comment &&
+            line.kind != TAsmLine::Blank &&
+            !(line.kind == TAsmLine::Directive &&
+              line.op == ".loc")) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static bool IsInstruction(const vector<TAsmLine> &lines, size_t i,
+                          const string &op, vector<string> operands) {
+    return i < lines.size() && lines[i].kind == TAsmLine::Instruction &&
+           lines[i].op == op && lines[i].operands == operands;
+}
+
+static void Rewrite(TAsmLine *line, string op, vector<string> operands) {
+    line->op = op;
+    line->operands = operands;
+    line->text = {};
+}
+
+static bool IsMove(const TAsmLine &line) {
+    return line.kind == TAsmLine::Instruction && line.op == "movq" &&
+           line.operands.size() == 2;
+}
+
+// movq %r, %r
+static long RemoveSelfMove(vector<TAsmLine> *lines, size_t i) {
+    auto &line = (*lines)[i];
+
+    if (!IsMove(line) || !IsRegister(line.operands[0]) ||
+        line.operands[0] != line.operands[1]) {
+        return 0;
+    }
+
+    line.removed = true;
+    return 1;
+}
+
+// movq A, B followed by movq B, A, or by a load of B, which can come from A
+// instead when it's a register or an immediate.
+static long RemoveReload(vector<TAsmLine> *lines, size_t i) {
+    auto &first = (*lines)[i];
+    auto j = NextLine(*lines, i);
+
+    if (!IsMove(first) || j == lines->size() || !IsMove((*lines)[j]) ||
+        (*lines)[j].operands[0] != first.operands[1]) {
+        return 0;
+    }
+
+    auto &second = (*lines)[j];
+    const auto &from = first.operands[0];
+    const auto &to = first.operands[1];
+
+    // Loading a register from memory addressed by it changes the address.
+    if (second.operands[1] == from &&
+        !(IsRegister(to) && MentionsRegister(from, Registers()
+                                                       .at(to.substr(1))
+                                                       .first))) {
+        second.removed = true;
+        return 1;
+    }
+
+    if (!IsRegister(to) && (IsRegister(from) || IsImmediate(from)) &&
+        IsRegister(second.operands[1])) {
+        Rewrite(&second, "movq", {from, second.operands[1]});
+    }
+
+    return 0;
+}
+
+// A jump to a label right after it.
+static long RemoveJumpToNext(vector<TAsmLine> *lines, size_t i) {
+    auto &jump = (*lines)[i];
+
+    if ((jump.op != "jmp" && !IsConditionalJump(jump.op)) ||
+        jump.operands.size() != 1) {
+        return 0;
+    }
+
+    for (auto j = NextLine(*lines, i);
+         j < lines->size() && (*lines)[j].kind == TAsmLine::Label;
+         j = NextLine(*lines, j)) {
+        if ((*lines)[j].op == jump.operands[0]) {
+            jump.removed = true;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// The boolean a predicate builds in %al (see EmitCmp), compared with #f right
+// away by EmitIfExpr:
+//
+//   setCC %al
+//   movzbq %al, %rax
+//   sal $BoolBit, %al
+//   or $BoolF, %al
+//   cmp $BoolF, %al
+//   je L
+//
+// The branch can test the predicate's flags instead, unless %rax or the flags
+// are used after it.
+static long FuseBoolTest(vector<TAsmLine> *lines, const TLabelIndex &labels,
+                         size_t i) {
+    static const unordered_map<string, string> negatedConditions{
+        {"e", "ne"}, {"ne", "e"}, {"z", "nz"},  {"nz", "z"},  {"l", "ge"},
+        {"ge", "l"}, {"le", "g"}, {"g", "le"},  {"b", "ae"},  {"ae", "b"},
+        {"be", "a"}, {"a", "be"}, {"s", "ns"},  {"ns", "s"},  {"o", "no"},
+        {"no", "o"}, {"p", "np"}, {"np", "p"}};
+    const auto &setcc = (*lines)[i];
+
+    if (!StartsWith(setcc.op, "set") ||
+        setcc.operands != vector<string>{"%al"} ||
+        negatedConditions.count(setcc.op.substr(3)) == 0) {
+        return 0;
+    }
+
+    auto boolF = "$" + to_string(BoolF);
+    vector<size_t> seq{i};
+    vector<pair<string, vector<string>>> expected{
+        {"movzbq", {"%al", "%rax"}},
+        {"sal", {"$" + to_string(BoolBit), "%al"}},
+        {"or", {boolF, "%al"}},
+        {"cmp", {boolF, "%al"}}};
+
+    for (const auto &e : expected) {
+        seq.push_back(NextLine(*lines, seq.back()));
+
+        if (!IsInstruction(*lines, seq.back(), e.first, e.second)) {
+            return 0;
+        }
+    }
+
+    auto jumpIdx = NextLine(*lines, seq.back());
+
+    if (jumpIdx == lines->size()) {
+        return 0;
+    }
+
+    auto &jump = (*lines)[jumpIdx];
+    auto condition = setcc.op.substr(3);
+
+    if ((jump.op != "je" && jump.op != "jne") || jump.operands.size() != 1 ||
+        labels.count(jump.operands[0]) == 0) {
+        return 0;
+    }
+
+    auto target = labels.at(jump.operands[0]);
+
+    for (string resource : {"rax", "flags"}) {
+        if (!IsDeadFrom(*lines, labels, jumpIdx + 1, resource) ||
+            !IsDeadFrom(*lines, labels, target, resource)) {
+            return 0;
+        }
+    }
+
+    // je branches when the predicate is false.
+    if (jump.op == "je") {
+        condition = negatedConditions.at(condition);
+    }
+
+    Rewrite(&jump, "j" + condition, jump.operands);
+
+    for (auto idx : seq) {
+        (*lines)[idx].removed = true;
+    }
+
+    return seq.size();
+}
+
+// Scaling a register by 2, 4 or 8, then adding a constant:
+//
+//   imul $S, %r          salq $K, %r
+//   addq $D, %r          addq $D, %r
+//
+// becomes leaq D(,%r,S), %r, unless the flags are used after it.
+static long FormLea(vector<TAsmLine> *lines, const TLabelIndex &labels,
+                    size_t i) {
+    static const set<string> multiplyOps{"imul"};
+    static const set<string> shiftOps{"sal", "shl"};
+    static const set<string> addOps{"add"};
+    auto &scale = (*lines)[i];
+    bool isMultiply = IsOp(scale.op, multiplyOps);
+
+    if ((!isMultiply && !IsOp(scale.op, shiftOps)) ||
+        scale.operands.size() != 2 || !IsImmediate(scale.operands[0]) ||
+        !IsRegister(scale.operands[1]) ||
+        Registers().at(scale.operands[1].substr(1)).second != 8) {
+        return 0;
+    }
+
+    auto amount = scale.operands[0].substr(1);
+    string factor;
+
+    if (isMultiply && (amount == "2" || amount == "4" || amount == "8")) {
+        factor = amount;
+    } else if (!isMultiply &&
+               (amount == "1" || amount == "2" || amount == "3")) {
+        factor = to_string(1 << stoi(amount));
+    } else {
+        return 0;
+    }
+
+    const auto &reg = scale.operands[1];
+    auto j = NextLine(*lines, i);
+
+    if (j == lines->size() || (*lines)[j].kind != TAsmLine::Instruction ||
+        !IsOp((*lines)[j].op, addOps) || (*lines)[j].operands.size() != 2 ||
+        !IsImmediate((*lines)[j].operands[0]) ||
+        (*lines)[j].operands[1] != reg ||
+        !IsDeadFrom(*lines, labels, j + 1, "flags")) {
+        return 0;
+    }
+
+    auto displacement = (*lines)[j].operands[0].substr(1);
+
+    if (displacement.find_first_not_of("-0123456789") != string::npos) {
+        return 0;
+    }
+
+    Rewrite(&scale, "leaq",
+            {displacement + "(," + reg + "," + factor + ")", reg});
+    (*lines)[j].removed = true;
+    return 1;
+}
+
+long OptimizeAsmLines(vector<TAsmLine> *lines) {
+    TLabelIndex labels;
+
+    for (size_t i = 0; i < lines->size(); ++i) {
+        if ((*lines)[i].kind == TAsmLine::Label) {
+            labels[(*lines)[i].op] = i;
+        }
+    }
+
+    long numRemoved = 0;
+
+    // Each rewrite can make room for another.
+    for (bool changed = true; changed;) {
+        long numRemovedBefore = numRemoved;
+
+        for (size_t i = 0; i < lines->size(); ++i) {
+            if ((*lines)[i].removed ||
+                (*lines)[i].kind != TAsmLine::Instruction) {
+                continue;
+            }
+
+            // One rewrite at a time; it may have removed the instruction.
+            long numRemovedHere = RemoveSelfMove(lines, i);
+
+            if (numRemovedHere == 0) {
+                numRemovedHere = RemoveReload(lines, i);
+            }
+
+            if (numRemovedHere == 0) {
+                numRemovedHere = RemoveJumpToNext(lines, i);
+            }
+
+            if (numRemovedHere == 0) {
+                numRemovedHere = FuseBoolTest(lines, labels, i);
+            }
+
+            if (numRemovedHere == 0) {
+                numRemovedHere = FormLea(lines, labels, i);
+            }
+
+            numRemoved += numRemovedHere;
+        }
+
+        changed = numRemoved != numRemovedBefore;
+    }
+
+    return numRemoved;
+}
+
+string OptimizeAsm(const string &code, long *outNumRemoved) {
+    auto lines = ParseAsm(code);
+    *outNumRemoved = OptimizeAsmLines(&lines);
+    return FormatAsm(lines);
+}
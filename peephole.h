@@ -0,0 +1,43 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A line of emitted assembly.
+struct TAsmLine {
+    enum EKind { Instruction, Label, Directive, Comment, Blank };
+
+    EKind kind;
+    // The mnemonic of an instruction, the name of a label or directive.
+    std::string op;
+    std::vector<std::string> operands;
+    // The line as emitted, in the code it was parsed from; empty once the
+    // instruction is rewritten.
+    std::string_view text;
+    bool removed = false;
+};
+
+// The lines refer to code, which has to outlive them.
+std::vector<TAsmLine> ParseAsm(const std::string &code);
+std::string FormatAsm(const std::vector<TAsmLine> &lines);
+
+// Rewrites short sequences of instructions into fewer, equivalent ones:
+//
+// - a move of a value back to where it was just moved from, and moves of a
+//   register to itself, are dropped;
+// - a value stored to memory and loaded right back is taken from the
+//   register;
+// - jumps to the label that follows them are dropped;
+// - a boolean built from the flags, only to be compared with #f and branched
+//   on, becomes a branch on the flags;
+// - multiplying by 2, 4 or 8 and adding a constant becomes a leaq.
+//
+// Returns the number of instructions removed.
+long OptimizeAsmLines(std::vector<TAsmLine> *lines);
+
+// The same, on the text of one or more procedures.
+std::string OptimizeAsm(const std::string &code, long *outNumRemoved);
+
+#endif
@@ -0,0 +1,130 @@
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static bool WriteAll(int fd, const string &bytes) {
+    size_t numWritten = 0;
+
+    while (numWritten < bytes.size()) {
+        auto size = write(fd, bytes.data() + numWritten,
+                          bytes.size() - numWritten);
+
+        if (size <= 0) {
+            return false;
+        }
+
+        numWritten += size;
+    }
+
+    return true;
+}
+
+// Reads through a buffer, since numbers are read a byte at a time.
+struct TReader {
+    explicit TReader(int fd) : fd(fd) {}
+
+    int fd;
+    char buffer[4096];
+    size_t pos = 0;
+    size_t end = 0;
+
+    bool Fill() {
+        if (pos < end) {
+            return true;
+        }
+
+        auto size = read(fd, buffer, sizeof(buffer));
+
+        if (size <= 0) {
+            return false;
+        }
+
+        pos = 0;
+        end = size;
+        return true;
+    }
+
+    bool ReadNumber(size_t *outNumber) {
+        *outNumber = 0;
+
+        for (int numDigits = 0; Fill(); ++numDigits) {
+            auto c = buffer[pos++];
+
+            if (c == '\n') {
+                return numDigits > 0;
+            }
+
+            if (c < '0' || c > '9' || numDigits == 18) {
+                return false;
+            }
+
+            *outNumber = *outNumber * 10 + (c - '0');
+        }
+
+        return false;
+    }
+
+    bool Read(size_t size, string *outBytes) {
+        outBytes->clear();
+        outBytes->reserve(size);
+
+        while (outBytes->size() < size) {
+            if (!Fill()) {
+                return false;
+            }
+
+            auto chunk = min(end - pos, size - outBytes->size());
+            outBytes->append(buffer + pos, chunk);
+            pos += chunk;
+        }
+
+        return true;
+    }
+};
+
+bool SendFields(int fd, const vector<string> &fields) {
+    auto message = to_string(fields.size()) + "\n";
+
+    for (const auto &field : fields) {
+        message += to_string(field.size()) + "\n" + field;
+    }
+
+    return WriteAll(fd, message);
+}
+
+bool ReceiveFields(int fd, vector<string> *outFields) {
+    TReader reader(fd);
+    size_t numFields;
+
+    // A message is read whole before the reply is sent, so nothing the
+    // reader buffers belongs to the next one.
+    if (!reader.ReadNumber(&numFields) || numFields > 16) {
+        return false;
+    }
+
+    outFields->assign(numFields, "");
+
+    for (auto &field : *outFields) {
+        size_t size;
+
+        if (!reader.ReadNumber(&size) || !reader.Read(size, &field)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+string DefaultSocketPath() {
+    auto path = getenv("SILCD_SOCKET");
+
+    if (path != nullptr && path[0] != '\0') {
+        return path;
+    }
+
+    return "/tmp/silcd-" + to_string(getuid()) + ".sock";
+}
@@ -0,0 +1,23 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <vector>
+
+// Messages between the compile server and its clients. A message is a list
+// of fields, sent as the number of fields on a line, then each field as its
+// length on a line followed by its bytes.
+//
+// A request is {mode, output path, source, source path}. With mode "asm" the
+// response is {"ok", assembly}; with "binary" the program is linked to the
+// output path, which is absolute, and the response is {"ok", path}. Failures
+// get {"error", message}. The line info of the emitted code points into the
+// source path, which is absolute, or there is none when it's empty.
+bool SendFields(int fd, const std::vector<std::string> &fields);
+bool ReceiveFields(int fd, std::vector<std::string> *outFields);
+
+// Where the server listens unless told otherwise: $SILCD_SOCKET, or a socket
+// in /tmp private to the user.
+std::string DefaultSocketPath();
+
+#endif
@@ -1,7 +1,15 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 const unsigned int FxShift = 2;
@@ -26,166 +34,2168 @@ const unsigned int VectorTag = 0x05;
 const unsigned int StringMask = 0x07;
 const unsigned int StringTag = 0x06;
 
+const unsigned int ObjMask = 0x07;
+const unsigned int ObjTag = 0x03;
+const unsigned long ObjTypeMask = 0xFF;
+const unsigned long FlonumType = 0x01;
+const unsigned long BignumType = 0x02;
+const unsigned long HashtableType = 0x03;
+const unsigned long SymbolType = 0x04;
+const unsigned int BignumSignBit = 8;
+const unsigned int BignumSizeShift = 16;
+
+const int WordSize = 8;
+const int FixNumBits = WordSize * 8 - FxShift;
+
+// Operand size (in 32-bit limbs) from which bignum multiplication switches
+// from schoolbook to Karatsuba.
+const size_t KaratsubaThreshold = 32;
+
 typedef unsigned long ptr;
 
 char* gHeap;
+char* gHeapEnd;
+
+// A region of the Scheme stack (see link_stack_segment). Layout matches
+// sil_stack_underflow and sil_escape: limit first, prev three words after.
+typedef struct stack_segment {
+    // Procedures whose frame goes below the limit move to the next segment.
+    char* limit;
+    char* top;
+    char* base;
+    // The segment this one was linked to, and the one linked to it last.
+    struct stack_segment* prev;
+    struct stack_segment* next;
+} stack_segment;
+
+// The segment %rsp is in, and its limit, which compiled code compares with.
+stack_segment* gStackSegment;
+char* gStackLimit;
+// Next free heap address. Compiled code keeps it in %rbp and syncs it with
+// this variable around calls into the runtime.
+char* gAllocPtr;
+
+// All program output goes through a single buffer that is flushed with
+// write(2), so printing a large structure doesn't pay for stdio locking and
+// formatting on every atom.
+#define OUT_BUF_SIZE (64 * 1024)
+
+static char gOutBuf[OUT_BUF_SIZE];
+static size_t gOutLen = 0;
+
+static void out_flush_to(int fd) {
+    size_t written = 0;
+
+    while (written < gOutLen) {
+        ssize_t n = write(fd, gOutBuf + written, gOutLen - written);
+
+        if (n <= 0) {
+            exit(1);
+        }
+
+        written += n;
+    }
+
+    gOutLen = 0;
+}
+
+static void out_flush() { out_flush_to(STDOUT_FILENO); }
+
+static void out_char(char c) {
+    if (gOutLen == OUT_BUF_SIZE) {
+        out_flush();
+    }
+
+    gOutBuf[gOutLen++] = c;
+}
+
+static void out_str(const char* s) {
+    for (; *s != '\0'; ++s) {
+        out_char(*s);
+    }
+}
+
+static const char gDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const unsigned long gPowersOf10[] = {1UL,
+                                            10UL,
+                                            100UL,
+                                            1000UL,
+                                            10000UL,
+                                            100000UL,
+                                            1000000UL,
+                                            10000000UL,
+                                            100000000UL,
+                                            1000000000UL,
+                                            10000000000UL,
+                                            100000000000UL,
+                                            1000000000000UL,
+                                            10000000000000UL,
+                                            100000000000000UL,
+                                            1000000000000000UL,
+                                            10000000000000000UL,
+                                            100000000000000000UL,
+                                            1000000000000000000UL,
+                                            10000000000000000000UL};
+
+// Number of decimal digits in u, from its bit length (log10(2) ~ 1233/4096)
+// and one table lookup instead of a loop.
+static int decimal_digits(unsigned long u) {
+    u |= 1;
+    int bits = 64 - __builtin_clzl(u);
+    int digits = (bits * 1233) >> 12;
+    return digits + (u >= gPowersOf10[digits]);
+}
+
+// Formats x straight into the output buffer. The digit count is known up
+// front, so digits are written two at a time from the end with no copying.
+static void out_long(long x) {
+    // Work on the magnitude as unsigned so that LONG_MIN doesn't overflow.
+    unsigned long u = (x < 0) ? -(unsigned long)x : (unsigned long)x;
+    int len = decimal_digits(u) + (x < 0);
+
+    if (gOutLen + len > OUT_BUF_SIZE) {
+        out_flush();
+    }
+
+    char* p = gOutBuf + gOutLen + len;
+    gOutBuf[gOutLen] = '-';
+    gOutLen += len;
+
+    while (u >= 100) {
+        unsigned long pair = (u % 100) * 2;
+        u /= 100;
+        *--p = gDigitPairs[pair + 1];
+        *--p = gDigitPairs[pair];
+    }
+
+    if (u >= 10) {
+        *--p = gDigitPairs[u * 2 + 1];
+        *--p = gDigitPairs[u * 2];
+    } else {
+        *--p = (char)('0' + u);
+    }
+}
 
 static void print_char(char c) {
     if (c == ' ') {
-        printf("#\\\\space");
+        out_str("#\\\\space");
     } else if (c == '\n') {
-        printf("#\\\\newline");
+        out_str("#\\\\newline");
     } else if (c == '\t') {
-        printf("#\\\\tab");
+        out_str("#\\\\tab");
     } else if (c == '\r') {
-        printf("#\\\\return");
+        out_str("#\\\\return");
     } else if (c == '"') {
-        printf("#\\\\\\\"");
+        out_str("#\\\\\\\"");
     } else if (c == '\\') {
-        printf("#\\\\\\\\");
+        out_str("#\\\\\\\\");
     } else {
-        printf("#\\\\%c", c);
+        out_str("#\\\\");
+        out_char(c);
     }
 }
 
 static void print_char_within_str(char c) {
     if (c == '"') {
-        printf("\\\\\\\"");
+        out_str("\\\\\\\"");
     } else if (c == '\\') {
-        printf("\\\\\\\\");
+        out_str("\\\\\\\\");
     } else {
-        printf("%c", c);
+        out_char(c);
     }
 }
 
-static void print_ptr(ptr x, int parentIsPair) {
-    if ((x & FxMask) == FxTag) {
-        // TODO Examine why casting to long causes fx- to fail on boundary
-        // cases.
-        printf("%d", ((int)x) >> FxShift);
-    } else if (x == BoolF) {
-        printf("#f");
-    } else if (x == BoolT) {
-        printf("#t");
-    } else if (x == Null) {
-        printf("()");
-    } else if ((x & CharMask) == CharTag) {
-        print_char((char)(((int)x) >> CharShift));
-    } else if ((x & PairMask) == PairTag) {
-        ptr car = ((ptr*)(x - PairTag))[0];
-        ptr cdr = ((ptr*)(x - PairTag))[1];
-
-        // If x is a nested pair/list, don't print the (.
-        if (!parentIsPair) {
-            printf("(");
-        }
-
-        print_ptr(car, 0);
-
-        if (cdr != Null) {
-            // If cdr is a nested pair/list, don't print the dot.
-            if ((cdr & PairMask) != PairTag) {
-                printf(" . ");
-            } else {
-                printf(" ");
-            }
+static void print_hex(ptr x) {
+    static const char hexDigits[] = "0123456789abcdef";
+    int shift = 60;
+
+    out_str("0x");
+
+    // Skip leading zeros but keep at least 8 digits (the old %08lx format).
+    for (; shift > 28 && ((x >> shift) & 0xF) == 0; shift -= 4) {
+    }
+
+    for (; shift >= 0; shift -= 4) {
+        out_char(hexDigits[(x >> shift) & 0xF]);
+    }
+}
+
+// Signal handlers must not run on the Scheme stack: compiled code keeps live
+// values below %rsp, where the kernel would put the signal frame.
+static void install_signal_stack() {
+    static char altStack[64 * 1024];
+    stack_t ss;
+    ss.ss_sp = altStack;
+    ss.ss_size = sizeof(altStack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+}
+
+//
+// Allocation profiling.
+//
+// Programs compiled with allocation profiling get one alloc_site record per
+// allocation site in the sil_alloc_sites section, whose counters the compiled
+// code bumps on every allocation. The linker defines the section bounds; both
+// are null in programs compiled without profiling.
+//
+
+typedef struct {
+    long bytes;
+    long objects;
+    const char* kind;
+    const char* location;
+} alloc_site;
+
+extern alloc_site __start_sil_alloc_sites[] __attribute__((weak));
+extern alloc_site __stop_sil_alloc_sites[] __attribute__((weak));
+
+// Bignums and flonums the runtime allocates for generic arithmetic.
+static alloc_site gRuntimeAllocSite = {0, 0, "number",
+                                       "runtime: generic arithmetic"};
+// Hashtables; their slots are outside the Scheme heap.
+static alloc_site gHashtableAllocSite = {0, 0, "table",
+                                         "runtime: make-eq-hashtable"};
+static alloc_site gSymbolAllocSite = {0, 0, "symbol",
+                                      "runtime: string->symbol"};
+static alloc_site gSymbolNameAllocSite = {0, 0, "string",
+                                          "runtime: symbol->string"};
+static alloc_site* const gRuntimeAllocSites[] = {
+    &gRuntimeAllocSite, &gHashtableAllocSite, &gSymbolAllocSite,
+    &gSymbolNameAllocSite};
+static const size_t NumRuntimeAllocSites =
+    sizeof(gRuntimeAllocSites) / sizeof(gRuntimeAllocSites[0]);
+
+static int is_alloc_profiling_enabled() {
+    return (uintptr_t)__start_sil_alloc_sites !=
+           (uintptr_t)__stop_sil_alloc_sites;
+}
+
+static int compare_alloc_sites(const void* a, const void* b) {
+    const alloc_site* x = *(const alloc_site* const*)a;
+    const alloc_site* y = *(const alloc_site* const*)b;
+
+    if (x->bytes != y->bytes) {
+        return x->bytes < y->bytes ? 1 : -1;
+    }
+
+    return x->objects < y->objects ? 1 : (x->objects > y->objects ? -1 : 0);
+}
+
+// Prints the allocation sites that allocated anything to stderr, most bytes
+// first.
+static void dump_alloc_profile() {
+    size_t numSites = __stop_sil_alloc_sites - __start_sil_alloc_sites;
+    size_t numAllSites = numSites + NumRuntimeAllocSites;
+    const alloc_site** sites = malloc(numAllSites * sizeof(alloc_site*));
+    size_t numUsed = 0;
+    long totalBytes = 0;
+    long totalObjects = 0;
+
+    if (sites == NULL) {
+        return;
+    }
 
-            print_ptr(cdr, 1);
+    for (size_t i = 0; i < numAllSites; ++i) {
+        const alloc_site* site = i < numSites
+                                     ? &__start_sil_alloc_sites[i]
+                                     : gRuntimeAllocSites[i - numSites];
+
+        if (site->objects > 0) {
+            sites[numUsed++] = site;
+            totalBytes += site->bytes;
+            totalObjects += site->objects;
+        }
+    }
+
+    qsort(sites, numUsed, sizeof(alloc_site*), compare_alloc_sites);
+
+    fprintf(stderr, "\nAllocation profile: %ld bytes in %ld objects\n",
+            totalBytes, totalObjects);
+    fprintf(stderr, "%12s %10s %6s  %-8s %s\n", "bytes", "objects", "%",
+            "kind", "site");
+
+    for (size_t i = 0; i < numUsed; ++i) {
+        fprintf(stderr, "%12ld %10ld %6.1f  %-8s %s\n", sites[i]->bytes,
+                sites[i]->objects, 100.0 * sites[i]->bytes / totalBytes,
+                sites[i]->kind, sites[i]->location);
+    }
+
+    fprintf(stderr, "%zu of %zu allocation sites never allocated.\n",
+            numAllSites - numUsed, numAllSites);
+    free(sites);
+}
+
+// Bounds of the program's code and read-only data, where the compiler lays out
+// literals (see EmitLiteralObject in emit.cpp).
+extern char __executable_start[];
+extern char __data_start[];
+
+// Names the likely causes of a crash: running into the heap's guard page, and
+// writing to a literal, which compiled code only does when the program changes
+// one. There is no garbage collector, so profiled programs are likely to be
+// the ones running out of heap. Report the profile when that happens too.
+static void on_fatal_signal(int sig, siginfo_t* info, void* ucontext) {
+    char* addr = info->si_addr;
+
+    out_flush();
+
+    if (sig == SIGSEGV && addr >= gHeapEnd &&
+        addr < gHeapEnd + getpagesize()) {
+        fprintf(stderr, "error: out of heap space\n");
+    } else if (sig == SIGSEGV && info->si_code == SEGV_ACCERR &&
+               addr >= __executable_start && addr < __data_start) {
+        fprintf(stderr, "error: attempt to change a literal\n");
+    } else {
+        fprintf(stderr, "error: %s\n", strsignal(sig));
+    }
+
+    if (is_alloc_profiling_enabled()) {
+        dump_alloc_profile();
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_fatal_signal_handlers() {
+    install_signal_stack();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_fatal_signal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+//
+// Sampling profiler.
+//
+// With SIL_PROFILE=1 in the environment, SIGPROF samples the running
+// procedure and the Scheme call stack every millisecond of CPU time. The
+// compiler describes every procedure in the sil_procs section and every call's
+// return address in the sil_call_sites section; a call site's stack index is
+// how far the caller moved %rsp down for the call, which is how the profiler
+// gets from a callee's frame to its caller's. At exit, a flat profile goes to
+// stderr and the collapsed stacks (flamegraph.pl input) to SIL_PROFILE_OUT,
+// sil-profile.folded by default.
+//
+
+typedef struct {
+    char* start;
+    char* end;
+    const char* name;
+    const char* source;
+} proc_info;
+
+typedef struct {
+    char* returnAddress;
+    long stackIdx;
+} call_site_info;
+
+extern proc_info __start_sil_procs[] __attribute__((weak));
+extern proc_info __stop_sil_procs[] __attribute__((weak));
+extern call_site_info __start_sil_call_sites[] __attribute__((weak));
+extern call_site_info __stop_sil_call_sites[] __attribute__((weak));
+
+// While compiled code calls into the runtime, the aligned frame it switched
+// %rsp to. It holds the Scheme %rsp, right above the call's return address.
+char** gRuntimeFrame;
+
+#define PROFILE_MAX_SAMPLES (64 * 1024)
+#define PROFILE_MAX_DEPTH 128
+
+// Frames of a sample are indices into the sil_procs table, leaf first.
+// RuntimeFrame stands for code outside compiled procedures and
+// TruncatedFrame for the part of a stack too deep to record.
+static const int RuntimeFrame = -1;
+static const int TruncatedFrame = -2;
+
+typedef struct {
+    int depth;
+    int frames[PROFILE_MAX_DEPTH];
+} profile_sample;
+
+static profile_sample* gSamples;
+static size_t gNumSamples = 0;
+static size_t gNumDroppedSamples = 0;
+
+static int compare_procs(const void* a, const void* b) {
+    const proc_info* x = a;
+    const proc_info* y = b;
+    return x->start < y->start ? -1 : (x->start > y->start ? 1 : 0);
+}
+
+static int compare_call_sites(const void* a, const void* b) {
+    const call_site_info* x = a;
+    const call_site_info* y = b;
+    return x->returnAddress < y->returnAddress
+               ? -1
+               : (x->returnAddress > y->returnAddress ? 1 : 0);
+}
+
+static int find_proc(char* pc) {
+    size_t lo = 0;
+    size_t hi = __stop_sil_procs - __start_sil_procs;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (pc < __start_sil_procs[mid].start) {
+            hi = mid;
+        } else if (pc >= __start_sil_procs[mid].end) {
+            lo = mid + 1;
+        } else {
+            return mid;
         }
+    }
+
+    return RuntimeFrame;
+}
 
-        // If x is a nested pair/list, don't print the ).
-        if (!parentIsPair) {
-            printf(")");
+static const call_site_info* find_call_site(char* returnAddress) {
+    size_t lo = 0;
+    size_t hi = __stop_sil_call_sites - __start_sil_call_sites;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        char* addr = __start_sil_call_sites[mid].returnAddress;
+
+        if (returnAddress < addr) {
+            hi = mid;
+        } else if (returnAddress > addr) {
+            lo = mid + 1;
+        } else {
+            return &__start_sil_call_sites[mid];
         }
-    } else if ((x & VectorMask) == VectorTag) {
-        ptr length = ((ptr*)(x - VectorTag))[0] >> FxShift;
-        printf("#(");
+    }
 
-        for (int i = 0; i < length; ++i) {
-            print_ptr(((ptr*)(x - VectorTag))[i + 1], 0);
+    return NULL;
+}
 
-            if (i < length - 1) {
-                printf(" ");
-            }
+static int is_on_scheme_stack(char** sp) {
+    for (stack_segment* s = gStackSegment; s != NULL; s = s->prev) {
+        if ((char*)sp >= s->top && (char*)sp < s->base) {
+            return 1;
         }
+    }
+
+    return 0;
+}
+
+extern char sil_stack_underflow[];
+
+// Walks the Scheme stack from the interrupted pc and %rsp. A walk that runs
+// into a state it can't decode (e.g. in the middle of a call sequence) just
+// ends early.
+static void on_profile_signal(int sig, siginfo_t* info, void* ucontext) {
+    ucontext_t* uc = ucontext;
+    char* pc = (char*)uc->uc_mcontext.gregs[REG_RIP];
+    char** sp = (char**)uc->uc_mcontext.gregs[REG_RSP];
+
+    if (gNumSamples == PROFILE_MAX_SAMPLES) {
+        ++gNumDroppedSamples;
+        return;
+    }
+
+    profile_sample* sample = &gSamples[gNumSamples++];
+    sample->depth = 0;
+    int proc = find_proc(pc);
 
-        printf(")");
-    } else if ((x & StringMask) == StringTag) {
-        ptr length = ((ptr*)(x - StringTag))[0] >> FxShift;
-        printf("\\\"");
+    if (proc == RuntimeFrame) {
+        sample->frames[sample->depth++] = RuntimeFrame;
 
-        for (int i = 0; i < length; ++i) {
-            assert((((ptr*)(x - StringTag))[i + 1] & CharMask) == CharTag);
-            char c = (char)(((ptr*)(x - StringTag))[i + 1] >> CharShift);
-            print_char_within_str(c);
+        if (gRuntimeFrame == NULL) {
+            return;
         }
 
-        printf("\\\"");
+        pc = gRuntimeFrame[-1];
+        sp = (char**)gRuntimeFrame[0];
+        proc = find_proc(pc);
     } else {
-        printf("#<unknown 0x%08lx>", x);
+        // Right after a call returns, %rsp is still moved down for the call.
+        const call_site_info* site = find_call_site(pc);
+
+        if (site != NULL) {
+            sp = (char**)((char*)sp - site->stackIdx);
+        }
+    }
+
+    while (proc != RuntimeFrame) {
+        if (sample->depth == PROFILE_MAX_DEPTH - 1) {
+            sample->frames[sample->depth++] = TruncatedFrame;
+            return;
+        }
+
+        sample->frames[sample->depth++] = proc;
+
+        if (!is_on_scheme_stack(sp)) {
+            return;
+        }
+
+        // A procedure moved to a new segment returns to its caller's through
+        // sil_stack_underflow, with the caller's %rsp right above.
+        if (*sp == sil_stack_underflow) {
+            sp = (char**)sp[1];
+        }
+
+        const call_site_info* site = find_call_site(*sp);
+
+        if (site == NULL) {
+            return;
+        }
+
+        // The callee's frame starts right below the return address, which
+        // is where the caller's %rsp pointed during the call.
+        sp = (char**)((char*)(sp + 1) - site->stackIdx);
+        proc = find_proc(site->returnAddress);
     }
 }
 
-static char* allocate_protected_space(int size) {
-    int page = getpagesize();
-    int status;
-    int aligned_size = ((size + page - 1) / page) * page;
-    char* p = mmap(0, aligned_size + 2 * page, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+static int is_profiling_enabled() {
+    const char* value = getenv("SIL_PROFILE");
+    return value != NULL && strcmp(value, "1") == 0 &&
+           (uintptr_t)__start_sil_procs != (uintptr_t)__stop_sil_procs;
+}
 
-    if (p == MAP_FAILED) {
-        exit(1);
+static void start_profiling() {
+    gSamples = mmap(0, PROFILE_MAX_SAMPLES * sizeof(profile_sample),
+                    PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+    if (gSamples == MAP_FAILED) {
+        fprintf(stderr, "warning: couldn't allocate the profile buffer\n");
+        return;
     }
 
-    status = mprotect(p, page, PROT_NONE);
+    qsort(__start_sil_procs, __stop_sil_procs - __start_sil_procs,
+          sizeof(proc_info), compare_procs);
+    qsort(__start_sil_call_sites,
+          __stop_sil_call_sites - __start_sil_call_sites,
+          sizeof(call_site_info), compare_call_sites);
 
-    if (status != 0) {
-        exit(1);
+    install_signal_stack();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_profile_signal;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static const char* frame_name(int frame) {
+    if (frame == RuntimeFrame) {
+        return "[runtime]";
     }
 
-    status = mprotect(p + page + aligned_size, page, PROT_NONE);
+    if (frame == TruncatedFrame) {
+        return "[truncated]";
+    }
 
-    if (status != 0) {
-        exit(1);
+    return __start_sil_procs[frame].name;
+}
+
+// Orders samples by their stacks from the root down, so equal stacks end up
+// next to each other.
+static int compare_samples(const void* a, const void* b) {
+    const profile_sample* x = a;
+    const profile_sample* y = b;
+    int i = x->depth - 1;
+    int j = y->depth - 1;
+
+    for (; i >= 0 && j >= 0; --i, --j) {
+        if (x->frames[i] != y->frames[j]) {
+            return x->frames[i] < y->frames[j] ? -1 : 1;
+        }
     }
 
-    return (p + page);
+    return i < 0 ? (j < 0 ? 0 : -1) : 1;
 }
 
-static void deallocate_protected_space(char* p, int size) {
-    int page = getpagesize();
-    int status;
-    int aligned_size = ((size + page - 1) / page) * page;
-    status = munmap(p - page, aligned_size + 2 * page);
+static void write_collapsed_stacks(FILE* out) {
+    qsort(gSamples, gNumSamples, sizeof(profile_sample), compare_samples);
 
-    if (status != 0) {
-        exit(1);
+    for (size_t i = 0; i < gNumSamples;) {
+        size_t j = i + 1;
+
+        while (j < gNumSamples &&
+               compare_samples(&gSamples[i], &gSamples[j]) == 0) {
+            ++j;
+        }
+
+        for (int f = gSamples[i].depth - 1; f >= 0; --f) {
+            fprintf(out, "%s%s", frame_name(gSamples[i].frames[f]),
+                    f > 0 ? ";" : "");
+        }
+
+        fprintf(out, " %zu\n", j - i);
+        i = j;
     }
 }
 
 typedef struct {
-    void* rax;
-    void* rbx;
-    void* rcx;
-    void* rdx;
-    void* rsi;
-    void* rdi;
-    void* rbp;
-    void* rsp;
-} context;
+    int frame;
+    long self;
+    long total;
+} flat_entry;
 
-long scheme_entry(context*, char*, char*);
+static int compare_flat_entries(const void* a, const void* b) {
+    const flat_entry* x = a;
+    const flat_entry* y = b;
 
-int main(int argc, char** argv) {
-    int stack_size = (16 * 4096);
-    int heap_size = (16 * 4096);
-    char* stack_top = allocate_protected_space(stack_size);
-    char* stack_base = stack_top + stack_size;
-    gHeap = allocate_protected_space(heap_size);
-    context ctxt;
-    print_ptr(scheme_entry(&ctxt, stack_base, gHeap), 0);
-    printf("\n");
-    deallocate_protected_space(stack_top, stack_size);
+    if (x->self != y->self) {
+        return x->self < y->self ? 1 : -1;
+    }
+
+    return x->total < y->total ? 1 : (x->total > y->total ? -1 : 0);
+}
+
+// Prints each procedure's self samples (it was running) and total samples
+// (it was on the stack, counted once per sample even when recursive).
+static void write_flat_profile(FILE* out) {
+    size_t numProcs = __stop_sil_procs - __start_sil_procs;
+    // Slots 0 and 1 are for the runtime and truncated pseudo-frames.
+    flat_entry* entries = calloc(numProcs + 2, sizeof(flat_entry));
+    size_t* lastSample = calloc(numProcs + 2, sizeof(size_t));
+
+    if (entries == NULL || lastSample == NULL) {
+        free(entries);
+        free(lastSample);
+        return;
+    }
+
+    for (size_t i = 0; i < numProcs + 2; ++i) {
+        entries[i].frame = (int)i - 2;
+    }
+
+    for (size_t s = 0; s < gNumSamples; ++s) {
+        const profile_sample* sample = &gSamples[s];
+
+        for (int f = 0; f < sample->depth; ++f) {
+            size_t slot = sample->frames[f] + 2;
+
+            if (f == 0) {
+                ++entries[slot].self;
+            }
+
+            if (lastSample[slot] != s + 1) {
+                lastSample[slot] = s + 1;
+                ++entries[slot].total;
+            }
+        }
+    }
+
+    qsort(entries, numProcs + 2, sizeof(flat_entry), compare_flat_entries);
+
+    fprintf(out, "\nProfile: %zu samples (1 ms CPU time each)", gNumSamples);
+
+    if (gNumDroppedSamples > 0) {
+        fprintf(out, ", %zu dropped", gNumDroppedSamples);
+    }
+
+    fprintf(out, "\n%7s %7s %7s %7s  %-20s %s\n", "self%", "self", "total%",
+            "total", "procedure", "source");
+
+    for (size_t i = 0; i < numProcs + 2 && entries[i].total > 0; ++i) {
+        int frame = entries[i].frame;
+        fprintf(out, "%7.1f %7ld %7.1f %7ld  %-20s %s\n",
+                100.0 * entries[i].self / gNumSamples, entries[i].self,
+                100.0 * entries[i].total / gNumSamples, entries[i].total,
+                frame_name(frame),
+                frame >= 0 ? __start_sil_procs[frame].source : "");
+    }
+
+    free(entries);
+    free(lastSample);
+}
+
+static void stop_profiling() {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    if (gSamples == MAP_FAILED || gNumSamples == 0) {
+        return;
+    }
+
+    const char* path = getenv("SIL_PROFILE_OUT");
+    path = path != NULL ? path : "sil-profile.folded";
+    FILE* out = fopen(path, "w");
+
+    if (out != NULL) {
+        write_collapsed_stacks(out);
+        fclose(out);
+    } else {
+        fprintf(stderr, "warning: couldn't write %s\n", path);
+    }
+
+    write_flat_profile(stderr);
+}
+
+//
+// Numeric tower. Fixnums are handled inline by compiled code, which calls the
+// generic_* entry points below when an operand isn't a fixnum or a fixnum
+// operation overflows. Bignums and flonums are ObjTag heap objects allocated
+// from the Scheme heap through gAllocPtr.
+//
+
+static void fatal(const char* msg) {
+    out_flush();
+    write(STDERR_FILENO, msg, strlen(msg));
+    exit(1);
+}
+
+static void* heap_alloc_at(alloc_site* site, size_t bytes) {
+    void* p = gAllocPtr;
+    size_t alignedBytes = (bytes + WordSize - 1) & ~(WordSize - 1);
+    gAllocPtr += alignedBytes;
+    site->bytes += alignedBytes;
+    ++site->objects;
+    return p;
+}
+
+static void* heap_alloc(size_t bytes) {
+    return heap_alloc_at(&gRuntimeAllocSite, bytes);
+}
+
+static int is_obj_of_type(ptr x, ptr type) {
+    return (x & ObjMask) == ObjTag &&
+           (((ptr*)(x - ObjTag))[0] & ObjTypeMask) == type;
+}
+
+static ptr make_flonum(double d) {
+    ptr* obj = heap_alloc(2 * WordSize);
+    obj[0] = FlonumType;
+    memcpy(&obj[1], &d, sizeof(double));
+    return (ptr)obj | ObjTag;
+}
+
+static double flonum_value(ptr x) {
+    double d;
+    memcpy(&d, &((ptr*)(x - ObjTag))[1], sizeof(double));
+    return d;
+}
+
+// A view of an exact integer as a sign and a little-endian array of 32-bit
+// limbs. Fixnums are unpacked into the inline buffer; bignum views point
+// straight at the heap object.
+typedef struct {
+    const uint32_t* limbs;
+    size_t size;
+    int negative;
+    uint32_t inlineLimbs[2];
+} integer_view;
+
+static void view_integer(ptr x, integer_view* view) {
+    if ((x & FxMask) == FxTag) {
+        long value = ((long)x) >> FxShift;
+        unsigned long mag =
+            value < 0 ? -(unsigned long)value : (unsigned long)value;
+        view->inlineLimbs[0] = (uint32_t)mag;
+        view->inlineLimbs[1] = (uint32_t)(mag >> 32);
+        view->limbs = view->inlineLimbs;
+        view->size = mag == 0 ? 0 : (mag >> 32) == 0 ? 1 : 2;
+        view->negative = value < 0;
+    } else {
+        ptr header = ((ptr*)(x - ObjTag))[0];
+        view->limbs = (const uint32_t*)&((ptr*)(x - ObjTag))[1];
+        view->size = header >> BignumSizeShift;
+        view->negative = (header >> BignumSignBit) & 1;
+    }
+}
+
+static size_t mag_trim(const uint32_t* a, size_t size) {
+    for (; size > 0 && a[size - 1] == 0; --size) {
+    }
+
+    return size;
+}
+
+static int mag_cmp(const uint32_t* a, size_t an, const uint32_t* b,
+                   size_t bn) {
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+
+    for (size_t i = an; i-- > 0;) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+// out[0, outLen) += in[0, n), with n <= outLen. The final carry is dropped.
+static void mag_add_into(uint32_t* out, size_t outLen, const uint32_t* in,
+                         size_t n) {
+    uint64_t carry = 0;
+    size_t i = 0;
+
+    for (; i < n; ++i) {
+        uint64_t t = (uint64_t)out[i] + in[i] + carry;
+        out[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+
+    for (; carry != 0 && i < outLen; ++i) {
+        uint64_t t = (uint64_t)out[i] + carry;
+        out[i] = (uint32_t)t;
+        carry = t >> 32;
+    }
+}
+
+// out[0, outLen) -= in[0, n), with out >= in.
+static void mag_sub_from(uint32_t* out, size_t outLen, const uint32_t* in,
+                         size_t n) {
+    uint64_t borrow = 0;
+    size_t i = 0;
+
+    for (; i < n; ++i) {
+        uint64_t t = (uint64_t)out[i] - in[i] - borrow;
+        out[i] = (uint32_t)t;
+        borrow = (t >> 32) & 1;
+    }
+
+    for (; borrow != 0 && i < outLen; ++i) {
+        uint64_t t = (uint64_t)out[i] - borrow;
+        out[i] = (uint32_t)t;
+        borrow = (t >> 32) & 1;
+    }
+}
+
+static void mag_mul_schoolbook(const uint32_t* a, size_t an,
+                               const uint32_t* b, size_t bn, uint32_t* out) {
+    memset(out, 0, (an + bn) * sizeof(uint32_t));
+
+    for (size_t i = 0; i < an; ++i) {
+        uint64_t carry = 0;
+
+        for (size_t j = 0; j < bn; ++j) {
+            uint64_t t = (uint64_t)a[i] * b[j] + out[i + j] + carry;
+            out[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+
+        out[i + bn] = (uint32_t)carry;
+    }
+}
+
+static uint32_t* limbs_alloc(size_t n) {
+    uint32_t* limbs = calloc(n == 0 ? 1 : n, sizeof(uint32_t));
+
+    if (limbs == NULL) {
+        fatal("error: out of memory\n");
+    }
+
+    return limbs;
+}
+
+// out[0, 2n) = a[0, n) * b[0, n), using three half-size products instead of
+// four once the operands are large enough for that to pay off.
+static void mag_mul_karatsuba(const uint32_t* a, const uint32_t* b, size_t n,
+                              uint32_t* out) {
+    if (n < KaratsubaThreshold) {
+        mag_mul_schoolbook(a, n, b, n, out);
+        return;
+    }
+
+    size_t lo = n / 2;
+    size_t hi = n - lo;
+    uint32_t* aSum = limbs_alloc(hi + 1);
+    uint32_t* bSum = limbs_alloc(hi + 1);
+    uint32_t* mid = limbs_alloc(2 * (hi + 1));
+
+    memcpy(aSum, a + lo, hi * sizeof(uint32_t));
+    mag_add_into(aSum, hi + 1, a, lo);
+    memcpy(bSum, b + lo, hi * sizeof(uint32_t));
+    mag_add_into(bSum, hi + 1, b, lo);
+
+    // mid = (a0 + a1)(b0 + b1) - a0 b0 - a1 b1 = a0 b1 + a1 b0.
+    mag_mul_karatsuba(aSum, bSum, hi + 1, mid);
+    mag_mul_karatsuba(a, b, lo, out);
+    mag_mul_karatsuba(a + lo, b + lo, hi, out + 2 * lo);
+    mag_sub_from(mid, 2 * (hi + 1), out, 2 * lo);
+    mag_sub_from(mid, 2 * (hi + 1), out + 2 * lo, 2 * hi);
+
+    // a0 b1 + a1 b0 < 2^(32 (lo + hi) + 1), so lo + hi + 1 limbs hold it.
+    mag_add_into(out + lo, 2 * n - lo, mid, lo + hi + 1);
+
+    free(aSum);
+    free(bSum);
+    free(mid);
+}
+
+// out[0, an + bn) = a * b.
+static void mag_mul(const uint32_t* a, size_t an, const uint32_t* b,
+                    size_t bn, uint32_t* out) {
+    if (an < bn) {
+        const uint32_t* t = a;
+        a = b;
+        b = t;
+        size_t tn = an;
+        an = bn;
+        bn = tn;
+    }
+
+    if (bn < KaratsubaThreshold) {
+        mag_mul_schoolbook(a, an, b, bn, out);
+        return;
+    }
+
+    // Unbalanced operands: multiply b by bn-limb chunks of a.
+    uint32_t* partial = limbs_alloc(an + bn);
+    memset(out, 0, (an + bn) * sizeof(uint32_t));
+
+    for (size_t offset = 0; offset < an; offset += bn) {
+        size_t chunk = (an - offset) < bn ? (an - offset) : bn;
+
+        if (chunk == bn) {
+            mag_mul_karatsuba(a + offset, b, bn, partial);
+        } else {
+            mag_mul(a + offset, chunk, b, bn, partial);
+        }
+
+        mag_add_into(out + offset, an + bn - offset, partial, chunk + bn);
+    }
+
+    free(partial);
+}
+
+// Boxes a magnitude as an exact integer: a fixnum when it fits, a bignum
+// otherwise.
+static ptr make_integer(const uint32_t* limbs, size_t size, int negative) {
+    size = mag_trim(limbs, size);
+
+    if (size <= 2) {
+        unsigned long mag = size == 0   ? 0
+                            : size == 1 ? limbs[0]
+                                        : (limbs[0] | (unsigned long)limbs[1]
+                                                          << 32);
+        unsigned long limit = (1UL << (FixNumBits - 1)) - (negative ? 0 : 1);
+
+        if (mag <= limit) {
+            long value = negative ? -(long)mag : (long)mag;
+            return (ptr)value << FxShift;
+        }
+    }
+
+    ptr* obj = heap_alloc(WordSize + size * sizeof(uint32_t));
+    obj[0] = BignumType | ((ptr)negative << BignumSignBit) |
+             ((ptr)size << BignumSizeShift);
+    memcpy(&obj[1], limbs, size * sizeof(uint32_t));
+    return (ptr)obj | ObjTag;
+}
+
+static ptr integer_add(const integer_view* a, const integer_view* b,
+                       int negateB) {
+    int bNegative = b->negative ^ negateB;
+    size_t size = (a->size > b->size ? a->size : b->size) + 1;
+    uint32_t* out = limbs_alloc(size);
+    int negative;
+
+    if (a->negative == bNegative) {
+        memcpy(out, a->limbs, a->size * sizeof(uint32_t));
+        mag_add_into(out, size, b->limbs, b->size);
+        negative = a->negative;
+    } else if (mag_cmp(a->limbs, a->size, b->limbs, b->size) >= 0) {
+        memcpy(out, a->limbs, a->size * sizeof(uint32_t));
+        mag_sub_from(out, size, b->limbs, b->size);
+        negative = a->negative;
+    } else {
+        memcpy(out, b->limbs, b->size * sizeof(uint32_t));
+        mag_sub_from(out, size, a->limbs, a->size);
+        negative = bNegative;
+    }
+
+    ptr result = make_integer(out, size, negative);
+    free(out);
+    return result;
+}
+
+static ptr integer_mul(const integer_view* a, const integer_view* b) {
+    uint32_t* out = limbs_alloc(a->size + b->size);
+
+    if (a->size > 0 && b->size > 0) {
+        mag_mul(a->limbs, a->size, b->limbs, b->size, out);
+    }
+
+    ptr result = make_integer(out, a->size + b->size,
+                              a->negative != b->negative);
+    free(out);
+    return result;
+}
+
+static int integer_cmp(const integer_view* a, const integer_view* b) {
+    if (a->negative != b->negative) {
+        return a->negative ? -1 : 1;
+    }
+
+    int magCmp = mag_cmp(a->limbs, a->size, b->limbs, b->size);
+    return a->negative ? -magCmp : magCmp;
+}
+
+static int is_integer(ptr x) {
+    return (x & FxMask) == FxTag || is_obj_of_type(x, BignumType);
+}
+
+static double number_to_double(ptr x) {
+    if (is_obj_of_type(x, FlonumType)) {
+        return flonum_value(x);
+    }
+
+    integer_view view;
+    view_integer(x, &view);
+    double d = 0;
+
+    for (size_t i = view.size; i-- > 0;) {
+        d = d * 4294967296.0 + view.limbs[i];
+    }
+
+    return view.negative ? -d : d;
+}
+
+static void check_numbers(ptr a, ptr b, const char* op) {
+    if (!(is_integer(a) || is_obj_of_type(a, FlonumType)) ||
+        !(is_integer(b) || is_obj_of_type(b, FlonumType))) {
+        out_flush();
+        write(STDERR_FILENO, "error: ", 7);
+        write(STDERR_FILENO, op, strlen(op));
+        fatal(" expects numbers\n");
+    }
+}
+
+ptr generic_add(ptr a, ptr b) {
+    check_numbers(a, b, "+");
+
+    if (!is_integer(a) || !is_integer(b)) {
+        return make_flonum(number_to_double(a) + number_to_double(b));
+    }
+
+    integer_view va, vb;
+    view_integer(a, &va);
+    view_integer(b, &vb);
+    return integer_add(&va, &vb, 0);
+}
+
+ptr generic_sub(ptr a, ptr b) {
+    check_numbers(a, b, "-");
+
+    if (!is_integer(a) || !is_integer(b)) {
+        return make_flonum(number_to_double(a) - number_to_double(b));
+    }
+
+    integer_view va, vb;
+    view_integer(a, &va);
+    view_integer(b, &vb);
+    return integer_add(&va, &vb, 1);
+}
+
+ptr generic_mul(ptr a, ptr b) {
+    check_numbers(a, b, "*");
+
+    if (!is_integer(a) || !is_integer(b)) {
+        return make_flonum(number_to_double(a) * number_to_double(b));
+    }
+
+    integer_view va, vb;
+    view_integer(a, &va);
+    view_integer(b, &vb);
+    return integer_mul(&va, &vb);
+}
+
+ptr generic_lt(ptr a, ptr b) {
+    check_numbers(a, b, "<");
+
+    if (!is_integer(a) || !is_integer(b)) {
+        return number_to_double(a) < number_to_double(b) ? BoolT : BoolF;
+    }
+
+    integer_view va, vb;
+    view_integer(a, &va);
+    view_integer(b, &vb);
+    return integer_cmp(&va, &vb) < 0 ? BoolT : BoolF;
+}
+
+static void print_bignum(ptr x) {
+    integer_view view;
+    view_integer(x, &view);
+
+    // Peel off base 10^9 chunks, least significant first.
+    size_t size = view.size;
+    uint32_t* mag = limbs_alloc(size);
+    uint32_t* chunks = limbs_alloc(size * 2 + 1);
+    size_t numChunks = 0;
+    memcpy(mag, view.limbs, size * sizeof(uint32_t));
+
+    while (size > 0) {
+        uint64_t rem = 0;
+
+        for (size_t i = size; i-- > 0;) {
+            uint64_t cur = (rem << 32) | mag[i];
+            mag[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+
+        chunks[numChunks++] = (uint32_t)rem;
+        size = mag_trim(mag, size);
+    }
+
+    if (view.negative) {
+        out_char('-');
+    }
+
+    out_long(numChunks == 0 ? 0 : chunks[numChunks - 1]);
+
+    for (size_t i = numChunks - 1; i-- > 0;) {
+        // Inner chunks are zero padded to 9 digits.
+        for (int d = decimal_digits(chunks[i]); d < 9; ++d) {
+            out_char('0');
+        }
+
+        out_long(chunks[i]);
+    }
+
+    free(mag);
+    free(chunks);
+}
+
+static void print_flonum(double d) {
+    char buf[32];
+
+    if (isnan(d)) {
+        out_str("+nan.0");
+        return;
+    }
+
+    if (isinf(d)) {
+        out_str(d < 0 ? "-inf.0" : "+inf.0");
+        return;
+    }
+
+    // Shortest representation that reads back as the same double.
+    for (int precision = 1; precision <= 17; ++precision) {
+        snprintf(buf, sizeof(buf), "%.*g", precision, d);
+
+        if (strtod(buf, NULL) == d) {
+            break;
+        }
+    }
+
+    out_str(buf);
+
+    if (strpbrk(buf, ".e") == NULL) {
+        out_str(".0");
+    }
+}
+
+//
+// Set of pairs/vectors on the path from the root to the object currently being
+// printed. Revisiting one of them means the structure is cyclic.
+//
+
+typedef struct {
+    ptr* slots;
+    size_t capacity;
+    size_t size;
+} ptr_set;
+
+static size_t ptr_set_hash(ptr x, size_t capacity) {
+    return ((x >> 3) * 0x9E3779B97F4A7C15UL) & (capacity - 1);
+}
+
+static void ptr_set_insert(ptr_set* set, ptr x);
+
+static void ptr_set_grow(ptr_set* set) {
+    ptr* oldSlots = set->slots;
+    size_t oldCapacity = set->capacity;
+
+    set->capacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+    set->slots = calloc(set->capacity, sizeof(ptr));
+    set->size = 0;
+
+    if (set->slots == NULL) {
+        exit(1);
+    }
+
+    for (size_t i = 0; i < oldCapacity; ++i) {
+        if (oldSlots[i] != 0) {
+            ptr_set_insert(set, oldSlots[i]);
+        }
+    }
+
+    free(oldSlots);
+}
+
+static int ptr_set_contains(const ptr_set* set, ptr x) {
+    if (set->capacity == 0) {
+        return 0;
+    }
+
+    for (size_t i = ptr_set_hash(x, set->capacity); set->slots[i] != 0;
+         i = (i + 1) & (set->capacity - 1)) {
+        if (set->slots[i] == x) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void ptr_set_insert(ptr_set* set, ptr x) {
+    if ((set->size + 1) * 2 > set->capacity) {
+        ptr_set_grow(set);
+    }
+
+    size_t i = ptr_set_hash(x, set->capacity);
+
+    for (; set->slots[i] != 0; i = (i + 1) & (set->capacity - 1)) {
+        if (set->slots[i] == x) {
+            return;
+        }
+    }
+
+    set->slots[i] = x;
+    ++set->size;
+}
+
+// Linear probing removal with backward shift, so no tombstones are needed.
+static void ptr_set_remove(ptr_set* set, ptr x) {
+    size_t mask = set->capacity - 1;
+    size_t i = ptr_set_hash(x, set->capacity);
+
+    for (; set->slots[i] != x; i = (i + 1) & mask) {
+        assert(set->slots[i] != 0);
+    }
+
+    for (size_t j = (i + 1) & mask; set->slots[j] != 0; j = (j + 1) & mask) {
+        size_t home = ptr_set_hash(set->slots[j], set->capacity);
+
+        // Move slots[j] into the hole at i unless its home lies in (i, j].
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+
+    set->slots[i] = 0;
+    --set->size;
+}
+
+//
+// Iterative printer. Compound objects push continuation frames on an explicit
+// work stack instead of recursing, so printing a long list needs no C stack.
+//
+
+typedef enum {
+    // Print an arbitrary object.
+    PRINT_OBJ,
+    // Continue a list whose next pair (or final cdr) is x.
+    PRINT_LIST_REST,
+    // Print the remaining elements of vector x, starting at index.
+    PRINT_VECTOR_REST,
+    // All elements of a compound object are printed: close it and take it
+    // off the current path.
+    PRINT_CLOSE
+} print_op;
+
+typedef struct {
+    print_op op;
+    ptr x;
+    ptr index;
+} print_frame;
+
+typedef struct {
+    print_frame* frames;
+    size_t capacity;
+    size_t size;
+} print_stack;
+
+static void print_stack_push(print_stack* stack, print_op op, ptr x,
+                             ptr index) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+        stack->frames =
+            realloc(stack->frames, stack->capacity * sizeof(print_frame));
+
+        if (stack->frames == NULL) {
+            exit(1);
+        }
+    }
+
+    print_frame frame = {op, x, index};
+    stack->frames[stack->size++] = frame;
+}
+
+// Enters compound object x. Returns 0 (after printing a marker) if x is
+// already on the current path.
+static int print_enter(ptr_set* path, ptr x) {
+    if (ptr_set_contains(path, x)) {
+        out_str("#<cycle>");
+        return 0;
+    }
+
+    ptr_set_insert(path, x);
+    return 1;
+}
+
+static void print_ptr(ptr root) {
+    print_stack stack = {NULL, 0, 0};
+    ptr_set path = {NULL, 0, 0};
+    // Pairs of the list currently being printed are kept on the path until
+    // the whole list is done, remembered here so they can be removed again.
+    print_stack listPairs = {NULL, 0, 0};
+
+    print_stack_push(&stack, PRINT_OBJ, root, 0);
+
+    while (stack.size > 0) {
+        print_frame frame = stack.frames[--stack.size];
+        ptr x = frame.x;
+
+        if (frame.op == PRINT_CLOSE) {
+            if ((x & PairMask) == PairTag) {
+                out_char(')');
+
+                // frame.index holds the number of pairs entered for the list.
+                for (ptr i = 0; i < frame.index; ++i) {
+                    ptr_set_remove(&path,
+                                   listPairs.frames[--listPairs.size].x);
+                }
+            } else {
+                out_char(')');
+                ptr_set_remove(&path, x);
+            }
+
+            continue;
+        }
+
+        if (frame.op == PRINT_LIST_REST) {
+            // The pair that owns this tail is the topmost PRINT_CLOSE frame.
+            print_frame* close = &stack.frames[stack.size - 1];
+            assert(close->op == PRINT_CLOSE);
+
+            if (x == Null) {
+                continue;
+            }
+
+            if ((x & PairMask) != PairTag) {
+                out_str(" . ");
+                print_stack_push(&stack, PRINT_OBJ, x, 0);
+                continue;
+            }
+
+            out_char(' ');
+
+            if (!print_enter(&path, x)) {
+                continue;
+            }
+
+            print_stack_push(&listPairs, PRINT_OBJ, x, 0);
+            ++close->index;
+            print_stack_push(&stack, PRINT_LIST_REST,
+                             ((ptr*)(x - PairTag))[1], 0);
+            print_stack_push(&stack, PRINT_OBJ, ((ptr*)(x - PairTag))[0], 0);
+            continue;
+        }
+
+        if (frame.op == PRINT_VECTOR_REST) {
+            ptr length = ((ptr*)(x - VectorTag))[0] >> FxShift;
+
+            if (frame.index < length) {
+                if (frame.index > 0) {
+                    out_char(' ');
+                }
+
+                print_stack_push(&stack, PRINT_VECTOR_REST, x,
+                                 frame.index + 1);
+                print_stack_push(&stack, PRINT_OBJ,
+                                 ((ptr*)(x - VectorTag))[frame.index + 1], 0);
+            }
+
+            continue;
+        }
+
+        if ((x & FxMask) == FxTag) {
+            out_long(((long)x) >> FxShift);
+        } else if (x == BoolF) {
+            out_str("#f");
+        } else if (x == BoolT) {
+            out_str("#t");
+        } else if (x == Null) {
+            out_str("()");
+        } else if ((x & CharMask) == CharTag) {
+            print_char((char)(((int)x) >> CharShift));
+        } else if ((x & PairMask) == PairTag) {
+            if (!print_enter(&path, x)) {
+                continue;
+            }
+
+            out_char('(');
+            print_stack_push(&listPairs, PRINT_OBJ, x, 0);
+            print_stack_push(&stack, PRINT_CLOSE, x, 1);
+            print_stack_push(&stack, PRINT_LIST_REST, ((ptr*)(x - PairTag))[1],
+                             0);
+            print_stack_push(&stack, PRINT_OBJ, ((ptr*)(x - PairTag))[0], 0);
+        } else if ((x & VectorMask) == VectorTag) {
+            if (!print_enter(&path, x)) {
+                continue;
+            }
+
+            out_str("#(");
+            print_stack_push(&stack, PRINT_CLOSE, x, 0);
+            print_stack_push(&stack, PRINT_VECTOR_REST, x, 0);
+        } else if ((x & StringMask) == StringTag) {
+            ptr length = ((ptr*)(x - StringTag))[0] >> FxShift;
+            out_str("\\\"");
+
+            for (ptr i = 0; i < length; ++i) {
+                assert((((ptr*)(x - StringTag))[i + 1] & CharMask) == CharTag);
+                char c = (char)(((ptr*)(x - StringTag))[i + 1] >> CharShift);
+                print_char_within_str(c);
+            }
+
+            out_str("\\\"");
+        } else if (is_obj_of_type(x, FlonumType)) {
+            print_flonum(flonum_value(x));
+        } else if (is_obj_of_type(x, BignumType)) {
+            print_bignum(x);
+        } else if (is_obj_of_type(x, HashtableType)) {
+            out_str("#<hashtable>");
+        } else if (is_obj_of_type(x, SymbolType)) {
+            ptr* name = (ptr*)(((ptr*)(x - ObjTag))[1] - StringTag);
+            ptr length = name[0] >> FxShift;
+
+            for (ptr i = 0; i < length; ++i) {
+                out_char((char)(name[i + 1] >> CharShift));
+            }
+        } else {
+            out_str("#<unknown ");
+            print_hex(x);
+            out_char('>');
+        }
+    }
+
+    free(stack.frames);
+    free(listPairs.frames);
+    free(path.slots);
+}
+
+//
+// Safe mode. A failed check in compiled code ends up in check_failed, which
+// reports the check, numbered as EValueType, IndexCheck and LengthCheck in
+// defs.h, and the value that failed it.
+//
+
+// IndexCheck, ContinuationCheck and LengthCheck have messages of their own.
+// The runtime checks the tables the hashtable primitives are passed, and the
+// operands of string->symbol and symbol->string, itself, in and out of safe
+// mode.
+static const char* gCheckedTypeNames[] = {
+    "",         "a fixnum",    "a char", "a pair",      "a vector",
+    "a string", "a procedure", "",       "a hashtable", "a symbol"};
+static const long FixNumCheck = 1;
+static const long StringCheck = 5;
+static const long IndexCheck = 7;
+static const long HashtableCheck = 8;
+static const long SymbolCheck = 9;
+static const long ContinuationCheck = 10;
+static const long LengthCheck = 11;
+
+void check_failed(long check, ptr value) {
+    out_flush();
+    out_str("error: ");
+
+    if (check == IndexCheck) {
+        out_str("index ");
+        print_ptr(value);
+        out_str(" is out of range\n");
+    } else if (check == ContinuationCheck) {
+        out_str("continuation called after its call/cc returned\n");
+    } else if (check == LengthCheck) {
+        out_str("length ");
+        print_ptr(value);
+        out_str(" is negative\n");
+    } else {
+        print_ptr(value);
+        out_str(" is not ");
+        out_str(gCheckedTypeNames[check]);
+        out_char('\n');
+    }
+
+    out_flush_to(STDERR_FILENO);
+    exit(1);
+}
+
+// Compiled code jumps here with the check in %rdi and the value in %rax. The
+// program ends, so check_failed runs on the C stack scheme_entry was called on,
+// whatever the Scheme stack holds.
+__asm__("    .text\n"
+        "    .globl sil_check_failed\n"
+        "sil_check_failed:\n"
+        "    movq %rax, %rsi\n"
+        "    movq 56(%rcx), %rsp\n"
+        "    andq $-16, %rsp\n"
+        "    call check_failed\n");
+
+// Compiled code calls an escape continuation (see EmitCallCC in emit.cpp) like
+// any closure: with the continuation in %rdi and its argument's box at
+// -8(%rsp). It returns the argument from call/cc, in %rax, at the address the
+// continuation holds, with the stack segment, stack pointer and closure
+// call/cc had. Nothing on the stack in between needs unwinding, so escaping
+// is O(1).
+__asm__("    .text\n"
+        "    .globl sil_escape\n"
+        "sil_escape:\n"
+        "    movq 6(%rdi), %r8\n"
+        "    testq %r8, %r8\n"
+        "    jz 1f\n"
+        "    movq -8(%rsp), %rax\n"
+        "    movq (%rax), %rax\n"
+        "    movq 30(%rdi), %r9\n"
+        "    movq %r9, gStackSegment(%rip)\n"
+        "    movq (%r9), %r9\n"
+        "    movq %r9, gStackLimit(%rip)\n"
+        "    movq 14(%rdi), %rsp\n"
+        "    movq 22(%rdi), %rdi\n"
+        "    jmp *%r8\n"
+        "1:\n"
+        "    movq %rdi, %rax\n"
+        "    movq $10, %rdi\n"
+        "    jmp sil_check_failed\n");
+
+//
+// Eq hashtables. A table is a heap object pointing to an array of key/value
+// slots, probed linearly so that a lookup usually stays within a cache line.
+// Growing doesn't move all the entries at once: the old array is kept, and
+// every operation moves a few of its slots to the new one, lookups trying
+// both until it is empty. Only the new array is ever inserted into.
+//
+
+typedef struct {
+    ptr key;
+    ptr value;
+} eq_slot;
+
+typedef struct {
+    ptr header;
+    eq_slot* slots;
+    size_t capacity;
+    // Entries in both arrays.
+    size_t size;
+    // The array being moved to slots, NULL when there is none. Entries
+    // removed from it leave a DeletedKey behind, so that probing it still
+    // finds the entries past them.
+    eq_slot* oldSlots;
+    size_t oldCapacity;
+    // The old slots before it have been moved.
+    size_t rehashIdx;
+} eq_hashtable;
+
+// Tag 7 isn't the tag of any Scheme value.
+static const ptr EmptyKey = 0x07;
+static const ptr DeletedKey = 0x17;
+static const size_t HashtableMinCapacity = 8;
+// Old slots moved per operation. An array grows to twice its capacity when
+// half full, so without deletions it takes at least a quarter of the new
+// capacity in inserts for it to grow again, and 2 slots per operation would
+// empty the old array by then. Moving 8, two cache lines' worth, empties it
+// four times sooner, so that fewer operations pay for probing both arrays.
+static const size_t RehashStep = 8;
+
+static size_t eq_hash(ptr key, size_t capacity) {
+    // Fibonacci hashing: the top bits of the product depend on all of the
+    // key's.
+    return (key * 0x9E3779B97F4A7C15UL) >> (64 - __builtin_ctzl(capacity));
+}
+
+static eq_slot* eq_slots_alloc(size_t capacity) {
+    // Slots don't straddle cache lines.
+    eq_slot* slots = aligned_alloc(64, capacity * sizeof(eq_slot));
+
+    if (slots == NULL) {
+        fatal("error: out of memory\n");
+    }
+
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].key = EmptyKey;
+    }
+
+    return slots;
+}
+
+static eq_slot* eq_find(eq_slot* slots, size_t capacity, ptr key) {
+    if (slots == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = eq_hash(key, capacity); slots[i].key != EmptyKey;
+         i = (i + 1) & (capacity - 1)) {
+        if (slots[i].key == key) {
+            return &slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+// key isn't in slots.
+static void eq_insert(eq_slot* slots, size_t capacity, ptr key, ptr value) {
+    size_t i = eq_hash(key, capacity);
+
+    for (; slots[i].key != EmptyKey; i = (i + 1) & (capacity - 1)) {
+    }
+
+    slots[i].key = key;
+    slots[i].value = value;
+}
+
+// Backward shift removal, as in ptr_set_remove, so that the new array needs
+// no tombstones.
+static void eq_remove(eq_slot* slots, size_t capacity, eq_slot* slot) {
+    size_t mask = capacity - 1;
+    size_t i = slot - slots;
+
+    for (size_t j = (i + 1) & mask; slots[j].key != EmptyKey;
+         j = (j + 1) & mask) {
+        size_t home = eq_hash(slots[j].key, capacity);
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i].key = EmptyKey;
+}
+
+static void eq_rehash_step(eq_hashtable* table, size_t numSlots) {
+    if (table->oldSlots == NULL) {
+        return;
+    }
+
+    size_t end = table->rehashIdx + numSlots < table->oldCapacity
+                     ? table->rehashIdx + numSlots
+                     : table->oldCapacity;
+
+    for (; table->rehashIdx < end; ++table->rehashIdx) {
+        eq_slot* slot = &table->oldSlots[table->rehashIdx];
+
+        if (slot->key != EmptyKey && slot->key != DeletedKey) {
+            eq_insert(table->slots, table->capacity, slot->key, slot->value);
+            slot->key = DeletedKey;
+        }
+    }
+
+    if (table->rehashIdx == table->oldCapacity) {
+        free(table->oldSlots);
+        table->oldSlots = NULL;
+    }
+}
+
+static void eq_grow(eq_hashtable* table) {
+    // Only has anything left to move after deletions.
+    eq_rehash_step(table, table->oldCapacity);
+
+    table->oldSlots = table->slots;
+    table->oldCapacity = table->capacity;
+    table->rehashIdx = 0;
+    table->capacity *= 2;
+    table->slots = eq_slots_alloc(table->capacity);
+}
+
+static eq_hashtable* to_hashtable(ptr x) {
+    if (!is_obj_of_type(x, HashtableType)) {
+        check_failed(HashtableCheck, x);
+    }
+
+    eq_hashtable* table = (eq_hashtable*)(x - ObjTag);
+    eq_rehash_step(table, RehashStep);
+
+    return table;
+}
+
+ptr make_eq_hashtable(ptr sizeHint) {
+    if ((sizeHint & FxMask) != FxTag) {
+        check_failed(FixNumCheck, sizeHint);
+    }
+
+    long hint = ((long)sizeHint) >> FxShift;
+    size_t capacity = HashtableMinCapacity;
+
+    // At most half full. Hints too large to allocate end in out of memory.
+    while (hint > 0 && capacity / 2 < (size_t)hint && capacity < (1UL << 40)) {
+        capacity *= 2;
+    }
+
+    eq_hashtable* table =
+        heap_alloc_at(&gHashtableAllocSite, sizeof(eq_hashtable));
+    table->header = HashtableType;
+    table->slots = eq_slots_alloc(capacity);
+    table->capacity = capacity;
+    table->size = 0;
+    table->oldSlots = NULL;
+    table->oldCapacity = 0;
+    table->rehashIdx = 0;
+
+    return (ptr)table | ObjTag;
+}
+
+ptr hashtable_ref(ptr tableObj, ptr key, ptr defaultValue) {
+    eq_hashtable* table = to_hashtable(tableObj);
+    eq_slot* slot = eq_find(table->slots, table->capacity, key);
+
+    if (slot == NULL) {
+        slot = eq_find(table->oldSlots, table->oldCapacity, key);
+    }
+
+    return slot == NULL ? defaultValue : slot->value;
+}
+
+ptr hashtable_set(ptr tableObj, ptr key, ptr value) {
+    eq_hashtable* table = to_hashtable(tableObj);
+    eq_slot* slot = eq_find(table->slots, table->capacity, key);
+
+    if (slot != NULL) {
+        slot->value = value;
+        return value;
+    }
+
+    slot = eq_find(table->oldSlots, table->oldCapacity, key);
+
+    if (slot != NULL) {
+        slot->key = DeletedKey;
+        --table->size;
+    }
+
+    if ((table->size + 1) * 2 > table->capacity) {
+        eq_grow(table);
+    }
+
+    eq_insert(table->slots, table->capacity, key, value);
+    ++table->size;
+
+    return value;
+}
+
+ptr hashtable_delete(ptr tableObj, ptr key) {
+    eq_hashtable* table = to_hashtable(tableObj);
+    eq_slot* slot = eq_find(table->slots, table->capacity, key);
+
+    if (slot != NULL) {
+        eq_remove(table->slots, table->capacity, slot);
+        --table->size;
+    } else if ((slot = eq_find(table->oldSlots, table->oldCapacity, key)) !=
+               NULL) {
+        slot->key = DeletedKey;
+        --table->size;
+    }
+
+    return tableObj;
+}
+
+//
+// Symbols. The compiler lays out the symbols a program quotes, one per name,
+// and lists them in the sil_symbols section. string->symbol looks names up in
+// an intern table that starts out with those, so that it returns the same
+// symbol for a name whether it was quoted or made at run time, and symbols
+// can be compared with eq?.
+//
+
+typedef struct {
+    ptr header;
+    // A string, not to be changed.
+    ptr name;
+} symbol;
+
+extern ptr __start_sil_symbols[] __attribute__((weak));
+extern ptr __stop_sil_symbols[] __attribute__((weak));
+
+// Open addressing, probed linearly; empty slots are 0. Never shrinks, since
+// symbols live as long as the program.
+static ptr* gSymbolTable = NULL;
+static size_t gSymbolTableCapacity = 0;
+static size_t gSymbolTableSize = 0;
+
+static ptr string_length(ptr str) {
+    return ((ptr*)(str - StringTag))[0] >> FxShift;
+}
+
+static ptr* string_chars(ptr str) { return &((ptr*)(str - StringTag))[1]; }
+
+static ptr symbol_name(ptr sym) { return ((symbol*)(sym - ObjTag))->name; }
+
+static size_t string_hash(ptr str) {
+    // FNV-1a over the chars.
+    size_t hash = 0xCBF29CE484222325UL;
+    ptr length = string_length(str);
+    ptr* chars = string_chars(str);
+
+    for (ptr i = 0; i < length; ++i) {
+        hash = (hash ^ (chars[i] >> CharShift)) * 0x100000001B3UL;
+    }
+
+    return hash;
+}
+
+static int string_equal(ptr a, ptr b) {
+    ptr length = string_length(a);
+
+    return length == string_length(b) &&
+           memcmp(string_chars(a), string_chars(b), length * WordSize) == 0;
+}
+
+// The slot of the symbol named name, or the empty slot it would go in.
+static ptr* intern_slot(ptr name, size_t hash) {
+    size_t mask = gSymbolTableCapacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        ptr sym = gSymbolTable[i];
+
+        if (sym == 0 || string_equal(symbol_name(sym), name)) {
+            return &gSymbolTable[i];
+        }
+    }
+}
+
+static void intern_grow() {
+    ptr* oldTable = gSymbolTable;
+    size_t oldCapacity = gSymbolTableCapacity;
+
+    gSymbolTableCapacity = oldCapacity == 0 ? 64 : 2 * oldCapacity;
+    gSymbolTable = calloc(gSymbolTableCapacity, sizeof(ptr));
+
+    if (gSymbolTable == NULL) {
+        fatal("error: out of memory\n");
+    }
+
+    for (size_t i = 0; i < oldCapacity; ++i) {
+        if (oldTable[i] != 0) {
+            ptr name = symbol_name(oldTable[i]);
+            *intern_slot(name, string_hash(name)) = oldTable[i];
+        }
+    }
+
+    free(oldTable);
+}
+
+static void intern(ptr sym) {
+    // At most half full.
+    if ((gSymbolTableSize + 1) * 2 > gSymbolTableCapacity) {
+        intern_grow();
+    }
+
+    ptr name = symbol_name(sym);
+    ptr* slot = intern_slot(name, string_hash(name));
+
+    if (*slot == 0) {
+        *slot = sym;
+        ++gSymbolTableSize;
+    }
+}
+
+static void intern_static_symbols() {
+    intern_grow();
+
+    for (ptr* sym = __start_sil_symbols; sym < __stop_sil_symbols; ++sym) {
+        intern(*sym);
+    }
+}
+
+ptr string_to_symbol(ptr str) {
+    if ((str & StringMask) != StringTag) {
+        check_failed(StringCheck, str);
+    }
+
+    if (gSymbolTable == NULL) {
+        intern_static_symbols();
+    }
+
+    ptr* slot = intern_slot(str, string_hash(str));
+
+    if (*slot != 0) {
+        return *slot;
+    }
+
+    // The symbol has a copy of the string, which may change.
+    ptr length = string_length(str);
+    symbol* sym = heap_alloc_at(&gSymbolAllocSite,
+                                sizeof(symbol) + (length + 1) * WordSize);
+    ptr* name = (ptr*)(sym + 1);
+    name[0] = length << FxShift;
+    memcpy(&name[1], string_chars(str), length * WordSize);
+    sym->header = SymbolType;
+    sym->name = (ptr)name | StringTag;
+
+    intern((ptr)sym | ObjTag);
+
+    return (ptr)sym | ObjTag;
+}
+
+// The names of the symbols the program quotes are read-only, like literals,
+// and returned as they are. Those of the symbols string->symbol made are
+// copied, so that changing the string doesn't rename the symbol.
+ptr symbol_to_string(ptr sym) {
+    if (!is_obj_of_type(sym, SymbolType)) {
+        check_failed(SymbolCheck, sym);
+    }
+
+    ptr name = symbol_name(sym);
+
+    if ((char*)sym < gHeap || (char*)sym >= gHeapEnd) {
+        return name;
+    }
+
+    ptr length = string_length(name);
+    ptr* copy =
+        heap_alloc_at(&gSymbolNameAllocSite, (length + 1) * WordSize);
+    copy[0] = length << FxShift;
+    memcpy(&copy[1], string_chars(name), length * WordSize);
+
+    return (ptr)copy | StringTag;
+}
+
+static char* allocate_protected_space(long size) {
+    long page = getpagesize();
+    int status;
+    long aligned_size = ((size + page - 1) / page) * page;
+    char* p = mmap(0, aligned_size + 2 * page, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, 0, 0);
+
+    if (p == MAP_FAILED) {
+        exit(1);
+    }
+
+    status = mprotect(p, page, PROT_NONE);
+
+    if (status != 0) {
+        exit(1);
+    }
+
+    status = mprotect(p + page + aligned_size, page, PROT_NONE);
+
+    if (status != 0) {
+        exit(1);
+    }
+
+    return (p + page);
+}
+
+static void deallocate_protected_space(char* p, long size) {
+    long page = getpagesize();
+    int status;
+    long aligned_size = ((size + page - 1) / page) * page;
+    status = munmap(p - page, aligned_size + 2 * page);
+
+    if (status != 0) {
+        exit(1);
+    }
+}
+
+//
+// Segmented stack. Each procedure's code starts by checking that its frame
+// fits above the limit of the stack segment, and jumps to sil_stack_overflow
+// when it doesn't, which moves the procedure to the next segment. Deep
+// recursion so only uses as much stack as it needs.
+//
+
+// Below the limit is room for the runtime functions compiled code calls.
+#define STACK_RED_ZONE (16 * 1024)
+// Segments double in size up to this.
+#define MAX_STACK_SEGMENT_SIZE (16 * 1024 * 1024)
+
+static stack_segment* make_stack_segment(long size, stack_segment* prev) {
+    long page = getpagesize();
+    size = ((size + page - 1) / page) * page;
+    stack_segment* segment = malloc(sizeof(stack_segment));
+
+    if (segment == NULL) {
+        exit(1);
+    }
+
+    segment->top = allocate_protected_space(size);
+    segment->base = segment->top + size;
+    segment->limit = segment->top + STACK_RED_ZONE;
+    segment->prev = prev;
+    segment->next = NULL;
+
+    return segment;
+}
+
+// Called by sil_stack_overflow with the %rsp of a procedure whose frame,
+// frameSize bytes with numArgs words of arguments below the return address,
+// doesn't fit in the current segment. Copies the arguments to the top of the
+// next segment, made if needed and kept once returned from, and returns the
+// %rsp to run the procedure with there. The procedure returns through
+// sil_stack_underflow, which finds the %rsp to go back to above its return
+// address.
+char** link_stack_segment(char** sp, long numArgs, long frameSize) {
+    stack_segment* current = gStackSegment;
+    long needed = frameSize + (numArgs + 2) * WordSize + STACK_RED_ZONE;
+    stack_segment* next = current->next;
+
+    if (next == NULL || next->base - next->top < needed) {
+        long size = (current->base - current->top) * 2;
+
+        if (size > MAX_STACK_SEGMENT_SIZE) {
+            size = MAX_STACK_SEGMENT_SIZE;
+        }
+
+        next = make_stack_segment(size > needed ? size : needed, current);
+        next->next = current->next;
+
+        if (current->next != NULL) {
+            current->next->prev = next;
+        }
+
+        current->next = next;
+    }
+
+    char** nextSp = (char**)next->base - 2;
+    nextSp[0] = sil_stack_underflow;
+    nextSp[1] = (char*)sp;
+
+    for (long i = 1; i <= numArgs; ++i) {
+        nextSp[-i] = sp[-i];
+    }
+
+    gStackSegment = next;
+    gStackLimit = next->limit;
+
+    return nextSp;
+}
+
+// Compiled code jumps here at the start of a procedure whose frame doesn't
+// fit above gStackLimit, with the address to go on at in %r8, the number of
+// words of arguments in %r11 and the frame size in %r9. Calls
+// link_stack_segment below the arguments and goes on with the procedure in
+// the next segment, keeping %rcx and %rdi; %rbp and %rbx are kept by C.
+__asm__("    .text\n"
+        "    .globl sil_stack_overflow\n"
+        "sil_stack_overflow:\n"
+        "    movq %rsp, %rax\n"
+        "    movq %r11, %rsi\n"
+        "    movq %r9, %rdx\n"
+        "    shlq $3, %r11\n"
+        "    subq %r11, %rsp\n"
+        "    andq $-16, %rsp\n"
+        "    pushq %rcx\n"
+        "    pushq %rdi\n"
+        "    pushq %r8\n"
+        "    subq $8, %rsp\n"
+        "    movq %rax, %rdi\n"
+        "    call link_stack_segment\n"
+        "    addq $8, %rsp\n"
+        "    popq %r8\n"
+        "    popq %rdi\n"
+        "    popq %rcx\n"
+        "    movq %rax, %rsp\n"
+        "    jmp *%r8\n"
+        // A procedure moved to a new segment returns here, with %rsp right
+        // below the %rsp it overflowed with, which is where its return
+        // address still is.
+        "    .globl sil_stack_underflow\n"
+        "sil_stack_underflow:\n"
+        "    movq gStackSegment(%rip), %r8\n"
+        "    movq 24(%r8), %r8\n"
+        "    movq %r8, gStackSegment(%rip)\n"
+        "    movq (%r8), %r8\n"
+        "    movq %r8, gStackLimit(%rip)\n"
+        "    movq (%rsp), %rsp\n"
+        "    ret\n");
+
+typedef struct {
+    void* rax;
+    void* rbx;
+    void* rcx;
+    void* rdx;
+    void* rsi;
+    void* rdi;
+    void* rbp;
+    void* rsp;
+} context;
+
+long scheme_entry(context*, char*, char*);
+
+// Reads a size in bytes, with an optional K, M or G suffix, from the
+// environment. There is no garbage collector, so longer running programs
+// need a bigger heap than the default.
+static long size_from_env(const char* name, long defaultSize) {
+    const char* value = getenv(name);
+
+    if (value == NULL) {
+        return defaultSize;
+    }
+
+    char* suffix;
+    long size = strtol(value, &suffix, 10);
+
+    if (*suffix == 'K' || *suffix == 'k') {
+        size <<= 10;
+    } else if (*suffix == 'M' || *suffix == 'm') {
+        size <<= 20;
+    } else if (*suffix == 'G' || *suffix == 'g') {
+        size <<= 30;
+    }
+
+    return size > 0 ? size : defaultSize;
+}
+
+int main(int argc, char** argv) {
+    long stack_size = size_from_env("SIL_STACK_SIZE", 16 * 4096);
+    long heap_size = size_from_env("SIL_HEAP_SIZE", 16 * 4096);
+    long first_segment_size =
+        stack_size > 2 * STACK_RED_ZONE ? stack_size : 2 * STACK_RED_ZONE;
+    gStackSegment = make_stack_segment(first_segment_size, NULL);
+    gStackLimit = gStackSegment->limit;
+    stack_segment* firstStackSegment = gStackSegment;
+    gHeap = allocate_protected_space(heap_size);
+    gHeapEnd = gHeap + ((heap_size + getpagesize() - 1) / getpagesize()) *
+                           getpagesize();
+
+    install_fatal_signal_handlers();
+    int profiling = is_profiling_enabled();
+
+    if (profiling) {
+        start_profiling();
+    }
+
+    context ctxt;
+    print_ptr(scheme_entry(&ctxt, gStackSegment->base, gHeap));
+    out_char('\n');
+    out_flush();
+
+    if (profiling) {
+        stop_profiling();
+    }
+
+    if (is_alloc_profiling_enabled()) {
+        dump_alloc_profile();
+    }
+
+    for (stack_segment* s = firstStackSegment; s != NULL;) {
+        stack_segment* next = s->next;
+        deallocate_protected_space(s->top, s->base - s->top);
+        free(s);
+        s = next;
+    }
 
     return 0;
 }
@@ -0,0 +1,263 @@
+// Separate compilation driver. Compiles one source file at a time, so that a
+// build tool can compile the files of a program in parallel and recompile
+// only the ones that changed, then links the objects with the runtime.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread silc.cpp emit.cpp parse.cpp stats.cpp
+//       cache.cpp module.cpp threads.cpp peephole.cpp -o silc
+//
+// Usage:
+//   ./silc -c [-I DIR]... [--cache-dir DIR] [-j N] [--safe] [-o FILE.o]
+//          FILE.scm
+//   ./silc -S [-I DIR]... [--cache-dir DIR] [-j N] [--safe] [-o FILE.s]
+//          FILE.scm
+//   ./silc [--runtime PATH] [-o PROGRAM] FILE.o...
+//
+// A source file holds either a module (see EmitModule) or a plain program.
+// Compiling a module also writes its interface, NAME.sili, next to the
+// output; the interfaces of the modules it imports are looked up in the -I
+// directories, the source file's directory and the current directory. -j
+// emits the file's procedures on N threads. --safe compiles it in safe mode
+// (see EnableSafeMode).
+
+#include "cache.h"
+#include "emit.h"
+#include "module.h"
+#include "parse.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+bool ReadFile(const string &path, string *outText) {
+    ifstream file(path);
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    ostringstream textOS;
+    textOS << file.rdbuf();
+    *outText = textOS.str();
+
+    return true;
+}
+
+string DirName(const string &path) {
+    auto slash = path.find_last_of('/');
+    return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+string ReplaceExtension(const string &path, const string &extension) {
+    auto slash = path.find_last_of('/');
+    auto dot = path.find_last_of('.');
+
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return path + extension;
+    }
+
+    return path.substr(0, dot) + extension;
+}
+
+bool ReadModuleInterface(const string &moduleName,
+                         const vector<string> &searchDirs,
+                         TModuleInterface *outModuleInterface) {
+    for (const auto &dir : searchDirs) {
+        string text;
+
+        if (ReadFile(dir + "/" + moduleName + ".sili", &text)) {
+            return TryParseModuleInterface(text, outModuleInterface) &&
+                   outModuleInterface->moduleName == moduleName;
+        }
+    }
+
+    return false;
+}
+
+// Leaves an up to date interface alone, so that build tools which compare
+// timestamps don't recompile the modules importing it.
+bool WriteModuleInterface(const string &path, const string &text) {
+    string oldText;
+
+    if (ReadFile(path, &oldText) && oldText == text) {
+        return true;
+    }
+
+    ofstream file(path);
+    file << text;
+
+    return file.good();
+}
+
+// The runtime that comes with the compiler, next to its executable.
+string DefaultRuntimePath() {
+    char exePath[4096];
+    auto size = readlink("/proc/self/exe", exePath, sizeof(exePath) - 1);
+
+    if (size <= 0) {
+        return "runtime.c";
+    }
+
+    return DirName(string(exePath, size)) + "/runtime.c";
+}
+
+int Compile(const string &sourcePath, string outputPath, bool assemble,
+            vector<string> searchDirs) {
+    string text;
+
+    if (!ReadFile(sourcePath, &text)) {
+        cerr << "Cannot open " << sourcePath << ".\n";
+        return 1;
+    }
+
+    auto source = NormalizeSource(text);
+
+    if (outputPath.empty()) {
+        outputPath = ReplaceExtension(sourcePath, assemble ? ".o" : ".s");
+    }
+
+    string code;
+    string moduleName;
+    vector<string> importNames;
+
+    if (TryParseModule(source, &moduleName, &importNames)) {
+        searchDirs.push_back(DirName(sourcePath));
+        searchDirs.push_back(".");
+        vector<TModuleInterface> imports;
+
+        for (const auto &importName : importNames) {
+            TModuleInterface moduleInterface;
+
+            if (!ReadModuleInterface(importName, searchDirs,
+                                     &moduleInterface)) {
+                cerr << sourcePath << ": cannot find the interface of module "
+                     << importName << ".\n";
+                return 1;
+            }
+
+            imports.push_back(moduleInterface);
+        }
+
+        TModuleInterface moduleInterface;
+        code = EmitModule(source, imports, &moduleInterface, sourcePath,
+                          text);
+        auto interfacePath = DirName(outputPath) + "/" + moduleName + ".sili";
+
+        if (!WriteModuleInterface(interfacePath,
+                                  FormatModuleInterface(moduleInterface))) {
+            cerr << "Cannot write " << interfacePath << ".\n";
+            return 1;
+        }
+    } else {
+        code = EmitProgram(source, sourcePath, text);
+    }
+
+    auto asmPath = assemble ? outputPath + ".s" : outputPath;
+
+    {
+        ofstream asmFile(asmPath);
+        asmFile << code;
+
+        if (!asmFile.good()) {
+            cerr << "Cannot write " << asmPath << ".\n";
+            return 1;
+        }
+    }
+
+    if (assemble) {
+        auto assembleCmd = "gcc -c " + asmPath + " -o " + outputPath;
+        auto status = system(assembleCmd.c_str());
+        unlink(asmPath.c_str());
+
+        if (status != 0) {
+            cerr << "Couldn't assemble " << sourcePath << ".\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int Link(const vector<string> &objectPaths, string outputPath,
+         string runtimePath) {
+    auto linkCmd = "gcc -O2 " + runtimePath;
+
+    for (const auto &path : objectPaths) {
+        linkCmd += " " + path;
+    }
+
+    linkCmd += " -o " + (outputPath.empty() ? string("a.out") : outputPath);
+
+    if (system(linkCmd.c_str()) != 0) {
+        cerr << "Couldn't link the program.\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bool compileOnly = false;
+    bool assemble = false;
+    string outputPath;
+    string runtimePath = DefaultRuntimePath();
+    vector<string> searchDirs;
+    vector<string> inputPaths;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-c") {
+            compileOnly = true;
+            assemble = true;
+        } else if (arg == "-S") {
+            compileOnly = true;
+            assemble = false;
+        } else if (arg == "-o" && hasValue) {
+            outputPath = argv[++i];
+        } else if (arg == "-I" && hasValue) {
+            searchDirs.push_back(argv[++i]);
+        } else if (arg == "--cache-dir" && hasValue) {
+            EnableCompileCache(argv[++i]);
+        } else if (arg == "-j" && hasValue) {
+            SetCodegenThreads(atoi(argv[++i]));
+        } else if (arg == "--safe") {
+            EnableSafeMode(true);
+        } else if (arg == "--runtime" && hasValue) {
+            runtimePath = argv[++i];
+        } else if (arg.size() > 0 && arg[0] == '-') {
+            cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        } else {
+            inputPaths.push_back(arg);
+        }
+    }
+
+    if (inputPaths.empty()) {
+        cerr << "No input files.\n";
+        return 1;
+    }
+
+    if (!compileOnly) {
+        return Link(inputPaths, outputPath, runtimePath);
+    }
+
+    if (inputPaths.size() != 1) {
+        cerr << "-c and -S take a single source file.\n";
+        return 1;
+    }
+
+    try {
+        return Compile(inputPaths[0], outputPath, assemble, searchDirs);
+    } catch (const TCompileError &error) {
+        cerr << inputPaths[0] << ": " << error.what() << "\n";
+        return 1;
+    }
+}
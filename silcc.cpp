@@ -0,0 +1,166 @@
+// Client of the compile server, silcd.
+//
+// Build:
+//   g++ -std=c++17 -O2 silcc.cpp protocol.cpp -o silcc
+//
+// Usage:
+//   ./silcc [--socket PATH] -S [-o FILE.s] FILE.scm
+//   ./silcc [--socket PATH] [-o PROGRAM] FILE.scm
+//
+// -S writes the program's assembly to FILE.s, or to stdout with -o -.
+// Otherwise the server links the program, into a.out by default.
+
+#include "protocol.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+int Connect(const string &socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+
+    strcpy(address.sun_path, socketPath.c_str());
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (connection >= 0 &&
+        connect(connection, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) != 0) {
+        close(connection);
+        return -1;
+    }
+
+    return connection;
+}
+
+// The server doesn't share our working directory.
+string AbsolutePath(const string &path) {
+    if (!path.empty() && path[0] == '/') {
+        return path;
+    }
+
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        return path;
+    }
+
+    return string(cwd) + "/" + path;
+}
+
+string ReplaceExtension(const string &path, const string &extension) {
+    auto slash = path.find_last_of('/');
+    auto dot = path.find_last_of('.');
+
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return path + extension;
+    }
+
+    return path.substr(0, dot) + extension;
+}
+
+int main(int argc, char *argv[]) {
+    string socketPath = DefaultSocketPath();
+    bool emitAsm = false;
+    string outputPath;
+    string sourcePath;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--socket" && hasValue) {
+            socketPath = argv[++i];
+        } else if (arg == "-S") {
+            emitAsm = true;
+        } else if (arg == "-o" && hasValue) {
+            outputPath = argv[++i];
+        } else if (arg.size() > 0 && arg[0] == '-') {
+            cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        } else if (sourcePath.empty()) {
+            sourcePath = arg;
+        } else {
+            cerr << "silcc takes a single source file.\n";
+            return 1;
+        }
+    }
+
+    if (sourcePath.empty()) {
+        cerr << "No input file.\n";
+        return 1;
+    }
+
+    ifstream sourceFile(sourcePath);
+
+    if (!sourceFile.is_open()) {
+        cerr << "Cannot open " << sourcePath << ".\n";
+        return 1;
+    }
+
+    ostringstream sourceOS;
+    sourceOS << sourceFile.rdbuf();
+
+    if (outputPath.empty()) {
+        outputPath = emitAsm ? ReplaceExtension(sourcePath, ".s") : "a.out";
+    }
+
+    int connection = Connect(socketPath);
+
+    if (connection < 0) {
+        cerr << "Cannot connect to the compile server at " << socketPath
+             << ".\n";
+        return 1;
+    }
+
+    vector<string> response;
+    bool ok = SendFields(connection,
+                         {emitAsm ? "asm" : "binary",
+                          emitAsm ? "" : AbsolutePath(outputPath),
+                          sourceOS.str(), AbsolutePath(sourcePath)}) &&
+              ReceiveFields(connection, &response) && response.size() == 2;
+    close(connection);
+
+    if (!ok) {
+        cerr << "Lost the connection to the compile server.\n";
+        return 1;
+    }
+
+    if (response[0] != "ok") {
+        cerr << sourcePath << ": " << response[1] << "\n";
+        return 1;
+    }
+
+    if (!emitAsm) {
+        return 0;
+    }
+
+    if (outputPath == "-") {
+        cout << response[1];
+        return 0;
+    }
+
+    ofstream asmFile(outputPath);
+    asmFile << response[1];
+
+    if (!asmFile.good()) {
+        cerr << "Cannot write " << outputPath << ".\n";
+        return 1;
+    }
+
+    return 0;
+}
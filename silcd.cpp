@@ -0,0 +1,281 @@
+// Compile server. Keeps the compiler running between compilations, so that a
+// program compiles without the cost of starting a compiler, and keeps the code
+// emitted for top-level letrec lambdas in memory, so that recompiling a
+// program only emits the procedures that changed. Clients, like silcc, talk to
+// it over a Unix domain socket (see protocol.h).
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread silcd.cpp emit.cpp parse.cpp stats.cpp
+//       cache.cpp module.cpp threads.cpp peephole.cpp protocol.cpp -o silcd
+//
+// Usage:
+//   ./silcd [--socket PATH] [--workers N] [--cache-memory MB]
+//           [--cache-dir DIR] [--runtime PATH] [--safe]
+//
+// --workers: number of programs compiled at once, 4 by default.
+// --cache-memory: memory kept for emitted code, 64 MiB by default.
+// --cache-dir: also keep the emitted code in DIR, across server restarts.
+// --runtime: runtime linked into binaries, compiled once at startup; by
+//   default runtime.c next to the executable.
+// --safe: compile programs in safe mode (see EnableSafeMode).
+//
+// The server compiles plain programs; modules go through silc.
+
+#include "cache.h"
+#include "emit.h"
+#include "parse.h"
+#include "protocol.h"
+#include "threads.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Private directory holding the runtime's object and the assembly of the
+// programs being linked.
+static string gWorkDir;
+static string gRuntimeObjectPath;
+static atomic<long> gNumLinks(0);
+static volatile sig_atomic_t gStopping = 0;
+static sigset_t gStopSignals;
+
+string DirName(const string &path) {
+    auto slash = path.find_last_of('/');
+    return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+// The runtime that comes with the compiler, next to its executable.
+string DefaultRuntimePath() {
+    char exePath[4096];
+    auto size = readlink("/proc/self/exe", exePath, sizeof(exePath) - 1);
+
+    if (size <= 0) {
+        return "runtime.c";
+    }
+
+    return DirName(string(exePath, size)) + "/runtime.c";
+}
+
+// Runs a command without a shell, so that paths from clients are passed to it
+// as they are. Returns whether it exited with status 0.
+bool RunCommand(const vector<string> &args) {
+    vector<char *> argv;
+
+    for (const auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Workers block the stop signals, and the command would inherit that.
+        pthread_sigmask(SIG_UNBLOCK, &gStopSignals, nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return false;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+vector<string> Link(const string &code, const string &outputPath) {
+    if (outputPath.empty() || outputPath[0] != '/') {
+        return {"error", "Binaries need an absolute output path."};
+    }
+
+    auto asmPath = gWorkDir + "/" + to_string(gNumLinks++) + ".s";
+
+    {
+        ofstream asmFile(asmPath);
+        asmFile << code;
+
+        if (!asmFile.good()) {
+            return {"error", "Cannot write " + asmPath + "."};
+        }
+    }
+
+    bool linked =
+        RunCommand({"gcc", asmPath, gRuntimeObjectPath, "-o", outputPath});
+    unlink(asmPath.c_str());
+
+    if (!linked) {
+        return {"error", "Couldn't link " + outputPath + "."};
+    }
+
+    return {"ok", outputPath};
+}
+
+vector<string> HandleRequest(const vector<string> &request) {
+    const auto &mode = request[0];
+
+    if (mode != "asm" && mode != "binary") {
+        return {"error", "Unknown mode: " + mode + "."};
+    }
+
+    string code;
+
+    try {
+        code = EmitProgram(NormalizeSource(request[2]), request[3],
+                           request[2]);
+    } catch (const TCompileError &error) {
+        return {"error", error.what()};
+    }
+
+    if (mode == "asm") {
+        return {"ok", code};
+    }
+
+    return Link(code, request[1]);
+}
+
+void Serve(int connection) {
+    vector<string> request;
+
+    if (ReceiveFields(connection, &request) && request.size() == 4) {
+        SendFields(connection, HandleRequest(request));
+    }
+
+    close(connection);
+}
+
+void Stop(int) { gStopping = 1; }
+
+int Listen(const string &socketPath) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path too long: " << socketPath << "\n";
+        return -1;
+    }
+
+    strcpy(address.sun_path, socketPath.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno)
+             << "\n";
+        return -1;
+    }
+
+    return listener;
+}
+
+int main(int argc, char *argv[]) {
+    string socketPath = DefaultSocketPath();
+    string runtimePath = DefaultRuntimePath();
+    int numWorkers = 4;
+    long cacheMemoryMb = 64;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--socket" && hasValue) {
+            socketPath = argv[++i];
+        } else if (arg == "--workers" && hasValue) {
+            numWorkers = max(1, atoi(argv[++i]));
+        } else if (arg == "--cache-memory" && hasValue) {
+            cacheMemoryMb = atol(argv[++i]);
+        } else if (arg == "--cache-dir" && hasValue) {
+            EnableCompileCache(argv[++i]);
+        } else if (arg == "--runtime" && hasValue) {
+            runtimePath = argv[++i];
+        } else if (arg == "--safe") {
+            EnableSafeMode(true);
+        } else {
+            cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    EnableMemoryCompileCache(cacheMemoryMb << 20);
+
+    char workDirTemplate[] = "/tmp/silcd.XXXXXX";
+
+    if (mkdtemp(workDirTemplate) == nullptr) {
+        cerr << "Cannot create a work directory.\n";
+        return 1;
+    }
+
+    gWorkDir = workDirTemplate;
+    gRuntimeObjectPath = gWorkDir + "/runtime.o";
+    if (!RunCommand(
+            {"gcc", "-O2", "-c", runtimePath, "-o", gRuntimeObjectPath})) {
+        cerr << "Couldn't compile " << runtimePath << ".\n";
+        rmdir(gWorkDir.c_str());
+        return 1;
+    }
+
+    // Computed once; cache keys need it.
+    CompilerVersion();
+
+    int listener = Listen(socketPath);
+
+    if (listener < 0) {
+        unlink(gRuntimeObjectPath.c_str());
+        rmdir(gWorkDir.c_str());
+        return 1;
+    }
+
+    // Clients that hang up early mustn't take the server down, and accept
+    // must return on SIGINT and SIGTERM to clean up. Only the accepting thread
+    // takes those: the workers start with them blocked, since one that took
+    // them would leave accept waiting.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stopAction {};
+    stopAction.sa_handler = Stop;
+    sigaction(SIGINT, &stopAction, nullptr);
+    sigaction(SIGTERM, &stopAction, nullptr);
+    sigemptyset(&gStopSignals);
+    sigaddset(&gStopSignals, SIGINT);
+    sigaddset(&gStopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &gStopSignals, nullptr);
+
+    {
+        // The accepting thread doesn't compile, hence the extra thread.
+        TThreadPool pool(numWorkers + 1);
+        pthread_sigmask(SIG_UNBLOCK, &gStopSignals, nullptr);
+
+        while (!gStopping) {
+            int connection = accept(listener, nullptr, nullptr);
+
+            if (connection >= 0) {
+                pool.Post([connection]() { Serve(connection); });
+            } else if (errno != EINTR) {
+                cerr << "accept: " << strerror(errno) << "\n";
+                break;
+            }
+        }
+    }
+
+    close(listener);
+    unlink(socketPath.c_str());
+    unlink(gRuntimeObjectPath.c_str());
+    rmdir(gWorkDir.c_str());
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <malloc.h>
+#include <new>
+#include <sys/resource.h>
+
+using namespace std;
+
+//
+// Allocation accounting. Every operator new/delete in the process goes
+// through these counters, which are cheap enough to keep always on.
+//
+
+static atomic<long> gNumAllocs(0);
+static atomic<long> gAllocBytes(0);
+static atomic<long> gLiveBytes(0);
+static atomic<long> gPeakLiveBytes(0);
+
+void *operator new(size_t size) {
+    void *p = malloc(size == 0 ? 1 : size);
+
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+
+    auto usable = static_cast<long>(malloc_usable_size(p));
+    gNumAllocs.fetch_add(1, memory_order_relaxed);
+    gAllocBytes.fetch_add(usable, memory_order_relaxed);
+    auto live = gLiveBytes.fetch_add(usable, memory_order_relaxed) + usable;
+    auto peak = gPeakLiveBytes.load(memory_order_relaxed);
+
+    while (live > peak &&
+           !gPeakLiveBytes.compare_exchange_weak(peak, live,
+                                                 memory_order_relaxed)) {
+    }
+
+    return p;
+}
+
+// Not inlined: GCC would otherwise see the free() of memory the inlined
+// operator new got and warn of a mismatched deallocation.
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+    if (p == nullptr) {
+        return;
+    }
+
+    gLiveBytes.fetch_sub(static_cast<long>(malloc_usable_size(p)),
+                         memory_order_relaxed);
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+//
+// Phase timing. Each thread records its own phases, so that compilations
+// running concurrently don't mix theirs up.
+//
+
+static bool gPhaseTimingEnabled = false;
+static thread_local vector<TPhaseStats> gPhaseStats;
+static thread_local int gPhaseDepth = 0;
+
+TPhaseTimer::TPhaseTimer(string name) : enabled(gPhaseTimingEnabled) {
+    if (!enabled) {
+        return;
+    }
+
+    entryIdx = -1;
+
+    for (int i = 0; i < gPhaseStats.size(); ++i) {
+        if (gPhaseStats[i].name == name) {
+            entryIdx = i;
+        }
+    }
+
+    if (entryIdx == -1) {
+        gPhaseStats.push_back({name, gPhaseDepth, 0, false, 0, 0, 0, 0, 0});
+        entryIdx = gPhaseStats.size() - 1;
+    } else if (gPhaseStats[entryIdx].active) {
+        enabled = false;
+        return;
+    }
+
+    gPhaseStats[entryIdx].active = true;
+    ++gPhaseDepth;
+    startNumAllocs = gNumAllocs.load();
+    startAllocBytes = gAllocBytes.load();
+    outerPeakLiveBytes = gPeakLiveBytes.exchange(gLiveBytes.load());
+    start = chrono::steady_clock::now();
+}
+
+TPhaseTimer::~TPhaseTimer() {
+    if (!enabled) {
+        return;
+    }
+
+    auto wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                  start)
+                      .count();
+    auto peakLiveBytes = gPeakLiveBytes.load();
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    auto &entry = gPhaseStats[entryIdx];
+    entry.active = false;
+    ++entry.count;
+    entry.wallMs += wallMs;
+    entry.numAllocs += gNumAllocs.load() - startNumAllocs;
+    entry.allocBytes += gAllocBytes.load() - startAllocBytes;
+    entry.peakLiveBytes = max(entry.peakLiveBytes, peakLiveBytes);
+    entry.peakRssKb = usage.ru_maxrss;
+
+    // The enclosing phase's peak covers this one too.
+    gPeakLiveBytes.store(max(outerPeakLiveBytes, peakLiveBytes));
+    --gPhaseDepth;
+}
+
+void EnablePhaseTiming(bool enable) { gPhaseTimingEnabled = enable; }
+
+bool IsPhaseTimingEnabled() { return gPhaseTimingEnabled; }
+
+vector<TPhaseStats> TakePhaseStats() {
+    vector<TPhaseStats> stats;
+    stats.swap(gPhaseStats);
+    return stats;
+}
+
+void AddPhaseStats(const vector<TPhaseStats> &phaseStats) {
+    for (const auto &phase : phaseStats) {
+        auto entry = find_if(
+            gPhaseStats.begin(), gPhaseStats.end(),
+            [&](const TPhaseStats &p) { return p.name == phase.name; });
+
+        if (entry == gPhaseStats.end()) {
+            gPhaseStats.push_back(phase);
+            gPhaseStats.back().depth += gPhaseDepth;
+            continue;
+        }
+
+        entry->count += phase.count;
+        entry->wallMs += phase.wallMs;
+        entry->numAllocs += phase.numAllocs;
+        entry->allocBytes += phase.allocBytes;
+        entry->peakLiveBytes = max(entry->peakLiveBytes, phase.peakLiveBytes);
+        entry->peakRssKb = max(entry->peakRssKb, phase.peakRssKb);
+    }
+}
+
+//
+// Instruction counts.
+//
+
+static bool gInstructionStatsEnabled = false;
+static thread_local map<string, long> gInstructionStats;
+
+void EnableInstructionStats(bool enable) { gInstructionStatsEnabled = enable; }
+
+bool IsInstructionStatsEnabled() { return gInstructionStatsEnabled; }
+
+long CountAsmInstructions(const string &code) {
+    long count = 0;
+    size_t lineStart = 0;
+
+    while (lineStart < code.size()) {
+        auto lineEnd = code.find('\n', lineStart);
+
+        if (lineEnd == string::npos) {
+            lineEnd = code.size();
+        }
+
+        // Instructions are indented; labels aren't. Skip comments and
+        // directives.
+        auto first = code.find_first_not_of(' ', lineStart);
+
+        if (first > lineStart && first < lineEnd && code[first] != '#' &&
+            code[first] != '.') {
+            ++count;
+        }
+
+        lineStart = lineEnd + 1;
+    }
+
+    return count;
+}
+
+void AddInstructionCount(const string &kind, long count) {
+    gInstructionStats[kind] += count;
+}
+
+map<string, long> TakeInstructionStats() {
+    map<string, long> stats;
+    stats.swap(gInstructionStats);
+    return stats;
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+struct TPhaseStats {
+    std::string name;
+    // Nesting depth; phases are listed in the order they started.
+    int depth;
+    // Number of times the phase ran (e.g. once per hoisted lambda).
+    int count;
+    bool active;
+    double wallMs;
+    long numAllocs;
+    long allocBytes;
+    // Peak bytes live through operator new while the phase ran.
+    long peakLiveBytes;
+    // Peak resident set size of the process at the end of the phase.
+    long peakRssKb;
+};
+
+// Records the phase spanning its lifetime when phase timing is enabled. Phases
+// of the same name are merged into one entry; a phase nested in another run of
+// itself isn't counted twice.
+class TPhaseTimer {
+  public:
+    explicit TPhaseTimer(std::string name);
+    ~TPhaseTimer();
+
+  private:
+    bool enabled;
+    int entryIdx;
+    std::chrono::steady_clock::time_point start;
+    long startNumAllocs;
+    long startAllocBytes;
+    long outerPeakLiveBytes;
+};
+
+void EnablePhaseTiming(bool enable);
+bool IsPhaseTimingEnabled();
+// Returns the phases the calling thread recorded so far and starts over.
+std::vector<TPhaseStats> TakePhaseStats();
+// Adds the phases another thread recorded to the calling thread's, as if they
+// ran nested in its current phase. The times of phases that ran at once add
+// up.
+void AddPhaseStats(const std::vector<TPhaseStats> &phaseStats);
+
+void EnableInstructionStats(bool enable);
+bool IsInstructionStatsEnabled();
+// Number of instructions (not labels, directives or comments) in asm code.
+long CountAsmInstructions(const std::string &code);
+void AddInstructionCount(const std::string &kind, long count);
+// Returns the instruction counts per kind of expression the calling thread
+// emitted and starts over.
+std::map<std::string, long> TakeInstructionStats();
+
+#endif
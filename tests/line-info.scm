@@ -0,0 +1,13 @@
+; Compiled by line-info.sh, which checks that the line info points at the
+; lines and columns of the expressions below.
+(letrec ([add1 (lambda (x)
+                 ;; A comment and a blank line.
+
+                 (fx+ x 1))]
+         [f (lambda (n)
+              (if (fx= n 0)
+                  '(a "b\tc" #\;)
+                  (cons (add1 n)
+                        (f (fx- n 1)))))])
+  (cons 'x
+        (f 3)))
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Compiles line-info.scm, whose expressions span several lines, and checks
+# that the emitted line info points at their lines and columns.
+#
+# Usage:
+#   tests/line-info.sh PATH/TO/silc
+
+set -e
+
+dir=$(dirname "$0")
+asm=$(mktemp)
+trap 'rm -f "$asm"' EXIT
+"$1" -S -o "$asm" "$dir/line-info.scm"
+
+# The add1 lambda, the sum after the comment, the quoted list, the recursive
+# call's argument and the call in the body.
+for loc in "3 16" "6 18" "9 19" "11 28" "13 9"; do
+    if ! grep -q "^    \.loc 1 $loc\$" "$asm"; then
+        echo "line-info.sh: no .loc 1 $loc"
+        exit 1
+    fi
+done
+
+echo "line-info.sh: OK"
@@ -0,0 +1,19 @@
+(add-tests-with-string-output "lifted lambdas and shadowing"
+  [(let ([f (lambda (y) y)]) (let ([f (lambda (z) (f (fx+ z 1)))]) (f 1))) => "2\n"]
+  [(let ([x 1]) (let ([x 2] [g (lambda () x)]) (g))) => "1\n"]
+  [(let ([x 1]) (let* ([x 2] [g (lambda () x)]) (g))) => "2\n"]
+)
+
+(add-tests-with-string-output "symbol->string and changing the name"
+  [(let ([s (symbol->string (string->symbol "abc"))])
+     (begin (string-set! s 0 #\z) (string->symbol "abc"))) => "abc\n"]
+  [(let ([s (symbol->string (string->symbol "abc"))])
+     (begin (string-set! s 0 #\z) s)) => "\"zbc\"\n"]
+  [(symbol->string 'abc) => "\"abc\"\n"]
+)
+
+(add-tests-with-string-output "make-vector of wide literal lengths"
+  [(if #f (let ([v (make-vector 99999999999999)]) 1) 2) => "2\n"]
+  [(let ([v (make-vector 16)]) (vector-length v)) => "16\n"]
+  [(let ([v (make-vector 17)]) (vector-length v)) => "17\n"]
+)
@@ -0,0 +1,10 @@
+; Run with --safe.
+
+(add-tests-with-string-output "make-vector and make-string lengths"
+  [(let ([v (make-vector -1)]) (begin (vector-set! v 5000 5) (vector-ref v 5000))) => "error: length -1 is negative\n"]
+  [(make-vector -1) => "error: length -1 is negative\n"]
+  [(make-string -5) => "error: length -5 is negative\n"]
+  [(letrec ([f (lambda (n) (make-string n))]) (f -3)) => "error: length -3 is negative\n"]
+  [(letrec ([f (lambda (n) (make-vector n))]) (vector-length (f 3))) => "3\n"]
+  [(string-length (make-string 0)) => "0\n"]
+)
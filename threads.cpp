@@ -0,0 +1,149 @@
+#include "threads.h"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+
+struct TThreadPool::TBatch {
+    const function<void(int)> *task;
+    // The task of a posted batch, which outlives the call that posted it.
+    function<void(int)> postedTask;
+    int numTasks;
+    atomic<int> nextTask{0};
+    // Guarded by the pool's mutex.
+    int numDone = 0;
+    exception_ptr firstException;
+    condition_variable done;
+};
+
+TThreadPool::TThreadPool(int numThreads) {
+    for (int i = 1; i < numThreads; ++i) {
+        workers.emplace_back([this]() { RunWorker(); });
+    }
+}
+
+TThreadPool::~TThreadPool() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    hasWork.notify_all();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+int TThreadPool::RunTasks(TBatch *batch, exception_ptr *outException) {
+    int numRun = 0;
+
+    for (auto i = batch->nextTask++; i < batch->numTasks;
+         i = batch->nextTask++) {
+        try {
+            (*batch->task)(i);
+        } catch (...) {
+            if (*outException == nullptr) {
+                *outException = current_exception();
+            }
+        }
+
+        ++numRun;
+    }
+
+    return numRun;
+}
+
+void TThreadPool::ParallelFor(int numTasks, const function<void(int)> &task) {
+    if (workers.empty() || numTasks <= 1) {
+        for (int i = 0; i < numTasks; ++i) {
+            task(i);
+        }
+
+        return;
+    }
+
+    auto batch = make_shared<TBatch>();
+    batch->task = &task;
+    batch->numTasks = numTasks;
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        batches.push_back(batch);
+    }
+
+    hasWork.notify_all();
+    exception_ptr exception;
+    auto numRun = RunTasks(batch.get(), &exception);
+
+    unique_lock<std::mutex> lock(mutex);
+    auto queued = find(batches.begin(), batches.end(), batch);
+
+    if (queued != batches.end()) {
+        batches.erase(queued);
+    }
+
+    batch->numDone += numRun;
+    batch->done.wait(lock, [&]() { return batch->numDone == numTasks; });
+
+    if (exception == nullptr) {
+        exception = batch->firstException;
+    }
+
+    if (exception != nullptr) {
+        rethrow_exception(exception);
+    }
+}
+
+void TThreadPool::Post(function<void()> task) {
+    if (workers.empty()) {
+        task();
+        return;
+    }
+
+    auto batch = make_shared<TBatch>();
+    batch->postedTask = [task](int) { task(); };
+    batch->task = &batch->postedTask;
+    batch->numTasks = 1;
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        batches.push_back(batch);
+    }
+
+    hasWork.notify_one();
+}
+
+void TThreadPool::RunWorker() {
+    unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        hasWork.wait(lock, [this]() { return stopping || !batches.empty(); });
+
+        if (stopping) {
+            return;
+        }
+
+        auto batch = batches.front();
+        lock.unlock();
+        exception_ptr exception;
+        auto numRun = RunTasks(batch.get(), &exception);
+        lock.lock();
+
+        // All of its tasks are started by now.
+        if (!batches.empty() && batches.front() == batch) {
+            batches.pop_front();
+        }
+
+        batch->numDone += numRun;
+
+        if (batch->firstException == nullptr) {
+            batch->firstException = exception;
+        }
+
+        if (batch->numDone == batch->numTasks) {
+            batch->done.notify_all();
+        }
+    }
+}
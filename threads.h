@@ -0,0 +1,47 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running tasks. The thread calling ParallelFor runs
+// tasks too, so a pool of N threads has N - 1 workers.
+class TThreadPool {
+  public:
+    explicit TThreadPool(int numThreads);
+    ~TThreadPool();
+
+    int NumThreads() const { return workers.size() + 1; }
+
+    // Runs task(0) ... task(numTasks - 1) and returns once all of them are
+    // done, rethrowing the first exception a task threw. Several threads can
+    // call it at once, but tasks can't.
+    void ParallelFor(int numTasks, const std::function<void(int)> &task);
+
+    // Runs the task on one of the workers, without waiting for it, or right
+    // away without workers. The task must not throw.
+    void Post(std::function<void()> task);
+
+  private:
+    struct TBatch;
+
+    // Runs the batch's tasks until all of them are started and returns how
+    // many it ran, keeping the first exception thrown.
+    static int RunTasks(TBatch *batch, std::exception_ptr *outException);
+    void RunWorker();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable hasWork;
+    // Batches which may still have tasks to start, oldest first.
+    std::deque<std::shared_ptr<TBatch>> batches;
+    bool stopping = false;
+};
+
+#endif